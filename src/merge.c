@@ -0,0 +1,81 @@
+#include "sf3_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]){
+  if(argc<3){
+    fprintf(stderr, "Usage: %s [OPTION...] OUTPUT LOG...\n", argv[0]);
+    fprintf(stderr, "Merge the entries of several SF3 logs into OUTPUT, ordered by time.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -c, --chunk-size N         write chunks of N bytes\n");
+    fprintf(stderr, "  -e, --chunk-entries N      write chunks of up to N entries\n");
+    fprintf(stderr, "      --no-verify            do not check the logs' checksums first\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Report bugs to https://shirakumo.org/projects/libsf3/\n");
+    return 0;
+  }
+  size_t chunk_size = 0;
+  uint32_t chunk_entries = 0;
+  char verify = 1;
+  ++argv; --argc;
+  while(0 < argc && argv[0][0] == '-'){
+    if((strcmp(argv[0], "-c") == 0 || strcmp(argv[0], "--chunk-size") == 0) && 1 < argc){
+      chunk_size = (size_t)strtoull(argv[1], 0, 10);
+      argv += 2; argc -= 2;
+    }else if((strcmp(argv[0], "-e") == 0 || strcmp(argv[0], "--chunk-entries") == 0) && 1 < argc){
+      chunk_entries = (uint32_t)strtoul(argv[1], 0, 10);
+      argv += 2; argc -= 2;
+    }else if(strcmp(argv[0], "--no-verify") == 0){
+      verify = 0;
+      ++argv; --argc;
+    }else{
+      fprintf(stderr, "Unknown option: %s\n", argv[0]);
+      return 1;
+    }
+  }
+  if(argc < 2){
+    fprintf(stderr, "Expected an output file and at least one log.\n");
+    return 1;
+  }
+
+  int count = argc-1;
+  sf3_handle *handles = calloc(count, sizeof(sf3_handle));
+  const struct sf3_log **logs = calloc(count, sizeof(struct sf3_log *));
+  if(!handles || !logs){
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  int ok = 1, opened = 0;
+  for(; ok && opened<count; ++opened){
+    const char *path = argv[opened+1];
+    size_t size;
+    int type = sf3_open(path, SF3_OPEN_READ_ONLY, &handles[opened]);
+    if(type == 0){
+      fprintf(stderr, "Failed to open %s: %s\n", path, sf3_strerror(-1));
+      ok = 0;
+      break;
+    }
+    logs[opened] = sf3_data(handles[opened], &size);
+    if(type != SF3_FORMAT_ID_LOG){
+      fprintf(stderr, "%s is not a log\n", path);
+      ok = 0;
+    }else if(verify && !sf3_verify_parallel(logs[opened], size, 0)){
+      fprintf(stderr, "%s is corrupted: the CRC32 checksum does not match\n", path);
+      ok = 0;
+    }else{
+      // Each log is read front to back exactly once.
+      sf3_advise(handles[opened], 0, size, SF3_ADVISE_SEQUENTIAL);
+    }
+  }
+  if(ok && !sf3_log_merge(logs, count, argv[0], chunk_size, chunk_entries)){
+    fprintf(stderr, "Failed to write %s: %s\n", argv[0], sf3_strerror(-1));
+    ok = 0;
+  }
+  for(int i=0; i<opened; ++i){
+    if(handles[i]) sf3_close(handles[i]);
+  }
+  free(logs);
+  free(handles);
+  return !ok;
+}
@@ -0,0 +1,282 @@
+#include "sf3_lib.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct member{
+  // The path relative to the packed directory, which is also the
+  // path within the archive.
+  char *path;
+  const char *mime_type;
+  int64_t modtime;
+  uint64_t size;
+  void *data;
+  sf3_crc32_checksum checksum;
+  // Zero while the member is still being read, one once it is ready
+  // to be written, and -1 if it could not be read.
+  int state;
+};
+
+struct pack{
+  const char *root;
+  struct member *members;
+  size_t count;
+  size_t capacity;
+  // The next member to be read by a worker.
+  size_t next;
+  // The number of members the writer has consumed.
+  size_t done;
+  // How far the workers may run ahead of the writer, which bounds
+  // the number of files held open at once.
+  size_t window;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+  pthread_cond_t room;
+};
+
+static const char *guess_mime_type(const char *path){
+  size_t length = strlen(path);
+  for(int type=1; type<256; ++type){
+    const char *suffix = sf3_file_type(type);
+    if(strcmp(suffix, "sf3") == 0) continue;
+    size_t suffix_length = strlen(suffix);
+    if(suffix_length < length
+       && path[length-suffix_length-1] == '.'
+       && strcmp(path+length-suffix_length, suffix) == 0)
+      return sf3_mime_type(type);
+  }
+  if(4 < length && strcmp(path+length-4, ".sf3") == 0)
+    return sf3_mime_type(0);
+  return "application/octet-stream";
+}
+
+static int add_member(struct pack *pack, const char *path, const struct stat *stat){
+  if(pack->count == pack->capacity){
+    size_t capacity = (pack->capacity)? pack->capacity*2 : 1024;
+    struct member *members = realloc(pack->members, capacity*sizeof(struct member));
+    if(!members) return 0;
+    pack->members = members;
+    pack->capacity = capacity;
+  }
+  struct member *member = &pack->members[pack->count];
+  memset(member, 0, sizeof(struct member));
+  member->path = strdup(path);
+  if(!member->path) return 0;
+  member->mime_type = guess_mime_type(path);
+  member->modtime = stat->st_mtime;
+  member->size = stat->st_size;
+  pack->count++;
+  return 1;
+}
+
+// Collects all regular files below the root. Symbolic links are not
+// followed.
+static int collect(struct pack *pack, char *path, size_t length){
+  char full[4096];
+  snprintf(full, sizeof(full), "%s%s%s", pack->root, (length)? "/" : "", path);
+  DIR *dir = opendir(full);
+  if(!dir){
+    fprintf(stderr, "Failed to open %s: %s\n", full, strerror(errno));
+    return 0;
+  }
+  int ok = 1;
+  struct dirent *entry;
+  while(ok && (entry = readdir(dir))){
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+    size_t name_length = strlen(entry->d_name);
+    if(4096 <= length+name_length+2){
+      fprintf(stderr, "Path too long: %s/%s\n", full, entry->d_name);
+      ok = 0;
+      break;
+    }
+    size_t sublength = length;
+    if(length) path[sublength++] = '/';
+    memcpy(path+sublength, entry->d_name, name_length+1);
+    sublength += name_length;
+    struct stat stat;
+    if(fstatat(dirfd(dir), entry->d_name, &stat, AT_SYMLINK_NOFOLLOW) != 0){
+      fprintf(stderr, "Failed to stat %s/%s: %s\n", full, entry->d_name, strerror(errno));
+      ok = 0;
+    }else if(S_ISDIR(stat.st_mode)){
+      ok = collect(pack, path, sublength);
+    }else if(S_ISREG(stat.st_mode)){
+      if(!add_member(pack, path, &stat)){
+        fprintf(stderr, "Out of memory\n");
+        ok = 0;
+      }
+    }
+    path[length] = 0;
+  }
+  closedir(dir);
+  return ok;
+}
+
+static int compare_members(const void *a, const void *b){
+  return strcmp(((const struct member *)a)->path, ((const struct member *)b)->path);
+}
+
+static int load_member(struct pack *pack, struct member *member){
+  char full[8192];
+  snprintf(full, sizeof(full), "%s/%s", pack->root, member->path);
+  int fd = open(full, O_RDONLY);
+  if(fd < 0){
+    fprintf(stderr, "Failed to open %s: %s\n", full, strerror(errno));
+    return 0;
+  }
+  // The file may have changed since we looked at it.
+  struct stat stat;
+  if(fstat(fd, &stat) == 0){
+    member->size = stat.st_size;
+    member->modtime = stat.st_mtime;
+  }
+  if(0 < member->size){
+    member->data = mmap(0, member->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(member->data == MAP_FAILED){
+      fprintf(stderr, "Failed to map %s: %s\n", full, strerror(errno));
+      member->data = 0;
+      close(fd);
+      return 0;
+    }
+    madvise(member->data, member->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  member->checksum = sf3_compute_checksum(member->data, member->size);
+  return 1;
+}
+
+static void *worker(void *data){
+  struct pack *pack = (struct pack *)data;
+  pthread_mutex_lock(&pack->mutex);
+  while(pack->next < pack->count){
+    if(pack->window <= pack->next - pack->done){
+      pthread_cond_wait(&pack->room, &pack->mutex);
+      continue;
+    }
+    struct member *member = &pack->members[pack->next++];
+    pthread_mutex_unlock(&pack->mutex);
+    int state = load_member(pack, member)? 1 : -1;
+    pthread_mutex_lock(&pack->mutex);
+    member->state = state;
+    pthread_cond_broadcast(&pack->ready);
+  }
+  pthread_mutex_unlock(&pack->mutex);
+  return 0;
+}
+
+static int write_members(struct pack *pack, sf3_archive_builder builder){
+  for(size_t i=0; i<pack->count; ++i){
+    struct member *member = &pack->members[i];
+    pthread_mutex_lock(&pack->mutex);
+    while(member->state == 0)
+      pthread_cond_wait(&pack->ready, &pack->mutex);
+    pthread_mutex_unlock(&pack->mutex);
+    int ok = (0 < member->state)
+      && sf3_archive_builder_add_checksummed(builder, member->path, member->mime_type, member->modtime,
+                                             (member->data)? member->data : "", member->size, member->checksum);
+    if(member->state == 1 && !ok)
+      fprintf(stderr, "Failed to add %s: %s\n", member->path, sf3_strerror(-1));
+    if(member->data) munmap(member->data, member->size);
+    member->data = 0;
+    pthread_mutex_lock(&pack->mutex);
+    pack->done++;
+    // Stop the workers early if we are not going to finish anyway.
+    if(!ok) pack->next = pack->count;
+    pthread_cond_broadcast(&pack->room);
+    pthread_mutex_unlock(&pack->mutex);
+    if(!ok) return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[]){
+  if(argc<3){
+    fprintf(stderr, "Usage: %s [OPTION...] ARCHIVE DIRECTORY\n", argv[0]);
+    fprintf(stderr, "Pack all files below DIRECTORY into an SF3 archive.\n");
+    fprintf(stderr, "Members are stored in sorted path order, and symbolic links are skipped.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -j, --jobs N               read files on N threads\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Report bugs to https://shirakumo.org/projects/libsf3/\n");
+    return 0;
+  }
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  ++argv; --argc;
+  while(0 < argc && argv[0][0] == '-'){
+    if((strcmp(argv[0], "-j") == 0 || strcmp(argv[0], "--jobs") == 0) && 1 < argc){
+      threads = atol(argv[1]);
+      argv += 2; argc -= 2;
+    }else{
+      fprintf(stderr, "Unknown option: %s\n", argv[0]);
+      return 1;
+    }
+  }
+  if(argc != 2){
+    fprintf(stderr, "Expected an archive and a directory.\n");
+    return 1;
+  }
+  if(threads < 1) threads = 1;
+
+  struct pack pack = {0};
+  pack.root = argv[1];
+  pack.window = threads*4;
+  char path[4096] = {0};
+  if(!collect(&pack, path, 0)) return 1;
+  qsort(pack.members, pack.count, sizeof(struct member), compare_members);
+
+  // We know all entries up front, so we can reserve exactly the
+  // space the tables need.
+  size_t reserve = sizeof(struct sf3_archive);
+  for(size_t i=0; i<pack.count; ++i){
+    reserve += 3*sizeof(uint64_t) + sizeof(sf3_crc32_checksum)
+      + sizeof(uint8_t) + strlen(pack.members[i].mime_type)+1
+      + sizeof(uint16_t) + strlen(pack.members[i].path)+1;
+  }
+  sf3_archive_builder builder;
+  if(!sf3_archive_builder_create(argv[0], reserve, 0, &builder)){
+    fprintf(stderr, "Failed to create %s: %s\n", argv[0], sf3_strerror(-1));
+    return 1;
+  }
+
+  pthread_mutex_init(&pack.mutex, 0);
+  pthread_cond_init(&pack.ready, 0);
+  pthread_cond_init(&pack.room, 0);
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  long started = 0;
+  while(workers && started < threads && pthread_create(&workers[started], 0, worker, &pack) == 0)
+    ++started;
+  int ok = (0 < started);
+  if(!ok){
+    fprintf(stderr, "Failed to start worker threads\n");
+    pack.next = pack.count;
+  }
+  ok = ok && write_members(&pack, builder);
+  for(long i=0; i<started; ++i)
+    pthread_join(workers[i], 0);
+  // Workers may have mapped files past the point where we stopped.
+  for(size_t i=0; i<pack.count; ++i){
+    if(pack.members[i].data) munmap(pack.members[i].data, pack.members[i].size);
+    free(pack.members[i].path);
+  }
+  free(pack.members);
+  free(workers);
+  pthread_cond_destroy(&pack.room);
+  pthread_cond_destroy(&pack.ready);
+  pthread_mutex_destroy(&pack.mutex);
+
+  if(!ok){
+    sf3_archive_builder_abort(builder);
+    return 1;
+  }
+  if(!sf3_archive_builder_finish(builder)){
+    fprintf(stderr, "Failed to write %s: %s\n", argv[0], sf3_strerror(-1));
+    return 1;
+  }
+  return 0;
+}
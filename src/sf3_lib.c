@@ -1,16 +1,43 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #if defined(_WIN32)
 #include <windows.h>
+#include <io.h>
 #elif defined(HAVE_MMAN_H)
 #include <sys/mman.h>
 #endif
 #if defined(HAVE_STAT_H)
 #include <sys/stat.h>
 #endif
+#if !defined(_WIN32) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(HAVE_XATTR_H) && defined(__linux__)
+#include <sys/xattr.h>
+#define HAVE_XATTR 1
+#endif
+#if defined(HAVE_INOTIFY_H) && defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#else
+#undef HAVE_INOTIFY_H
+#endif
+#if defined(HAVE_IO_URING_H) && defined(HAVE_STAT_H)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#else
+#undef HAVE_IO_URING_H
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SIMD_SEARCH 1
+#endif
 #include "sf3_lib.h"
 
 #ifndef thread_local
@@ -28,6 +55,23 @@
 # endif
 #endif
 
+#define VERIFY_MIN_BLOCK (1024*1024)
+#define WRITE_CHUNK_SIZE (256*1024)
+
+// The handle and verification caches identify files by their inode,
+// which we can only get reliably through stat.
+#if defined(HAVE_STAT_H) && !defined(_WIN32)
+#define HAVE_HANDLE_CACHE 1
+#define HAVE_VERIFY_CACHE 1
+#endif
+
+struct dirty_range{
+  size_t start;
+  size_t end;
+  /// The linear CRC32 of the range's original contents.
+  uint32_t crc;
+};
+
 struct handle{
   enum sf3_open_mode mode;
 #if defined(_WIN32)
@@ -38,10 +82,179 @@ struct handle{
 #endif
   size_t size;
   void *addr;
+  struct dirty_range *dirty;
+  size_t dirty_count;
+  size_t dirty_capacity;
+  size_t dirty_size;
+  int dirty_overflow;
+  /// The cache this handle is shared through, if any.
+  struct handle_cache *cache;
+  /// The allocator the handle and its buffers come from.
+  struct sf3_allocator allocator;
+  /// Which archive members have been verified, and with what result.
+  /// Allocated on first use.
+  uint64_t *verified;
+  /// The handle whose memory this one aliases, if any.
+  struct handle *parent;
+  /// The number of references besides the one of the handle's owner,
+  /// held by the handles that alias its memory.
+  uint32_t refs;
 };
 
 thread_local enum sf3_error err = SF3_OK;
 
+// Allocator contexts without an allocate function use the global
+// allocation functions.
+static void *allocator_calloc(const struct sf3_allocator *allocator, size_t num, size_t size){
+  if(allocator && allocator->allocate) return allocator->allocate(allocator->user, num*size, 1);
+  return sf3_calloc(num, size);
+}
+
+static void *allocator_malloc(const struct sf3_allocator *allocator, size_t size){
+  if(allocator && allocator->allocate) return allocator->allocate(allocator->user, size, 0);
+  return sf3_malloc(size);
+}
+
+static void allocator_free(const struct sf3_allocator *allocator, void *ptr){
+  if(allocator && allocator->allocate){
+    if(allocator->release) allocator->release(allocator->user, ptr);
+  }else{
+    sf3_free(ptr);
+  }
+}
+
+#define atomic_load(PTR) __atomic_load_n(PTR, __ATOMIC_ACQUIRE)
+#define atomic_store(PTR, VAL) __atomic_store_n(PTR, VAL, __ATOMIC_RELEASE)
+#define atomic_fetch_add(PTR, VAL) __atomic_fetch_add(PTR, VAL, __ATOMIC_ACQ_REL)
+#define atomic_fetch_or(PTR, VAL) __atomic_fetch_or(PTR, VAL, __ATOMIC_ACQ_REL)
+#define atomic_compare_exchange(PTR, EXPECTED, VAL) __atomic_compare_exchange_n(PTR, EXPECTED, VAL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#if defined(_WIN32)
+#define HAVE_THREADS 1
+typedef HANDLE thread_t;
+typedef SRWLOCK mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define mutex_init(M) InitializeSRWLock(M)
+#define mutex_destroy(M)
+#define mutex_lock(M) AcquireSRWLockExclusive(M)
+#define mutex_unlock(M) ReleaseSRWLockExclusive(M)
+#define cond_init(C) InitializeConditionVariable(C)
+#define cond_destroy(C)
+#define cond_wait(C, M) SleepConditionVariableSRW(C, M, INFINITE, 0)
+#define cond_signal(C) WakeConditionVariable(C)
+#define cond_broadcast(C) WakeAllConditionVariable(C)
+
+struct thread_start_data{
+  void *(*fn)(void *);
+  void *arg;
+};
+
+static DWORD WINAPI thread_trampoline(LPVOID data){
+  struct thread_start_data start = *(struct thread_start_data *)data;
+  sf3_free(data);
+  start.fn(start.arg);
+  return 0;
+}
+
+static int thread_start(thread_t *thread, void *(*fn)(void *), void *arg){
+  struct thread_start_data *data = (struct thread_start_data *)sf3_calloc(1, sizeof(struct thread_start_data));
+  if(!data) return 0;
+  data->fn = fn;
+  data->arg = arg;
+  *thread = CreateThread(NULL, 0, thread_trampoline, data, 0, NULL);
+  if(*thread == NULL){
+    sf3_free(data);
+    return 0;
+  }
+  return 1;
+}
+
+static void thread_join(thread_t thread){
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+#elif defined(HAVE_PTHREAD_H)
+#define HAVE_THREADS 1
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define mutex_init(M) pthread_mutex_init(M, NULL)
+#define mutex_destroy(M) pthread_mutex_destroy(M)
+#define mutex_lock(M) pthread_mutex_lock(M)
+#define mutex_unlock(M) pthread_mutex_unlock(M)
+#define cond_init(C) pthread_cond_init(C, NULL)
+#define cond_destroy(C) pthread_cond_destroy(C)
+#define cond_wait(C, M) pthread_cond_wait(C, M)
+#define cond_signal(C) pthread_cond_signal(C)
+#define cond_broadcast(C) pthread_cond_broadcast(C)
+
+static int thread_start(thread_t *thread, void *(*fn)(void *), void *arg){
+  return pthread_create(thread, NULL, fn, arg) == 0;
+}
+
+static void thread_join(thread_t thread){
+  pthread_join(thread, NULL);
+}
+#endif
+
+static unsigned int cpu_count(){
+#if defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (info.dwNumberOfProcessors < 1)? 1 : info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return (count < 1)? 1 : (unsigned int)count;
+#else
+  return 1;
+#endif
+}
+
+struct parallel_job{
+  size_t next;
+  size_t count;
+  void (*fn)(size_t index, void *data);
+  void *data;
+};
+
+static void parallel_work(struct parallel_job *job){
+  for(;;){
+    size_t index = atomic_fetch_add(&job->next, 1);
+    if(job->count <= index) break;
+    job->fn(index, job->data);
+  }
+}
+
+static void *parallel_thread(void *job){
+  parallel_work((struct parallel_job *)job);
+  return 0;
+}
+
+// Calls FN for every index below COUNT, distributed over up to
+// THREADS threads including the calling one. The threads are started
+// for each call rather than kept in a pool, so callers should only
+// use this for enough work to pay for that. If threads cannot be
+// created, the remaining work is simply done on the calling thread.
+static void parallel_for(unsigned int threads, size_t count, void (*fn)(size_t index, void *data), void *data){
+  struct parallel_job job = {0, count, fn, data};
+  if(threads == 0) threads = cpu_count();
+  if(count < threads) threads = (unsigned int)count;
+  if(threads > 64) threads = 64;
+#if defined(HAVE_THREADS)
+  thread_t workers[64];
+  unsigned int started = 0;
+  for(; started+1<threads; ++started){
+    if(!thread_start(&workers[started], parallel_thread, &job)) break;
+  }
+  parallel_work(&job);
+  for(unsigned int i=0; i<started; ++i){
+    thread_join(workers[i]);
+  }
+#else
+  parallel_work(&job);
+#endif
+}
+
 SF3_EXPORT enum sf3_error sf3_error(){
   return err;
 }
@@ -63,21 +276,69 @@ SF3_EXPORT const char *sf3_strerror(enum sf3_error error){
     return "Failed to write file.";
   case SF3_INVALID_FILE:
     return "Not a valid SF3 file.";
+  case SF3_ADVISE_FAILED:
+    return "Failed to apply the memory access advice.";
+  case SF3_INVALID_SECTION:
+    return "The section does not exist in this file.";
+  case SF3_CHECKSUM_MISMATCH:
+    return "The CRC32 checksum of the file does not match.";
+  case SF3_INVALID_ARGUMENT:
+    return "An argument is outside of the permitted range.";
   default:
     return "Unknown error";
   }
 }
 
 SF3_EXPORT int sf3_tell(const char *path){
-  void *handle;
-  if(!sf3_open(path, SF3_OPEN_READ_ONLY, &handle)){
+  err = SF3_OK;
+  struct sf3_identifier identifier;
+  // We only need the identifier, so read just that rather than
+  // mapping in the whole file.
+#if defined(_WIN32)
+  HANDLE fd = CreateFile(path, GENERIC_READ,
+                         FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if(fd == INVALID_HANDLE_VALUE){
+    err = SF3_OPEN_FAILED;
     return 0;
   }
-  size_t size;
-  void *addr = sf3_data(handle, &size);
-  int res = sf3_check(addr, size);
-  sf3_close(handle);
-  return res;
+  DWORD length = 0;
+  if(!ReadFile(fd, &identifier, sizeof(identifier), &length, NULL)) length = 0;
+  CloseHandle(fd);
+#else
+  int fd = open(path, O_RDONLY);
+  if(fd == -1){
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  ssize_t length = pread(fd, &identifier, sizeof(identifier), 0);
+  close(fd);
+#endif
+  if(length < (ssize_t)sizeof(identifier)){
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+  int type = sf3_check(&identifier, sizeof(identifier));
+  if(!type) err = SF3_INVALID_FILE;
+  return type;
+}
+
+struct tell_job{
+  const char **paths;
+  int *ids;
+  size_t found;
+};
+
+static void tell_file(size_t index, void *data){
+  struct tell_job *job = (struct tell_job *)data;
+  job->ids[index] = sf3_tell(job->paths[index]);
+  if(job->ids[index]) atomic_fetch_add(&job->found, 1);
+}
+
+SF3_EXPORT size_t sf3_tell_many(const char **paths, size_t count, int *ids, unsigned int threads){
+  struct tell_job job = {paths, ids, 0};
+  parallel_for(threads, count, tell_file, &job);
+  return job.found;
 }
 
 static ssize_t file_size(int fd){
@@ -99,87 +360,113 @@ static ssize_t file_size(int fd){
 #endif
 }
 
-SF3_EXPORT int sf3_open(const char *path, enum sf3_open_mode mode, sf3_handle *handle){
-  err = SF3_OK;
-  struct handle *h = (struct handle *)sf3_calloc(1, sizeof(struct handle));
-  if(!h){
-    err = SF3_OUT_OF_MEMORY;
-    return 0;
+static int advise(void *addr, size_t size, enum sf3_advice advice){
+#if defined(_WIN32)
+  switch(advice){
+  case SF3_ADVISE_LOCK: return VirtualLock(addr, size);
+  case SF3_ADVISE_UNLOCK: return VirtualUnlock(addr, size);
+  default: return 1;
   }
+#elif defined(HAVE_MMAN_H)
+  switch(advice){
+  case SF3_ADVISE_NORMAL: return madvise(addr, size, MADV_NORMAL) == 0;
+  case SF3_ADVISE_SEQUENTIAL: return madvise(addr, size, MADV_SEQUENTIAL) == 0;
+  case SF3_ADVISE_RANDOM: return madvise(addr, size, MADV_RANDOM) == 0;
+  case SF3_ADVISE_WILLNEED: return madvise(addr, size, MADV_WILLNEED) == 0;
+  case SF3_ADVISE_DONTNEED: return madvise(addr, size, MADV_DONTNEED) == 0;
+#ifdef MADV_HUGEPAGE
+  case SF3_ADVISE_HUGEPAGE: return madvise(addr, size, MADV_HUGEPAGE) == 0;
+#endif
+  case SF3_ADVISE_LOCK: return mlock(addr, size) == 0;
+  case SF3_ADVISE_UNLOCK: return munlock(addr, size) == 0;
+  default: return 1;
+  }
+#else
+  return 1;
+#endif
+}
 
-#if defined(_WIN32)
-  h->fd = CreateFile(path,
-                     ((mode)? GENERIC_WRITE : 0) | GENERIC_READ,
-                     FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE,
-                     NULL, OPEN_EXISTING, 0, NULL);
+static void close_handle(struct handle *h);
 
-  if(h->fd == INVALID_HANDLE_VALUE){
-    err = SF3_OPEN_FAILED;
-    goto cleanup;
+// Discards the results of member verification after the contents of
+// the handle changed.
+static void forget_verified(struct handle *h){
+  uint64_t *verified = atomic_load(&h->verified);
+  if(verified){
+    atomic_store(&h->verified, (uint64_t *)0);
+    sf3_free(verified);
   }
+}
 
+// Maps the file behind the handle's descriptor into memory. On
+// failure the handle's resources are released, but the handle itself
+// is not.
+static int map_handle(struct handle *h, enum sf3_open_mode mode){
+  enum sf3_open_mode writable = mode & SF3_OPEN_READ_WRITE;
+#if defined(_WIN32)
   LARGE_INTEGER size;
   if(!GetFileSizeEx(h->fd, &size)){
     err = SF3_OPEN_FAILED;
     goto cleanup;
   }
 
-  h->mode = mode;
+  h->mode = writable;
   h->size = size.QuadPart;
-  h->handle = CreateFileMapping(h->fd, NULL, (mode)? PAGE_READWRITE : PAGE_READONLY,
+  h->handle = CreateFileMapping(h->fd, NULL, (writable)? PAGE_READWRITE : PAGE_READONLY,
                                 h->size >> 32, h->size, NULL);
-  h->addr = MapViewOfFile(h->handle, (mode)? FILE_MAP_WRITE : FILE_MAP_READ,
+  h->addr = MapViewOfFile(h->handle, (writable)? FILE_MAP_WRITE : FILE_MAP_READ,
                           0, 0, h->size);
   if(!h->addr){
     err = SF3_MMAP_FAILED;
     goto cleanup;
   }
+  if(mode & SF3_OPEN_LOCK) advise(h->addr, h->size, SF3_ADVISE_LOCK);
 #elif defined(HAVE_MMAN_H)
-  h->fd = open(path, (mode)? O_RDWR : O_RDONLY);
-  
-  if(h->fd == -1){
-    err = SF3_OPEN_FAILED;
-    goto cleanup;
-  }
-  
   ssize_t size = file_size(h->fd);
   if(size < 0){
     err = SF3_OPEN_FAILED;
     goto cleanup;
   }
 
-  h->mode = mode;
+  h->mode = writable;
   h->size = size;
+  int flags = (writable)? MAP_SHARED : MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  if(mode & SF3_OPEN_POPULATE) flags |= MAP_POPULATE;
+#endif
   h->addr = mmap(NULL, h->size,
-                 (mode)? (PROT_READ | PROT_WRITE) : PROT_READ,
-                 (mode)? MAP_SHARED : MAP_PRIVATE,
-                 h->fd, 0);
+                 (writable)? (PROT_READ | PROT_WRITE) : PROT_READ,
+                 flags, h->fd, 0);
   if(h->addr == MAP_FAILED){
     err = SF3_MMAP_FAILED;
     goto cleanup;
   }
+  // The access hints are best-effort, so we don't fail if they can't
+  // be applied.
+  if(mode & SF3_OPEN_SEQUENTIAL) advise(h->addr, h->size, SF3_ADVISE_SEQUENTIAL);
+  if(mode & SF3_OPEN_RANDOM) advise(h->addr, h->size, SF3_ADVISE_RANDOM);
+  if(mode & SF3_OPEN_HUGEPAGES) advise(h->addr, h->size, SF3_ADVISE_HUGEPAGE);
+#ifndef MAP_POPULATE
+  if(mode & SF3_OPEN_POPULATE) advise(h->addr, h->size, SF3_ADVISE_WILLNEED);
+#endif
+  if(mode & SF3_OPEN_LOCK) advise(h->addr, h->size, SF3_ADVISE_LOCK);
 #else
-  h->fd = open(path, (mode)? O_RDWR : O_RDONLY);
-  
-  if(h->fd == -1){
-    err = SF3_OPEN_FAILED;
-    goto cleanup;
-  }
-
   ssize_t size = file_size(h->fd);
   if(size < 0){
     err = SF3_OPEN_FAILED;
     goto cleanup;
   }
 
-  h->mode = mode;
+  h->mode = writable;
   h->size = size;
-  h->addr = sf3_calloc(1, h->size);
+  // The buffer is overwritten by the read right away, so there is no
+  // point in clearing it first.
+  h->addr = allocator_malloc(&h->allocator, h->size);
   if(h->addr == NULL){
     err = SF3_MMAP_FAILED;
     goto cleanup;
   }
-  if(read(h->fd, h->addr, h->size) < h->size){
+  if(pread(h->fd, h->addr, h->size, 0) < (ssize_t)h->size){
     err = SF3_MMAP_FAILED;
     goto cleanup;
   }
@@ -190,149 +477,4385 @@ SF3_EXPORT int sf3_open(const char *path, enum sf3_open_mode mode, sf3_handle *h
     err = SF3_INVALID_FILE;
     goto cleanup;
   }
-
-  *handle = h;
   return type;
   
  cleanup:
-  sf3_close(h);
+  close_handle(h);
   return 0;
 }
 
-SF3_EXPORT void sf3_close(sf3_handle handle){
-  struct handle *h = (struct handle *)handle;
-  if(h){
+// Opens the file into an already allocated, zeroed handle.
+static int open_handle(struct handle *h, const char *path, enum sf3_open_mode mode){
+  enum sf3_open_mode writable = mode & SF3_OPEN_READ_WRITE;
 #if defined(_WIN32)
-    if(h->addr != NULL){
-      UnmapViewOfFile(h->addr);
-    }
-    if(h->handle != INVALID_HANDLE_VALUE){
-      CloseHandle(h->handle);
-    }
-    if(h->fd != INVALID_HANDLE_VALUE){
-      CloseHandle(h->fd);
-    }
-    h->handle = INVALID_HANDLE_VALUE;
-    h->fd = INVALID_HANDLE_VALUE;
-    h->addr = NULL;
-#elif defined(HAVE_MMAN_H)
-    if(h->addr != MAP_FAILED){
-      munmap(h->addr, h->size);
-    }
-    if(0 <= h->fd){
-      close(h->fd);
-    }
-    h->fd = -1;
-    h->addr = MAP_FAILED;
+  h->fd = CreateFile(path,
+                     ((writable)? GENERIC_WRITE : 0) | GENERIC_READ,
+                     FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE,
+                     NULL, OPEN_EXISTING, 0, NULL);
+  if(h->fd == INVALID_HANDLE_VALUE){
+    err = SF3_OPEN_FAILED;
+    close_handle(h);
+    return 0;
+  }
 #else
-    if(h->addr){
-      sf3_free(h->addr);
-    }
-    if(0 <= h->fd){
-      close(h->fd);
-    }
-    h->fd = -1;
-    h->addr = NULL;
-#endif
-    h->mode = 0;
-    h->size = 0;
-    sf3_free(h);
+  h->fd = open(path, (writable)? O_RDWR : O_RDONLY);
+  if(h->fd == -1){
+    err = SF3_OPEN_FAILED;
+    close_handle(h);
+    return 0;
   }
+#endif
+  return map_handle(h, mode);
 }
 
-SF3_EXPORT void *sf3_data(sf3_handle handle, size_t *size){
+SF3_EXPORT int sf3_open_with(const char *path, enum sf3_open_mode mode, const struct sf3_allocator *allocator, sf3_handle *handle){
   err = SF3_OK;
-  struct handle *h = (struct handle *)handle;
-  if(h){
-    if(size) *size = h->size;
-    return h->addr;
+  struct handle *h = (struct handle *)allocator_calloc(allocator, 1, sizeof(struct handle));
+  if(!h){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
   }
-  err = SF3_INVALID_HANDLE;
+  if(allocator) h->allocator = *allocator;
+  int type = open_handle(h, path, mode);
+  if(!type){
+    allocator_free(allocator, h);
+    return 0;
+  }
+  *handle = h;
+  return type;
+}
+
+SF3_EXPORT int sf3_open(const char *path, enum sf3_open_mode mode, sf3_handle *handle){
+  return sf3_open_with(path, mode, 0, handle);
+}
+
+// Whether the file behind the descriptor can never change again.
+static int fd_sealed(int fd){
+#if defined(F_GET_SEALS)
+  int seals = fcntl(fd, F_GET_SEALS);
+  return seals != -1 && (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) == (F_SEAL_WRITE | F_SEAL_SHRINK);
+#else
   return 0;
+#endif
 }
 
-SF3_EXPORT int sf3_create(void *addr, size_t size, sf3_handle *handle){
-  err = SF3_OK;
+// Maps the file behind a duplicate of FD into a fresh handle.
+static int map_fd(int fd, enum sf3_open_mode mode, struct handle **handle){
   struct handle *h = (struct handle *)sf3_calloc(1, sizeof(struct handle));
   if(!h){
     err = SF3_OUT_OF_MEMORY;
-    return -1;
+    return 0;
   }
-  h->mode = SF3_OPEN_READ_WRITE;
 #if defined(_WIN32)
-  h->fd = NULL;
-  h->handle = NULL;
+  HANDLE source = (HANDLE)_get_osfhandle(fd);
+  if(source == INVALID_HANDLE_VALUE
+     || !DuplicateHandle(GetCurrentProcess(), source, GetCurrentProcess(), &h->fd, 0, FALSE, DUPLICATE_SAME_ACCESS)){
+    err = SF3_OPEN_FAILED;
+    sf3_free(h);
+    return 0;
+  }
 #else
-  h->fd = -1;
+  h->fd = dup(fd);
+  if(h->fd == -1){
+    err = SF3_OPEN_FAILED;
+    sf3_free(h);
+    return 0;
+  }
 #endif
-  h->size = size;
-  h->addr = addr;
+  int type = map_handle(h, mode);
+  if(!type){
+    sf3_free(h);
+    return 0;
+  }
   *handle = h;
-  return 1;
+  return type;
 }
 
-SF3_EXPORT int sf3_write(const char *path, sf3_handle handle){
+SF3_EXPORT int sf3_open_fd(int fd, enum sf3_open_mode mode, sf3_handle *handle){
   err = SF3_OK;
-  struct handle *h = (struct handle *)handle;
-  struct sf3_identifier *id = (struct sf3_identifier *)h->addr;
-  if(h->size < sizeof(struct sf3_identifier)){
-    err = SF3_INVALID_HANDLE;
-    return 0;
-  }else if(!path){
+  struct handle *h;
+  int type = map_fd(fd, mode, &h);
+  if(!type) return 0;
 #if defined(_WIN32)
-    if(h->mode == SF3_OPEN_READ_WRITE && h->fd != NULL){
-      size_t size = sf3_size(id);
-      sf3_write_header(id->format_id, h->addr, size);
-      FlushViewOfFile(h->addr, h->size);
-      return FlushFileBuffers(h->fd);
-#elif defined(HAVE_MMAN_H)
-    if(h->mode == SF3_OPEN_READ_WRITE && h->fd != -1){
-      size_t size = sf3_size(id);
-      sf3_write_header(id->format_id, h->addr, size);
-      return msync(h->addr, h->size, MS_SYNC) == 0;
+  int sealed = 0;
 #else
-    if(h->mode == SF3_OPEN_READ_WRITE && h->fd != -1){
-      size_t size = sf3_size(id);
-      sf3_write_header(id->format_id, h->addr, size);
-      if(lseek(h->fd, 0, SEEK_SET) == (off_t) -1){
-        err = SF3_WRITE_FAILED;
-        return 0;
-      }
-      if(write(h->fd, h->addr, size) < size){
-        err = SF3_WRITE_FAILED;
-        return 0;
-      }
-      fsync(h->fd);
-      return 1;
+  int sealed = fd_sealed(h->fd);
 #endif
-    }else{
-      return 0;
-    }
-  }else{
-    struct sf3_identifier header;
-    const void *payload = ((const uint8_t*)h->addr+sizeof(struct sf3_identifier));
-    size_t size = sf3_size(id);
-    
-    int fd = open(path, O_WRONLY | O_CREAT, 0644);
-    if(fd == -1){
-      err = SF3_OPEN_FAILED;
-      return 0;
-    }
-    sf3_write_header(id->format_id, &header, size);
-    write(fd, &header, sizeof(struct sf3_identifier));
-    size -= sizeof(struct sf3_identifier);
-    if(write(fd, payload, size) < size){
-      err = SF3_WRITE_FAILED;
-      close(fd);
+  // Seals say nothing about whether the sender wrote the header right,
+  // so the contents must still fit into the file.
+  size_t size = sf3_size((const struct sf3_identifier *)h->addr);
+  if(sealed && h->size < size){
+    err = SF3_INVALID_FILE;
+    sf3_close(h);
+    return 0;
+  }
+  // If the sender sealed the file, nobody can have changed it since
+  // its checksum was written, so there's no need to check it again.
+  if(!sealed){
+    if(h->size < size || !sf3_verify_parallel(h->addr, size, 0)){
+      err = SF3_CHECKSUM_MISMATCH;
+      sf3_close(h);
       return 0;
     }
-    ftruncate(fd, size);
-    close(fd);
-    return 1;
   }
+  *handle = h;
+  return type;
+}
+
+SF3_EXPORT int sf3_fd(sf3_handle handle){
+  struct handle *h = (struct handle *)handle;
+#if defined(_WIN32)
+  return -1;
+#else
+  return (h)? h->fd : -1;
+#endif
+}
+
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+static int shared_fd(){
+  int fd;
+#if defined(HAVE_MEMFD_CREATE)
+  fd = memfd_create("sf3", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd != -1) return fd;
+#endif
+  // Without memfd, fall back to an unlinked temporary file. It can't
+  // be sealed, so receivers will verify it in full.
+  char path[] = "/tmp/sf3-XXXXXX";
+  fd = mkstemp(path);
+  if(fd != -1) unlink(path);
+  return fd;
+}
+#endif
+
+SF3_EXPORT int sf3_create_shared(size_t size, sf3_handle *handle){
+  err = SF3_OK;
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+  if(size < sizeof(struct sf3_identifier)){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  struct handle *h = (struct handle *)sf3_calloc(1, sizeof(struct handle));
+  if(!h){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  h->addr = MAP_FAILED;
+  h->fd = shared_fd();
+  if(h->fd == -1){
+    err = SF3_OPEN_FAILED;
+    goto cleanup;
+  }
+  if(ftruncate(h->fd, size) != 0){
+    err = SF3_WRITE_FAILED;
+    goto cleanup;
+  }
+  h->mode = SF3_OPEN_READ_WRITE;
+  h->size = size;
+  h->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+  if(h->addr == MAP_FAILED){
+    err = SF3_MMAP_FAILED;
+    goto cleanup;
+  }
+  *handle = h;
+  return 1;
+
+ cleanup:
+  sf3_close(h);
+  return 0;
+#else
+  err = SF3_OPEN_FAILED;
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_seal(sf3_handle handle){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+  if(!h || h->mode != SF3_OPEN_READ_WRITE || h->fd == -1 || atomic_load(&h->refs) != 0){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  struct sf3_identifier *id = (struct sf3_identifier *)h->addr;
+  int type = sf3_check(h->addr, h->size);
+  size_t size = (type)? sf3_size(id) : 0;
+  if(!type || h->size < size){
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+  sf3_write_header(type, h->addr, size);
+  h->dirty_count = 0;
+  h->dirty_overflow = 0;
+
+  // Sealing against writes fails while writable mappings exist, so
+  // drop ours and map the file again read-only after.
+  munmap(h->addr, h->size);
+  h->addr = MAP_FAILED;
+  h->mode = SF3_OPEN_READ_ONLY;
+  if(size < h->size && ftruncate(h->fd, size) == 0)
+    h->size = size;
+#if defined(F_ADD_SEALS)
+  fcntl(h->fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+  h->addr = mmap(NULL, h->size, PROT_READ, MAP_SHARED, h->fd, 0);
+  if(h->addr == MAP_FAILED){
+    err = SF3_MMAP_FAILED;
+    return 0;
+  }
+  return type;
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+static void close_handle(struct handle *h){
+#if defined(_WIN32)
+  if(h->addr != NULL){
+    UnmapViewOfFile(h->addr);
+  }
+  if(h->handle != INVALID_HANDLE_VALUE){
+    CloseHandle(h->handle);
+  }
+  if(h->fd != INVALID_HANDLE_VALUE){
+    CloseHandle(h->fd);
+  }
+  h->handle = INVALID_HANDLE_VALUE;
+  h->fd = INVALID_HANDLE_VALUE;
+  h->addr = NULL;
+#elif defined(HAVE_MMAN_H)
+  if(0 <= h->fd && h->addr != MAP_FAILED){
+    munmap(h->addr, h->size);
+  }
+  if(0 <= h->fd){
+    close(h->fd);
+  }
+  h->fd = -1;
+  h->addr = MAP_FAILED;
+#else
+  if(0 <= h->fd && h->addr){
+    allocator_free(&h->allocator, h->addr);
+  }
+  if(0 <= h->fd){
+    close(h->fd);
+  }
+  h->fd = -1;
+  h->addr = NULL;
+#endif
+  if(h->dirty){
+    allocator_free(&h->allocator, h->dirty);
+  }
+  forget_verified(h);
+  h->mode = 0;
+  h->size = 0;
+}
+
+#if defined(HAVE_HANDLE_CACHE)
+struct cache_entry;
+static void cache_release(struct cache_entry *entry);
+#endif
+
+SF3_EXPORT void sf3_close(sf3_handle handle){
+  struct handle *h = (struct handle *)handle;
+#if defined(HAVE_HANDLE_CACHE)
+  if(h && h->cache){
+    cache_release((struct cache_entry *)h);
+    return;
+  }
+#endif
+  // Handles aliasing this one keep it alive, so only the last
+  // reference actually closes it.
+  if(h && atomic_fetch_add(&h->refs, -1) == 0){
+    struct handle *parent = h->parent;
+    struct sf3_allocator allocator = h->allocator;
+    close_handle(h);
+    allocator_free(&allocator, h);
+    if(parent) sf3_close(parent);
+  }
+}
+
+SF3_EXPORT void *sf3_data(sf3_handle handle, size_t *size){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  if(h){
+    if(size) *size = h->size;
+    return h->addr;
+  }
+  err = SF3_INVALID_HANDLE;
+  return 0;
+}
+
+SF3_EXPORT int sf3_advise(sf3_handle handle, size_t offset, size_t length, enum sf3_advice advice){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  if(!h){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  if(h->size <= offset) return 1;
+  if(h->size - offset < length) length = h->size - offset;
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+  // madvise requires a page-aligned start address.
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)h->addr + offset;
+  length += start & (page-1);
+  start &= ~(uintptr_t)(page-1);
+  if(!advise((void *)start, length, advice)){
+#else
+  if(!advise(((uint8_t *)h->addr)+offset, length, advice)){
+#endif
+    err = SF3_ADVISE_FAILED;
+    return 0;
+  }
+  return 1;
+}
+
+SF3_EXPORT int sf3_section_range(const void *addr, size_t size, enum sf3_section section, uint64_t first, uint64_t count, size_t *offset, size_t *length){
+  err = SF3_OK;
+  const uint8_t *base = (const uint8_t *)addr;
+  const uint8_t *start = 0, *end = 0;
+  int type = sf3_check(addr, size);
+  if(!type){
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+  switch(section){
+  case SF3_SECTION_ALL:
+    start = base;
+    end = base+size;
+    break;
+  case SF3_SECTION_ARCHIVE_METADATA:
+  case SF3_SECTION_ARCHIVE_FILES: {
+    if(type != SF3_FORMAT_ID_ARCHIVE) break;
+    const struct sf3_archive *archive = (const struct sf3_archive *)addr;
+    const uint8_t *offsets = (const uint8_t *)archive->entry_offset + archive->metadata_size;
+    if(section == SF3_SECTION_ARCHIVE_METADATA){
+      start = (const uint8_t *)archive->entry_offset;
+      end = offsets;
+      break;
+    }
+    if(archive->count <= first) break;
+    if(archive->count - first < count) count = archive->count - first;
+    // Members are normally laid out in order, but nothing requires
+    // them to be, so find the extent of the requested ones.
+    start = end = (const uint8_t *)sf3_archive_file(archive, first);
+    for(uint64_t i=first; i<first+count; ++i){
+      const struct sf3_file *file = sf3_archive_file(archive, i);
+      const uint8_t *file_end = (const uint8_t *)file->data + file->length;
+      if((const uint8_t *)file < start) start = (const uint8_t *)file;
+      if(end < file_end) end = file_end;
+    }
+    break;
+  }
+  case SF3_SECTION_LOG_CHUNKS: {
+    if(type != SF3_FORMAT_ID_LOG) break;
+    const struct sf3_log *log = (const struct sf3_log *)addr;
+    if(log->chunk_count <= first) break;
+    if(log->chunk_count - first < count) count = log->chunk_count - first;
+    const struct sf3_log_chunk *chunk = &log->chunks[0];
+    for(uint64_t i=0; i<first; ++i){
+      chunk = sf3_log_next_chunk(chunk);
+    }
+    start = (const uint8_t *)chunk;
+    for(uint64_t i=0; i<count; ++i){
+      chunk = sf3_log_next_chunk(chunk);
+    }
+    end = (const uint8_t *)chunk;
+    break;
+  }
+  case SF3_SECTION_MODEL_FACES:
+  case SF3_SECTION_MODEL_VERTICES: {
+    if(type != SF3_FORMAT_ID_MODEL) break;
+    const struct sf3_model *model = (const struct sf3_model *)addr;
+    if(section == SF3_SECTION_MODEL_FACES){
+      const struct sf3_faces *faces = sf3_model_faces(model);
+      start = (const uint8_t *)faces;
+      end = (const uint8_t *)(faces->faces + faces->count);
+    }else{
+      const struct sf3_vertices *vertices = sf3_model_vertices(model);
+      start = (const uint8_t *)vertices;
+      end = (const uint8_t *)(vertices->vertices + vertices->count);
+    }
+    break;
+  }
+  case SF3_SECTION_TABLE_SPEC:
+  case SF3_SECTION_TABLE_ROWS: {
+    if(type != SF3_FORMAT_ID_TABLE) break;
+    const struct sf3_table *table = (const struct sf3_table *)addr;
+    if(section == SF3_SECTION_TABLE_SPEC){
+      start = (const uint8_t *)table->columns;
+      end = (const uint8_t *)sf3_table_data(table);
+      break;
+    }
+    if(table->row_count <= first) break;
+    if(table->row_count - first < count) count = table->row_count - first;
+    start = (const uint8_t *)sf3_table_row(table, first);
+    end = start + table->row_length * count;
+    break;
+  }
+  default:
+    break;
+  }
+  if(!start || end < start || start < base || base+size < end){
+    err = SF3_INVALID_SECTION;
+    return 0;
+  }
+  *offset = start-base;
+  *length = end-start;
+  return 1;
+}
+
+SF3_EXPORT int sf3_prefetch(sf3_handle handle, enum sf3_section section, uint64_t first, uint64_t count){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  size_t offset, length;
+  if(!h){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  if(!sf3_section_range(h->addr, h->size, section, first, count, &offset, &length))
+    return 0;
+  return sf3_advise(handle, offset, length, SF3_ADVISE_WILLNEED);
+}
+
+// Changes the size of the file and its mapping to exactly SIZE bytes.
+static int resize_handle(struct handle *h, size_t size){
+  if(size == h->size) return 1;
+  forget_verified(h);
+#if defined(_WIN32)
+  LARGE_INTEGER end;
+  end.QuadPart = size;
+  UnmapViewOfFile(h->addr);
+  CloseHandle(h->handle);
+  h->addr = NULL;
+  h->handle = INVALID_HANDLE_VALUE;
+  if(!SetFilePointerEx(h->fd, end, NULL, FILE_BEGIN) || !SetEndOfFile(h->fd)){
+    err = SF3_WRITE_FAILED;
+    // Try to restore the previous mapping.
+    size = h->size;
+  }
+  h->handle = CreateFileMapping(h->fd, NULL, PAGE_READWRITE, size >> 32, size, NULL);
+  if(h->handle) h->addr = MapViewOfFile(h->handle, FILE_MAP_WRITE, 0, 0, size);
+  if(!h->addr){
+    if(h->handle) CloseHandle(h->handle);
+    h->handle = INVALID_HANDLE_VALUE;
+    h->size = 0;
+    err = SF3_MMAP_FAILED;
+    return 0;
+  }
+  h->size = size;
+  return err == SF3_OK;
+#elif defined(HAVE_MMAN_H)
+  if(h->size < size){
+#if defined(HAVE_FALLOCATE)
+    // Allocate the blocks up front so that writing to the mapping
+    // cannot fault later if the disk is full.
+    if(fallocate(h->fd, 0, 0, size) != 0){
+      if(errno == ENOSPC || ftruncate(h->fd, size) != 0){
+        err = SF3_WRITE_FAILED;
+        return 0;
+      }
+    }
+#else
+    if(ftruncate(h->fd, size) != 0){
+      err = SF3_WRITE_FAILED;
+      return 0;
+    }
+#endif
+  }
+#if defined(MREMAP_MAYMOVE)
+  void *addr = mremap(h->addr, h->size, size, MREMAP_MAYMOVE);
+  if(addr == MAP_FAILED){
+    err = SF3_MMAP_FAILED;
+    return 0;
+  }
+#else
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+  if(addr == MAP_FAILED){
+    err = SF3_MMAP_FAILED;
+    return 0;
+  }
+  munmap(h->addr, h->size);
+#endif
+  // Only cut the file down once nothing maps the tail anymore.
+  if(size < h->size && ftruncate(h->fd, size) != 0){
+    err = SF3_WRITE_FAILED;
+  }
+  h->addr = addr;
+  h->size = size;
+  return err == SF3_OK;
+#else
+  uint8_t *addr = (uint8_t *)allocator_malloc(&h->allocator, size);
+  if(!addr){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  if(size < h->size){
+    memcpy(addr, h->addr, size);
+  }else{
+    memcpy(addr, h->addr, h->size);
+    memset(addr+h->size, 0, size-h->size);
+  }
+  if(ftruncate(h->fd, size) != 0){
+    allocator_free(&h->allocator, addr);
+    err = SF3_WRITE_FAILED;
+    return 0;
+  }
+  allocator_free(&h->allocator, h->addr);
+  h->addr = addr;
+  h->size = size;
+  return 1;
+#endif
+}
+
+static int check_resizable(struct handle *h, size_t size){
+  if(!h){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+#if defined(_WIN32)
+  int owned = h->fd != NULL && h->fd != INVALID_HANDLE_VALUE;
+#else
+  int owned = 0 <= h->fd;
+#endif
+  // Moving the memory would pull it out from under aliasing handles.
+  if(!owned || h->mode != SF3_OPEN_READ_WRITE || size < sizeof(struct sf3_identifier)
+     || atomic_load(&h->refs) != 0){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  return 1;
+}
+
+SF3_EXPORT int sf3_reserve(sf3_handle handle, size_t capacity){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  if(!check_resizable(h, capacity)) return 0;
+  if(capacity <= h->size) return 1;
+  return resize_handle(h, capacity);
+}
+
+SF3_EXPORT int sf3_resize(sf3_handle handle, size_t size){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  if(!check_resizable(h, size)) return 0;
+  // Dirty ranges past the new end can no longer be accounted for, so
+  // fall back to a full checksum on the next write.
+  for(size_t i=0; i<h->dirty_count; ++i){
+    if(size < h->dirty[i].end) h->dirty_overflow = 1;
+  }
+  return resize_handle(h, size);
+}
+
+SF3_EXPORT int sf3_create(void *addr, size_t size, sf3_handle *handle){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)sf3_calloc(1, sizeof(struct handle));
+  if(!h){
+    err = SF3_OUT_OF_MEMORY;
+    return -1;
+  }
+  h->mode = SF3_OPEN_READ_WRITE;
+#if defined(_WIN32)
+  h->fd = NULL;
+  h->handle = NULL;
+#else
+  h->fd = -1;
+#endif
+  h->size = size;
+  h->addr = addr;
+  *handle = h;
+  return 1;
+}
+
+// The raw CRC32 of a block without pre- or post-conditioning. Unlike
+// the regular checksum this is linear: the difference between the
+// checksums of two equally long files only depends on the XOR of
+// their contents, which is what allows updating a checksum by only
+// looking at the bytes that changed.
+static uint32_t linear_crc(const uint8_t *addr, size_t size){
+  return sf3_crc32_kernel_update(SF3_CRC32_AUTO, 0, addr, size);
+}
+
+static uint32_t linear_crc_shift(uint32_t crc, size_t length){
+  return sf3_crc32_multiply(sf3_crc32_shift_factor(length), crc);
+}
+
+SF3_EXPORT int sf3_mark_dirty(sf3_handle handle, size_t offset, size_t length){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  if(!h || h->mode != SF3_OPEN_READ_WRITE || h->size < sizeof(struct sf3_identifier)){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  forget_verified(h);
+  if(h->dirty_overflow) return 1;
+
+  const uint8_t *addr = (const uint8_t *)h->addr;
+  if(h->dirty_count == 0) h->dirty_size = sf3_size((const struct sf3_identifier *)addr);
+  size_t start = offset;
+  size_t end = offset+length;
+  if(end < start || h->dirty_size < end) end = h->dirty_size;
+  if(start < sizeof(struct sf3_identifier)) start = sizeof(struct sf3_identifier);
+  if(end <= start) return 1;
+
+  // Merge all ranges we overlap or touch into one, whose original
+  // contents are those of the existing ranges, and the current
+  // contents everywhere else.
+  for(size_t i=0; i<h->dirty_count; ++i){
+    struct dirty_range *range = &h->dirty[i];
+    if(range->start <= end && start <= range->end){
+      if(range->start < start) start = range->start;
+      if(end < range->end) end = range->end;
+    }
+  }
+  uint32_t crc = linear_crc(addr+start, end-start);
+  for(size_t i=0; i<h->dirty_count;){
+    struct dirty_range *range = &h->dirty[i];
+    if(start <= range->start && range->end <= end){
+      uint32_t change = linear_crc(addr+range->start, range->end-range->start) ^ range->crc;
+      crc ^= linear_crc_shift(change, end-range->end);
+      *range = h->dirty[--h->dirty_count];
+    }else{
+      ++i;
+    }
+  }
+
+  if(h->dirty_count == h->dirty_capacity){
+    size_t capacity = (h->dirty_capacity)? h->dirty_capacity*2 : 16;
+    struct dirty_range *dirty = (struct dirty_range *)allocator_calloc(&h->allocator, capacity, sizeof(struct dirty_range));
+    if(!dirty){
+      // We can still fall back to recomputing the whole checksum.
+      h->dirty_overflow = 1;
+      return 1;
+    }
+    if(h->dirty){
+      memcpy(dirty, h->dirty, h->dirty_count*sizeof(struct dirty_range));
+      allocator_free(&h->allocator, h->dirty);
+    }
+    h->dirty = dirty;
+    h->dirty_capacity = capacity;
+  }
+  h->dirty[h->dirty_count].start = start;
+  h->dirty[h->dirty_count].end = end;
+  h->dirty[h->dirty_count].crc = crc;
+  h->dirty_count++;
+  return 1;
+}
+
+static void reset_dirty(struct handle *h){
+  h->dirty_count = 0;
+  h->dirty_overflow = 0;
+}
+
+static int write_all(int fd, const void *addr, size_t size){
+  const uint8_t *data = (const uint8_t *)addr;
+  while(0 < size){
+    ssize_t written = write(fd, data, size);
+    if(written <= 0) return 0;
+    data += written;
+    size -= written;
+  }
+  return 1;
+}
+
+static int flush_range(struct handle *h, size_t start, size_t end){
+#if defined(_WIN32)
+  return FlushViewOfFile(((uint8_t *)h->addr)+start, end-start);
+#elif defined(HAVE_MMAN_H)
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  start &= ~(page-1);
+  return msync(((uint8_t *)h->addr)+start, end-start, MS_SYNC) == 0;
+#else
+  if(lseek(h->fd, start, SEEK_SET) == (off_t) -1) return 0;
+  return write_all(h->fd, ((uint8_t *)h->addr)+start, end-start);
+#endif
+}
+
+// Updates the checksum and flushes only the ranges marked through
+// sf3_mark_dirty, rather than going over the entire file.
+static int write_dirty(struct handle *h){
+  struct sf3_identifier *id = (struct sf3_identifier *)h->addr;
+  const uint8_t *addr = (const uint8_t *)h->addr;
+  uint32_t change = 0;
+  for(size_t i=0; i<h->dirty_count; ++i){
+    struct dirty_range *range = &h->dirty[i];
+    uint32_t crc = linear_crc(addr+range->start, range->end-range->start) ^ range->crc;
+    change ^= linear_crc_shift(crc, h->dirty_size-range->end);
+  }
+  sf3_write_identifier(id->format_id, id->checksum ^ change, id);
+
+  int ok = flush_range(h, 0, sizeof(struct sf3_identifier));
+  for(size_t i=0; i<h->dirty_count; ++i){
+    if(!flush_range(h, h->dirty[i].start, h->dirty[i].end)) ok = 0;
+  }
+  reset_dirty(h);
+#if defined(_WIN32)
+  if(ok) ok = FlushFileBuffers(h->fd);
+#elif !defined(HAVE_MMAN_H)
+  if(ok) fsync(h->fd);
+#endif
+  if(!ok) err = SF3_WRITE_FAILED;
+  return ok;
+}
+
+SF3_EXPORT int sf3_write(const char *path, sf3_handle handle){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  struct sf3_identifier *id = (struct sf3_identifier *)h->addr;
+  if(h->size < sizeof(struct sf3_identifier)){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }else if(!path){
+#if defined(_WIN32)
+    if(h->mode == SF3_OPEN_READ_WRITE && h->fd != NULL){
+      size_t size = sf3_size(id);
+      if(h->dirty_count && !h->dirty_overflow && size == h->dirty_size)
+        return write_dirty(h);
+      reset_dirty(h);
+      sf3_write_header(id->format_id, h->addr, size);
+      FlushViewOfFile(h->addr, h->size);
+      return FlushFileBuffers(h->fd);
+#elif defined(HAVE_MMAN_H)
+    if(h->mode == SF3_OPEN_READ_WRITE && h->fd != -1){
+      size_t size = sf3_size(id);
+      if(h->dirty_count && !h->dirty_overflow && size == h->dirty_size)
+        return write_dirty(h);
+      reset_dirty(h);
+      sf3_write_header(id->format_id, h->addr, size);
+      return msync(h->addr, h->size, MS_SYNC) == 0;
+#else
+    if(h->mode == SF3_OPEN_READ_WRITE && h->fd != -1){
+      size_t size = sf3_size(id);
+      if(h->dirty_count && !h->dirty_overflow && size == h->dirty_size)
+        return write_dirty(h);
+      reset_dirty(h);
+      sf3_write_header(id->format_id, h->addr, size);
+      if(lseek(h->fd, 0, SEEK_SET) == (off_t) -1){
+        err = SF3_WRITE_FAILED;
+        return 0;
+      }
+      if(write(h->fd, h->addr, size) < size){
+        err = SF3_WRITE_FAILED;
+        return 0;
+      }
+      fsync(h->fd);
+      return 1;
+#endif
+    }else{
+      return 0;
+    }
+  }else{
+    struct sf3_identifier header = {0};
+    struct sf3_crc32_state crc;
+    const uint8_t *payload = ((const uint8_t*)h->addr+sizeof(struct sf3_identifier));
+    size_t size = sf3_size(id);
+    
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if(fd == -1){
+      err = SF3_OPEN_FAILED;
+      return 0;
+    }
+    // Checksum the payload in chunks as we copy it out, so that every
+    // chunk is only pulled through the cache once. The header is then
+    // filled in at the end.
+    sf3_crc32_init(&crc);
+    if(!write_all(fd, &header, sizeof(struct sf3_identifier)))
+      goto fail;
+    for(size_t offset=sizeof(struct sf3_identifier); offset<size; offset+=WRITE_CHUNK_SIZE){
+      size_t chunk = size-offset;
+      if(WRITE_CHUNK_SIZE < chunk) chunk = WRITE_CHUNK_SIZE;
+      sf3_crc32_update(&crc, payload+offset-sizeof(struct sf3_identifier), chunk);
+      if(!write_all(fd, payload+offset-sizeof(struct sf3_identifier), chunk))
+        goto fail;
+    }
+    sf3_write_identifier(id->format_id, sf3_crc32_final(&crc), &header);
+    if(lseek(fd, 0, SEEK_SET) == (off_t) -1)
+      goto fail;
+    if(!write_all(fd, &header, sizeof(struct sf3_identifier)))
+      goto fail;
+    if(ftruncate(fd, size) != 0)
+      goto fail;
+    close(fd);
+    return 1;
+
+  fail:
+    err = SF3_WRITE_FAILED;
+    close(fd);
+    return 0;
+  }
+}
+
+#if !defined(_WIN32)
+static int pwrite_all(int fd, const void *addr, size_t size, off_t offset){
+  const uint8_t *data = (const uint8_t *)addr;
+  while(0 < size){
+    ssize_t written = pwrite(fd, data, size, offset);
+    if(written <= 0) return 0;
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return 1;
+}
+
+static char *temporary_path(const char *path){
+  static const char suffix[] = ".XXXXXX";
+  size_t length = strlen(path);
+  char *temporary = (char *)sf3_calloc(length+sizeof(suffix), 1);
+  if(temporary){
+    memcpy(temporary, path, length);
+    memcpy(temporary+length, suffix, sizeof(suffix));
+  }
+  return temporary;
+}
+
+static char *directory_path(const char *path){
+  const char *slash = strrchr(path, '/');
+  size_t length = (slash)? (size_t)(slash-path) : 0;
+  if(slash && length == 0) length = 1;
+  char *directory = (char *)sf3_calloc(length+2, 1);
+  if(directory){
+    if(slash) memcpy(directory, path, length);
+    else directory[0] = '.';
+  }
+  return directory;
+}
+
+// Creates the file named by a TEMPORARY from temporary_path. Unlike
+// mkstemp, which always uses 0600, this creates it like any new file,
+// so the umask decides the permissions.
+static int create_temporary(char *temporary){
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  static uint64_t counter = 0;
+  char *suffix = temporary+strlen(temporary)-6;
+  for(int attempt=0; attempt<128; ++attempt){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t value = ((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_nsec ^ (uint64_t)now.tv_sec;
+    value ^= (uint64_t)(atomic_fetch_add(&counter, 1)+1) * 0x9E3779B97F4A7C15ull;
+    for(int i=0; i<6; ++i){
+      suffix[i] = letters[value % (sizeof(letters)-1)];
+      value /= sizeof(letters)-1;
+    }
+    int fd = open(temporary, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd != -1 || errno != EEXIST) return fd;
+  }
+  return -1;
+}
+
+// Gives a file that is about to replace PATH the mode and, as far as
+// we are allowed to, the owner of the file it replaces.
+static void copy_permissions(int fd, const char *path){
+#if defined(HAVE_STAT_H)
+  struct stat target;
+  if(stat(path, &target) != 0) return;
+  // Only privileged processes may hand files to other users, but we
+  // can usually still keep the group.
+  if(fchown(fd, target.st_uid, target.st_gid) != 0
+     && fchown(fd, (uid_t)-1, target.st_gid) != 0){}
+  // Changing the owner clears the set-id bits, so set the mode after.
+  fchmod(fd, target.st_mode & 07777);
+#else
+  (void)fd;
+  (void)path;
+#endif
+}
+
+// Opens a file in the same directory as PATH to write the contents
+// into before publishing them. If the file is anonymous, TEMPORARY
+// is left null and the file must be linked in with link_temporary.
+static int open_temporary(const char *path, char **temporary){
+  int fd;
+  *temporary = 0;
+#if defined(O_TMPFILE)
+  // Linking an anonymous file in requires /proc.
+  if(access("/proc/self/fd", X_OK) == 0){
+    char *directory = directory_path(path);
+    if(!directory) return -1;
+    fd = open(directory, O_TMPFILE | O_WRONLY, 0666);
+    sf3_free(directory);
+    if(fd != -1){
+      copy_permissions(fd, path);
+      return fd;
+    }
+  }
+#endif
+  *temporary = temporary_path(path);
+  if(!*temporary) return -1;
+  fd = create_temporary(*temporary);
+  if(fd == -1){
+    sf3_free(*temporary);
+    *temporary = 0;
+    return -1;
+  }
+  copy_permissions(fd, path);
+  return fd;
+}
+
+#if defined(O_TMPFILE)
+static int link_temporary(int fd, const char *path, char **temporary){
+  char source[64];
+  snprintf(source, sizeof(source), "/proc/self/fd/%d", fd);
+  // linkat cannot replace an existing file, so link to a fresh name
+  // first and rename that over the target after.
+  for(int attempt=0; attempt<16; ++attempt){
+    *temporary = temporary_path(path);
+    if(!*temporary) return 0;
+    int placeholder = mkstemp(*temporary);
+    if(placeholder == -1) break;
+    close(placeholder);
+    unlink(*temporary);
+    if(linkat(AT_FDCWD, source, AT_FDCWD, *temporary, AT_SYMLINK_FOLLOW) == 0)
+      return 1;
+    if(errno != EEXIST) break;
+    sf3_free(*temporary);
+  }
+  sf3_free(*temporary);
+  *temporary = 0;
+  return 0;
+}
+#endif
+
+static void sync_directory(const char *path){
+  char *directory = directory_path(path);
+  if(!directory) return;
+  int fd = open(directory, O_RDONLY);
+  sf3_free(directory);
+  if(fd != -1){
+    fsync(fd);
+    close(fd);
+  }
+}
+
+#if defined(HAVE_COPY_FILE_RANGE) && defined(HAVE_MMAN_H)
+// Copies the payload straight from the source file, which allows the
+// kernel to share the blocks if the file system supports it.
+static int copy_payload(int from, int to, size_t size){
+  loff_t in = sizeof(struct sf3_identifier);
+  loff_t out = sizeof(struct sf3_identifier);
+  while(0 < size){
+    ssize_t copied = copy_file_range(from, &in, to, &out, size, 0);
+    if(copied <= 0) return 0;
+    size -= copied;
+  }
+  return 1;
+}
+#endif
+#endif
+
+SF3_EXPORT int sf3_write_atomic(const char *path, sf3_handle handle){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  if(!h || !path || h->size < sizeof(struct sf3_identifier)){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  // The header may claim more than is mapped, for instance in a file
+  // that was cut short, and we must not read past the end.
+  size_t size = sf3_size((const struct sf3_identifier *)h->addr);
+  if(size < sizeof(struct sf3_identifier) || h->size < size){
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+#if defined(_WIN32)
+  size_t length = strlen(path);
+  char *temporary = (char *)sf3_calloc(length+5, 1);
+  if(!temporary){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  memcpy(temporary, path, length);
+  memcpy(temporary+length, ".tmp", 5);
+  if(!sf3_write(temporary, handle) || !MoveFileEx(temporary, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)){
+    DeleteFile(temporary);
+    sf3_free(temporary);
+    err = SF3_WRITE_FAILED;
+    return 0;
+  }
+  sf3_free(temporary);
+  return 1;
+#else
+  struct sf3_identifier *id = (struct sf3_identifier *)h->addr;
+  struct sf3_identifier header = {0};
+  const uint8_t *payload = ((const uint8_t*)h->addr+sizeof(struct sf3_identifier));
+  size_t payload_size = size-sizeof(struct sf3_identifier);
+  sf3_crc32_checksum checksum = 0;
+  int written = 0;
+  char *temporary;
+
+  int fd = open_temporary(path, &temporary);
+  if(fd == -1){
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+#if defined(HAVE_FALLOCATE)
+  // Reserve the space up front so the file can be laid out in one
+  // piece, and so that we fail early if the disk is full.
+  if(fallocate(fd, 0, 0, size) != 0 && errno == ENOSPC)
+    goto fail;
+#endif
+
+#if defined(HAVE_COPY_FILE_RANGE) && defined(HAVE_MMAN_H)
+  // The mapping of a file-backed handle always reflects the file, so
+  // we can checksum the memory and copy the file.
+  if(0 <= h->fd){
+    checksum = sf3_compute_checksum(payload, payload_size);
+    written = copy_payload(h->fd, fd, payload_size);
+  }
+#endif
+  if(!written){
+    struct sf3_crc32_state crc;
+    sf3_crc32_init(&crc);
+    for(size_t offset=0; offset<payload_size; offset+=WRITE_CHUNK_SIZE){
+      size_t chunk = payload_size-offset;
+      if(WRITE_CHUNK_SIZE < chunk) chunk = WRITE_CHUNK_SIZE;
+      sf3_crc32_update(&crc, payload+offset, chunk);
+      if(!pwrite_all(fd, payload+offset, chunk, sizeof(struct sf3_identifier)+offset))
+        goto fail;
+    }
+    checksum = sf3_crc32_final(&crc);
+  }
+  sf3_write_identifier(id->format_id, checksum, &header);
+  if(!pwrite_all(fd, &header, sizeof(struct sf3_identifier), 0))
+    goto fail;
+  if(ftruncate(fd, size) != 0 || fsync(fd) != 0)
+    goto fail;
+
+#if defined(O_TMPFILE)
+  if(!temporary && !link_temporary(fd, path, &temporary))
+    goto fail;
+#endif
+  if(rename(temporary, path) != 0)
+    goto fail;
+  sync_directory(path);
+  close(fd);
+  sf3_free(temporary);
+  return 1;
+
+ fail:
+  err = SF3_WRITE_FAILED;
+  close(fd);
+  if(temporary){
+    unlink(temporary);
+    sf3_free(temporary);
+  }
+  return 0;
+#endif
+}
+
+struct verify_job{
+  const uint8_t *payload;
+  size_t size;
+  size_t block;
+  sf3_crc32_checksum *checksums;
+};
+
+static void verify_block(size_t index, void *data){
+  struct verify_job *job = (struct verify_job *)data;
+  size_t start = index * job->block;
+  size_t size = job->size - start;
+  if(job->block < size) size = job->block;
+  job->checksums[index] = sf3_compute_checksum(job->payload+start, size);
+}
+
+static sf3_crc32_checksum checksum_parallel(const uint8_t *payload, size_t size, unsigned int threads){
+  struct verify_job job = {0};
+  job.payload = payload;
+  job.size = size;
+  if(threads == 0) threads = cpu_count();
+  // Use a few blocks per thread to balance out stragglers, but don't
+  // split the payload into pieces too small to outweigh the cost of
+  // spinning up the threads.
+  job.block = job.size / ((size_t)threads * 4);
+  if(job.block < VERIFY_MIN_BLOCK) job.block = VERIFY_MIN_BLOCK;
+  if(threads == 1 || job.size <= job.block)
+    return sf3_compute_checksum(payload, size);
+
+  size_t count = (job.size + job.block - 1) / job.block;
+  job.checksums = (sf3_crc32_checksum *)sf3_calloc(count, sizeof(sf3_crc32_checksum));
+  if(!job.checksums)
+    return sf3_compute_checksum(payload, size);
+  parallel_for(threads, count, verify_block, &job);
+
+  sf3_crc32_checksum checksum = job.checksums[0];
+  for(size_t i=1; i<count; ++i){
+    size_t length = (i+1 < count)? job.block : job.size - i*job.block;
+    checksum = sf3_crc32_combine(checksum, job.checksums[i], length);
+  }
+  sf3_free(job.checksums);
+  return checksum;
+}
+
+SF3_EXPORT int sf3_verify_parallel(const void *addr, size_t size, unsigned int threads){
+  int result = sf3_check(addr, size);
+  if(result == 0) return 0;
+
+  const struct sf3_identifier *identifier = (const struct sf3_identifier *)addr;
+  const uint8_t *payload = ((const uint8_t *)addr)+sizeof(struct sf3_identifier);
+  sf3_crc32_checksum checksum = checksum_parallel(payload, size-sizeof(struct sf3_identifier), threads);
+  return (identifier->checksum == checksum)? result : 0;
+}
+
+#if defined(HAVE_VERIFY_CACHE)
+#define VERIFY_RECORD_MAGIC 0x56463353u
+#define VERIFY_XATTR "user.sf3.verified"
+#define VERIFY_SIDECAR_SUFFIX ".sf3-verified"
+
+// What we remember about a file that verified successfully. The
+// ctime is deliberately not part of this, since setting the xattr
+// itself changes it.
+struct SF3_PACK verify_record{
+  uint32_t magic;
+  uint32_t checksum;
+  uint64_t size;
+  uint64_t inode;
+  int64_t mtime;
+  int64_t mtime_nsec;
+};
+
+static void verify_record_from_stat(struct verify_record *record, const struct stat *stat, uint32_t checksum){
+  memset(record, 0, sizeof(struct verify_record));
+  record->magic = VERIFY_RECORD_MAGIC;
+  record->checksum = checksum;
+  record->size = (uint64_t)stat->st_size;
+  record->inode = (uint64_t)stat->st_ino;
+  record->mtime = (int64_t)stat->st_mtime;
+#if defined(__APPLE__)
+  record->mtime_nsec = (int64_t)stat->st_mtimespec.tv_nsec;
+#else
+  record->mtime_nsec = (int64_t)stat->st_mtim.tv_nsec;
+#endif
+}
+
+static char *verify_sidecar_path(const char *path){
+  size_t length = strlen(path);
+  char *sidecar = (char *)sf3_calloc(length+sizeof(VERIFY_SIDECAR_SUFFIX), 1);
+  if(sidecar){
+    memcpy(sidecar, path, length);
+    memcpy(sidecar+length, VERIFY_SIDECAR_SUFFIX, sizeof(VERIFY_SIDECAR_SUFFIX));
+  }
+  return sidecar;
+}
+
+static int verify_record_load(int fd, const char *path, int flags, struct verify_record *record){
+#if defined(HAVE_XATTR)
+  if(fgetxattr(fd, VERIFY_XATTR, record, sizeof(struct verify_record)) == sizeof(struct verify_record))
+    return 1;
+#endif
+  if(flags & SF3_VERIFY_SIDECAR){
+    char *sidecar = verify_sidecar_path(path);
+    if(!sidecar) return 0;
+    int sfd = open(sidecar, O_RDONLY);
+    sf3_free(sidecar);
+    if(sfd == -1) return 0;
+    ssize_t length = pread(sfd, record, sizeof(struct verify_record), 0);
+    close(sfd);
+    return length == sizeof(struct verify_record);
+  }
+  return 0;
+}
+
+static void verify_record_store(int fd, const char *path, int flags, const struct verify_record *record){
+#if defined(HAVE_XATTR)
+  if(fsetxattr(fd, VERIFY_XATTR, record, sizeof(struct verify_record), 0) == 0)
+    return;
+#endif
+  if(flags & SF3_VERIFY_SIDECAR){
+    char *sidecar = verify_sidecar_path(path);
+    if(!sidecar) return;
+    // Storing the record is best-effort; failing to do so only means
+    // we'll verify the file in full again next time.
+    int sfd = open(sidecar, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    sf3_free(sidecar);
+    if(sfd == -1) return;
+    write_all(sfd, record, sizeof(struct verify_record));
+    close(sfd);
+  }
+}
+#endif
+
+SF3_EXPORT int sf3_verify_file(const char *path, int flags){
+  err = SF3_OK;
+#if defined(HAVE_VERIFY_CACHE)
+  if(flags & SF3_VERIFY_CACHED){
+    int fd = open(path, O_RDONLY);
+    if(fd == -1){
+      err = SF3_OPEN_FAILED;
+      return 0;
+    }
+    struct stat stat_buf;
+    struct sf3_identifier identifier;
+    struct verify_record current, stored;
+    if(fstat(fd, &stat_buf) == 0
+       && pread(fd, &identifier, sizeof(identifier), 0) == sizeof(identifier)
+       && sf3_check(&identifier, sizeof(identifier))){
+      verify_record_from_stat(&current, &stat_buf, identifier.checksum);
+      if(verify_record_load(fd, path, flags, &stored)
+         && memcmp(&current, &stored, sizeof(struct verify_record)) == 0){
+        close(fd);
+        return identifier.format_id;
+      }
+    }else{
+      memset(&current, 0, sizeof(current));
+    }
+
+    // Verify the very file we took the record from, rather than
+    // whatever PATH names by now.
+    int type = 0;
+    struct handle *handle;
+    if(map_fd(fd, SF3_OPEN_READ_ONLY | SF3_OPEN_SEQUENTIAL, &handle)){
+      type = sf3_verify_parallel(handle->addr, handle->size, 0);
+      if(!type) err = SF3_CHECKSUM_MISMATCH;
+      sf3_close(handle);
+    }
+    // Only remember the result if the file did not change while we
+    // were verifying it.
+    if(type && current.magic && fstat(fd, &stat_buf) == 0){
+      struct verify_record after;
+      verify_record_from_stat(&after, &stat_buf, current.checksum);
+      if(memcmp(&current, &after, sizeof(struct verify_record)) == 0)
+        verify_record_store(fd, path, flags, &current);
+    }
+    close(fd);
+    return type;
+  }
+#endif
+  sf3_handle handle;
+  if(!sf3_open(path, SF3_OPEN_READ_ONLY | SF3_OPEN_SEQUENTIAL, &handle))
+    return 0;
+  size_t size;
+  void *addr = sf3_data(handle, &size);
+  int type = sf3_verify_parallel(addr, size, 0);
+  if(!type) err = SF3_CHECKSUM_MISMATCH;
+  sf3_close(handle);
+  return type;
+}
+
+#if defined(HAVE_IO_URING_H) && defined(HAVE_MMAN_H) && defined(HAVE_THREADS)
+#define HAVE_IO_URING 1
+// A minimal io_uring wrapper, so that we don't need to depend on
+// liburing for the handful of operations we actually use.
+struct uring{
+  int fd;
+  unsigned int entries;
+  unsigned int pending;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+static void uring_free(struct uring *ring){
+  if(ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if(ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  if(ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+  if(0 <= ring->fd) close(ring->fd);
+  memset(ring, 0, sizeof(struct uring));
+  ring->fd = -1;
+}
+
+static int uring_init(struct uring *ring, unsigned int entries){
+  struct io_uring_params params = {0};
+  memset(ring, 0, sizeof(struct uring));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if(ring->fd < 0) return 0;
+
+  ring->entries = params.sq_entries;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(ring->sq_ring_size < ring->cq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if(ring->sq_ring == MAP_FAILED){
+    ring->sq_ring = 0;
+    goto cleanup;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    ring->cq_ring = ring->sq_ring;
+  }else{
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if(ring->cq_ring == MAP_FAILED){
+      ring->cq_ring = 0;
+      goto cleanup;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED){
+    ring->sqes = 0;
+    goto cleanup;
+  }
+
+  uint8_t *sq = (uint8_t *)ring->sq_ring;
+  uint8_t *cq = (uint8_t *)ring->cq_ring;
+  ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 1;
+
+ cleanup:
+  uring_free(ring);
+  return 0;
+}
+
+// Returns a cleared submission entry, or null if the queue is full.
+static struct io_uring_sqe *uring_sqe(struct uring *ring){
+  unsigned int tail = *ring->sq_tail;
+  if(ring->entries <= tail - atomic_load(ring->sq_head)) return 0;
+  unsigned int index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[index] = index;
+  atomic_store(ring->sq_tail, tail+1);
+  ring->pending++;
+  return sqe;
+}
+
+// Submits all queued entries and waits for at least WAIT completions.
+static int uring_enter(struct uring *ring, unsigned int wait){
+  for(;;){
+    long res = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, (wait)? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(0 <= res){
+      ring->pending -= (unsigned int)res;
+      return 1;
+    }
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY) return 0;
+  }
+}
+#endif
+
+#define ENGINE_MAX_BUFFER (16*1024*1024)
+
+enum engine_stage{
+  ENGINE_PENDING,
+  ENGINE_OPENING,
+  ENGINE_READING,
+};
+
+struct engine_job{
+  struct engine_job *next;
+  enum engine_stage stage;
+  char *path;
+  void *user;
+  int fd;
+  uint8_t *buffer;
+  size_t size;
+  size_t read;
+  int format_id;
+  enum sf3_error error;
+  /// The neighbours among the jobs that are on the ring.
+  struct engine_job *ring_prev;
+  struct engine_job *ring_next;
+  /// Where the job's last operation went in the submission queue.
+  unsigned int ring_slot;
+};
+
+struct engine_queue{
+  struct engine_job *head;
+  struct engine_job *tail;
+};
+
+struct engine{
+  struct engine_queue pending;
+  struct engine_queue verify;
+  struct engine_queue completed;
+  size_t outstanding;
+  int closing;
+#if defined(HAVE_THREADS)
+  mutex_t lock;
+  cond_t work_available;
+  cond_t result_available;
+  thread_t threads[64];
+  unsigned int thread_count;
+#endif
+#if defined(HAVE_IO_URING)
+  struct uring ring;
+  int use_ring;
+  int ring_waiting;
+  unsigned int depth;
+  thread_t io_thread;
+  int io_started;
+#endif
+};
+
+static void engine_push(struct engine_queue *queue, struct engine_job *job){
+  job->next = 0;
+  if(queue->tail) queue->tail->next = job;
+  else queue->head = job;
+  queue->tail = job;
+}
+
+static struct engine_job *engine_pop(struct engine_queue *queue){
+  struct engine_job *job = queue->head;
+  if(job){
+    queue->head = job->next;
+    if(!queue->head) queue->tail = 0;
+  }
+  return job;
+}
+
+static void engine_free_job(struct engine_job *job){
+  if(job->buffer) sf3_free(job->buffer);
+  if(job->path) sf3_free(job->path);
+  sf3_free(job);
+}
+
+// Verifies a job whose contents have not been read in by the ring,
+// by mapping the file in on the calling thread.
+static void engine_verify_file(struct engine_job *job){
+  sf3_handle handle;
+  size_t size;
+  if(!sf3_open(job->path, SF3_OPEN_READ_ONLY | SF3_OPEN_SEQUENTIAL, &handle)){
+    job->error = sf3_error();
+    return;
+  }
+  void *addr = sf3_data(handle, &size);
+  job->format_id = sf3_verify(addr, size);
+  if(!job->format_id) job->error = SF3_CHECKSUM_MISMATCH;
+  sf3_close(handle);
+}
+
+static void engine_verify_buffer(struct engine_job *job){
+  if(!sf3_check(job->buffer, job->size)){
+    job->error = SF3_INVALID_FILE;
+  }else{
+    job->format_id = sf3_verify(job->buffer, job->size);
+    if(!job->format_id) job->error = SF3_CHECKSUM_MISMATCH;
+  }
+  sf3_free(job->buffer);
+  job->buffer = 0;
+}
+
+static void engine_process(struct engine_job *job){
+  if(job->buffer) engine_verify_buffer(job);
+  else if(job->error == SF3_OK) engine_verify_file(job);
+}
+
+#if defined(HAVE_THREADS)
+static void *engine_worker(void *data){
+  struct engine *e = (struct engine *)data;
+  mutex_lock(&e->lock);
+  for(;;){
+    struct engine_job *job = engine_pop(&e->verify);
+#if defined(HAVE_IO_URING)
+    if(!job && !e->use_ring) job = engine_pop(&e->pending);
+#else
+    if(!job) job = engine_pop(&e->pending);
+#endif
+    if(job){
+      mutex_unlock(&e->lock);
+      engine_process(job);
+      mutex_lock(&e->lock);
+      engine_push(&e->completed, job);
+      cond_broadcast(&e->result_available);
+    }else if(e->closing){
+      break;
+    }else{
+      cond_wait(&e->work_available, &e->lock);
+    }
+  }
+  mutex_unlock(&e->lock);
+  return 0;
+}
+#endif
+
+#if defined(HAVE_IO_URING)
+static void engine_ring_done(struct engine *e, struct engine_job *job){
+  if(0 <= job->fd){
+    close(job->fd);
+    job->fd = -1;
+  }
+  mutex_lock(&e->lock);
+  if(job->error == SF3_OK || job->buffer){
+    engine_push(&e->verify, job);
+    cond_signal(&e->work_available);
+    // Without workers, whoever waits for results verifies the job.
+    if(e->thread_count == 0) cond_broadcast(&e->result_available);
+  }else{
+    engine_push(&e->completed, job);
+    cond_broadcast(&e->result_available);
+  }
+  mutex_unlock(&e->lock);
+}
+
+static struct io_uring_sqe *engine_ring_sqe(struct engine *e, struct engine_job *job){
+  struct io_uring_sqe *sqe = uring_sqe(&e->ring);
+  sqe->user_data = (uint64_t)(uintptr_t)job;
+  job->ring_slot = *e->ring.sq_tail-1;
+  return sqe;
+}
+
+static void engine_ring_read(struct engine *e, struct engine_job *job){
+  struct io_uring_sqe *sqe = engine_ring_sqe(e, job);
+  job->stage = ENGINE_READING;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = job->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(job->buffer + job->read);
+  sqe->len = (unsigned int)(job->size - job->read);
+  sqe->off = job->read;
+}
+
+// Advances the job after one of its operations completed. Returns
+// whether the job still has an operation in flight on the ring.
+static int engine_ring_complete(struct engine *e, struct engine_job *job, int res){
+  if(job->stage == ENGINE_OPENING){
+    if(res == -EINVAL || res == -EOPNOTSUPP){
+      // The kernel does not support opening through the ring, so
+      // leave the job to the workers.
+      engine_ring_done(e, job);
+      return 0;
+    }else if(res < 0){
+      job->error = SF3_OPEN_FAILED;
+      engine_ring_done(e, job);
+      return 0;
+    }
+    job->fd = res;
+    struct stat stat;
+    if(fstat(job->fd, &stat) != 0){
+      job->error = SF3_OPEN_FAILED;
+    }else if(stat.st_size < (off_t)sizeof(struct sf3_identifier)){
+      job->error = SF3_INVALID_FILE;
+    }else if(ENGINE_MAX_BUFFER < stat.st_size){
+      // Large files are better off being mapped in by the workers.
+    }else{
+      job->size = stat.st_size;
+      job->buffer = (uint8_t *)sf3_malloc(job->size);
+      if(job->buffer){
+        engine_ring_read(e, job);
+        return 1;
+      }
+    }
+    engine_ring_done(e, job);
+    return 0;
+  }else{
+    if(res <= 0){
+      job->error = SF3_OPEN_FAILED;
+      sf3_free(job->buffer);
+      job->buffer = 0;
+      engine_ring_done(e, job);
+      return 0;
+    }
+    job->read += res;
+    if(job->read < job->size){
+      engine_ring_read(e, job);
+      return 1;
+    }
+    engine_ring_done(e, job);
+    return 0;
+  }
+}
+
+static void engine_ring_add(struct engine_job **flight, struct engine_job *job){
+  job->ring_prev = 0;
+  job->ring_next = *flight;
+  if(*flight) (*flight)->ring_prev = job;
+  *flight = job;
+}
+
+static void engine_ring_remove(struct engine_job **flight, struct engine_job *job){
+  if(job->ring_prev) job->ring_prev->ring_next = job->ring_next;
+  else *flight = job->ring_next;
+  if(job->ring_next) job->ring_next->ring_prev = job->ring_prev;
+  job->ring_prev = job->ring_next = 0;
+}
+
+// Gives up on the ring after it failed for good. The jobs that were on
+// it are failed, and the workers take over the pending ones.
+static void engine_ring_fail(struct engine *e, struct engine_job *flight){
+  struct uring *ring = &e->ring;
+  // Closing the ring does not stop the kernel from still reading into
+  // our buffers, so cancel what it has and wait until it lets go.
+  for(struct engine_job *job = flight; job; job = job->ring_next){
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if(!sqe) break;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)job;
+  }
+  unsigned int active = 0;
+  for(struct engine_job *job = flight; job; job = job->ring_next) ++active;
+  while(0 < active && uring_enter(ring, 1)){
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = atomic_load(ring->cq_tail);
+    for(; head != tail; ++head){
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      struct engine_job *job = (struct engine_job *)(uintptr_t)cqe->user_data;
+      if(job && job->stage != ENGINE_PENDING){
+        if(job->stage == ENGINE_OPENING && 0 <= cqe->res) close(cqe->res);
+        job->stage = ENGINE_PENDING;
+        --active;
+      }
+      atomic_store(ring->cq_head, head+1);
+    }
+  }
+  // If the ring can't even tell us that much, the kernel may still be
+  // at whatever it picked up from the submission queue. Those buffers
+  // have to be left to it.
+  unsigned int consumed = atomic_load(ring->sq_head);
+  for(struct engine_job *job = flight; job; job = job->ring_next){
+    if(job->stage != ENGINE_PENDING && (int)(job->ring_slot - consumed) < 0) job->buffer = 0;
+  }
+  uring_free(ring);
+
+  mutex_lock(&e->lock);
+  atomic_store(&e->use_ring, 0);
+  while(flight){
+    struct engine_job *job = flight;
+    engine_ring_remove(&flight, job);
+    if(0 <= job->fd){
+      close(job->fd);
+      job->fd = -1;
+    }
+    if(job->buffer){
+      sf3_free(job->buffer);
+      job->buffer = 0;
+    }
+    job->error = SF3_OPEN_FAILED;
+    engine_push(&e->completed, job);
+  }
+  cond_broadcast(&e->result_available);
+  cond_broadcast(&e->work_available);
+  mutex_unlock(&e->lock);
+}
+
+static void *engine_io_thread(void *data){
+  struct engine *e = (struct engine *)data;
+  struct engine_job *flight = 0;
+  unsigned int in_flight = 0;
+  for(;;){
+    mutex_lock(&e->lock);
+    while(in_flight == 0 && !e->pending.head && !e->closing){
+      cond_wait(&e->work_available, &e->lock);
+    }
+    if(in_flight == 0 && !e->pending.head && e->closing){
+      mutex_unlock(&e->lock);
+      break;
+    }
+    while(in_flight < e->depth && e->pending.head){
+      struct engine_job *job = engine_pop(&e->pending);
+      struct io_uring_sqe *sqe = engine_ring_sqe(e, job);
+      job->stage = ENGINE_OPENING;
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uint64_t)(uintptr_t)job->path;
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+      engine_ring_add(&flight, job);
+      ++in_flight;
+    }
+    mutex_unlock(&e->lock);
+
+    // Interruptions are already retried, so this is a hard error.
+    if(!uring_enter(&e->ring, 1)){
+      engine_ring_fail(e, flight);
+      break;
+    }
+    unsigned int head = *e->ring.cq_head;
+    unsigned int tail = atomic_load(e->ring.cq_tail);
+    for(; head != tail; ++head){
+      struct io_uring_cqe *cqe = &e->ring.cqes[head & *e->ring.cq_mask];
+      struct engine_job *job = (struct engine_job *)(uintptr_t)cqe->user_data;
+      int res = cqe->res;
+      atomic_store(e->ring.cq_head, head+1);
+      // Once the job is handed on it may be gone at any moment.
+      engine_ring_remove(&flight, job);
+      if(engine_ring_complete(e, job, res)) engine_ring_add(&flight, job);
+      else --in_flight;
+    }
+  }
+  return 0;
+}
+#endif
+
+SF3_EXPORT int sf3_engine_create(unsigned int threads, unsigned int depth, int flags, sf3_engine *engine){
+  err = SF3_OK;
+  struct engine *e = (struct engine *)sf3_calloc(1, sizeof(struct engine));
+  if(!e){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  if(threads == 0) threads = cpu_count();
+  if(64 < threads) threads = 64;
+  if(depth == 0) depth = 64;
+#if defined(HAVE_THREADS)
+  mutex_init(&e->lock);
+  cond_init(&e->work_available);
+  cond_init(&e->result_available);
+#endif
+#if defined(HAVE_IO_URING)
+  e->ring.fd = -1;
+  e->depth = depth;
+  if(!(flags & SF3_ENGINE_NO_IO_URING) && uring_init(&e->ring, depth)){
+    if(e->ring.entries < e->depth) e->depth = e->ring.entries;
+    e->use_ring = 1;
+    if(thread_start(&e->io_thread, engine_io_thread, e)){
+      e->io_started = 1;
+    }else{
+      e->use_ring = 0;
+      uring_free(&e->ring);
+    }
+  }
+#endif
+#if defined(HAVE_THREADS)
+  for(; e->thread_count<threads; ++e->thread_count){
+    if(!thread_start(&e->threads[e->thread_count], engine_worker, e)) break;
+  }
+#endif
+  *engine = e;
+  return 1;
+}
+
+SF3_EXPORT int sf3_engine_uses_io_uring(sf3_engine engine){
+#if defined(HAVE_IO_URING)
+  return atomic_load(&((struct engine *)engine)->use_ring);
+#else
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_engine_submit(sf3_engine engine, const char *path, void *user){
+  err = SF3_OK;
+  struct engine *e = (struct engine *)engine;
+  if(!e){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  struct engine_job *job = (struct engine_job *)sf3_calloc(1, sizeof(struct engine_job));
+  size_t length = strlen(path)+1;
+  if(job) job->path = (char *)sf3_calloc(1, length);
+  if(!job || !job->path){
+    if(job) sf3_free(job);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  memcpy(job->path, path, length);
+  job->user = user;
+  job->fd = -1;
+#if defined(HAVE_THREADS)
+  mutex_lock(&e->lock);
+  engine_push(&e->pending, job);
+  e->outstanding++;
+#if defined(HAVE_IO_URING)
+  if(e->use_ring) cond_broadcast(&e->work_available);
+  else cond_signal(&e->work_available);
+#else
+  cond_signal(&e->work_available);
+#endif
+  mutex_unlock(&e->lock);
+#else
+  engine_push(&e->pending, job);
+  e->outstanding++;
+#endif
+  return 1;
+}
+
+SF3_EXPORT size_t sf3_engine_complete(sf3_engine engine, struct sf3_engine_result *results, size_t count, int wait){
+  err = SF3_OK;
+  struct engine *e = (struct engine *)engine;
+  size_t done = 0;
+  if(!e){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+#if defined(HAVE_THREADS)
+  mutex_lock(&e->lock);
+  while(wait && !e->completed.head && 0 < e->outstanding){
+    struct engine_job *job = 0;
+    // Without any workers we have to make progress ourselves, also on
+    // whatever the ring hands over while we wait.
+    if(e->thread_count == 0){
+      job = engine_pop(&e->verify);
+      if(!job) job = engine_pop(&e->pending);
+    }
+    if(job){
+      mutex_unlock(&e->lock);
+      engine_process(job);
+      mutex_lock(&e->lock);
+      engine_push(&e->completed, job);
+    }else{
+      cond_wait(&e->result_available, &e->lock);
+    }
+  }
+#else
+  if(wait && !e->completed.head){
+    struct engine_job *job = engine_pop(&e->pending);
+    if(job){
+      engine_process(job);
+      engine_push(&e->completed, job);
+    }
+  }
+#endif
+  while(done < count && e->completed.head){
+    struct engine_job *job = engine_pop(&e->completed);
+    results[done].user = job->user;
+    results[done].format_id = job->format_id;
+    results[done].error = job->error;
+    engine_free_job(job);
+    e->outstanding--;
+    done++;
+  }
+#if defined(HAVE_THREADS)
+  mutex_unlock(&e->lock);
+#endif
+  return done;
+}
+
+SF3_EXPORT void sf3_engine_destroy(sf3_engine engine){
+  struct engine *e = (struct engine *)engine;
+  if(!e) return;
+#if defined(HAVE_THREADS)
+  mutex_lock(&e->lock);
+  e->closing = 1;
+  // Drop everything that hasn't been started yet.
+  struct engine_job *job;
+  while((job = engine_pop(&e->pending))){
+    engine_free_job(job);
+  }
+  cond_broadcast(&e->work_available);
+  mutex_unlock(&e->lock);
+#if defined(HAVE_IO_URING)
+  if(e->io_started){
+    thread_join(e->io_thread);
+    uring_free(&e->ring);
+  }
+#endif
+  for(unsigned int i=0; i<e->thread_count; ++i){
+    thread_join(e->threads[i]);
+  }
+  cond_destroy(&e->result_available);
+  cond_destroy(&e->work_available);
+  mutex_destroy(&e->lock);
+#endif
+  struct engine_queue *queues[] = {&e->pending, &e->verify, &e->completed};
+  for(int i=0; i<3; ++i){
+    struct engine_job *job;
+    while((job = engine_pop(queues[i]))){
+      engine_free_job(job);
+    }
+  }
+  sf3_free(e);
+}
+
+#define CACHE_MIN_BUCKETS 64
+
+struct cache_key{
+  uint64_t device;
+  uint64_t inode;
+  int64_t mtime;
+  int64_t mtime_nsec;
+  uint64_t size;
+};
+
+struct cache_entry{
+  // Must be first, so that the entry can be handed out as a handle.
+  struct handle handle;
+  struct cache_key key;
+  struct cache_entry *bucket_next;
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+  uint32_t refs;
+  int idle;
+  int stale;
+};
+
+struct handle_cache{
+  struct cache_entry **buckets;
+  size_t bucket_count;
+  size_t entry_count;
+  // Idle entries, from least to most recently used.
+  struct cache_entry *lru_head;
+  struct cache_entry *lru_tail;
+  size_t budget;
+  size_t mapped;
+  size_t live;
+  int closing;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+#if defined(HAVE_THREADS)
+  mutex_t lock;
+#endif
+};
+
+#if defined(HAVE_THREADS)
+#define cache_lock(C) mutex_lock(&(C)->lock)
+#define cache_unlock(C) mutex_unlock(&(C)->lock)
+#else
+#define cache_lock(C)
+#define cache_unlock(C)
+#endif
+
+static void cache_free(struct handle_cache *cache){
+#if defined(HAVE_THREADS)
+  mutex_destroy(&cache->lock);
+#endif
+  sf3_free(cache->buckets);
+  sf3_free(cache);
+}
+
+#if defined(HAVE_HANDLE_CACHE)
+static void cache_key_from_stat(struct cache_key *key, const struct stat *stat){
+  key->device = (uint64_t)stat->st_dev;
+  key->inode = (uint64_t)stat->st_ino;
+  key->mtime = (int64_t)stat->st_mtime;
+#if defined(__APPLE__)
+  key->mtime_nsec = (int64_t)stat->st_mtimespec.tv_nsec;
+#else
+  key->mtime_nsec = (int64_t)stat->st_mtim.tv_nsec;
+#endif
+  key->size = (uint64_t)stat->st_size;
+}
+
+// Only the file's identity is hashed, so that a changed file lands
+// in the same bucket as its stale entry.
+static size_t cache_hash(const struct cache_key *key, size_t bucket_count){
+  uint64_t hash = key->inode * 0x9E3779B97F4A7C15ull ^ key->device;
+  hash ^= hash >> 29;
+  return (size_t)(hash & (bucket_count-1));
+}
+
+static void cache_lru_remove(struct handle_cache *cache, struct cache_entry *entry){
+  if(entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else cache->lru_head = entry->lru_next;
+  if(entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else cache->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = 0;
+  entry->idle = 0;
+}
+
+static void cache_lru_push(struct handle_cache *cache, struct cache_entry *entry){
+  entry->lru_next = 0;
+  entry->lru_prev = cache->lru_tail;
+  if(cache->lru_tail) cache->lru_tail->lru_next = entry;
+  else cache->lru_head = entry;
+  cache->lru_tail = entry;
+  entry->idle = 1;
+}
+
+static void cache_unlink(struct handle_cache *cache, struct cache_entry *entry){
+  struct cache_entry **place = &cache->buckets[cache_hash(&entry->key, cache->bucket_count)];
+  while(*place && *place != entry) place = &(*place)->bucket_next;
+  if(*place){
+    *place = entry->bucket_next;
+    cache->entry_count--;
+  }
+  entry->bucket_next = 0;
+  entry->stale = 1;
+}
+
+static void cache_free_entry(struct handle_cache *cache, struct cache_entry *entry){
+  cache->mapped -= entry->handle.size;
+  cache->live--;
+  close_handle(&entry->handle);
+  sf3_free(entry);
+}
+
+// Drops idle entries, least recently used first, until the mapped
+// bytes fit into the budget again.
+static void cache_evict(struct handle_cache *cache){
+  while(cache->budget < cache->mapped && cache->lru_head){
+    struct cache_entry *entry = cache->lru_head;
+    cache_lru_remove(cache, entry);
+    if(!entry->stale) cache_unlink(cache, entry);
+    cache_free_entry(cache, entry);
+    cache->evictions++;
+  }
+}
+
+static void cache_grow(struct handle_cache *cache){
+  size_t count = cache->bucket_count*2;
+  struct cache_entry **buckets = (struct cache_entry **)sf3_calloc(count, sizeof(struct cache_entry *));
+  // Growing is only an optimisation, so we just keep going with the
+  // old table if we can't.
+  if(!buckets) return;
+  for(size_t i=0; i<cache->bucket_count; ++i){
+    struct cache_entry *entry = cache->buckets[i];
+    while(entry){
+      struct cache_entry *next = entry->bucket_next;
+      size_t index = cache_hash(&entry->key, count);
+      entry->bucket_next = buckets[index];
+      buckets[index] = entry;
+      entry = next;
+    }
+  }
+  sf3_free(cache->buckets);
+  cache->buckets = buckets;
+  cache->bucket_count = count;
+}
+
+// Finds the entry for the key and takes a reference to it. Entries
+// for the same file that no longer match the key are invalidated.
+static struct cache_entry *cache_acquire(struct handle_cache *cache, const struct cache_key *key){
+  struct cache_entry **place = &cache->buckets[cache_hash(key, cache->bucket_count)];
+  while(*place){
+    struct cache_entry *entry = *place;
+    if(entry->key.device == key->device && entry->key.inode == key->inode){
+      if(memcmp(&entry->key, key, sizeof(struct cache_key)) == 0){
+        if(entry->idle) cache_lru_remove(cache, entry);
+        atomic_fetch_add(&entry->refs, 1);
+        return entry;
+      }
+      // The file changed on disk since we mapped it.
+      *place = entry->bucket_next;
+      cache->entry_count--;
+      entry->bucket_next = 0;
+      entry->stale = 1;
+      if(entry->idle){
+        cache_lru_remove(cache, entry);
+        cache_free_entry(cache, entry);
+      }
+      continue;
+    }
+    place = &entry->bucket_next;
+  }
+  return 0;
+}
+
+static void cache_release(struct cache_entry *entry){
+  struct handle_cache *cache = entry->handle.cache;
+  // The last reference has to be dropped under the lock. Otherwise
+  // another thread could pick the entry up, release it and free it
+  // again before we got to look at it.
+  cache_lock(cache);
+  if(atomic_fetch_add(&entry->refs, -1) == 1){
+    if(entry->stale || cache->closing){
+      if(!entry->stale) cache_unlink(cache, entry);
+      cache_free_entry(cache, entry);
+    }else{
+      cache_lru_push(cache, entry);
+      cache_evict(cache);
+    }
+  }
+  if(cache->closing && cache->live == 0){
+    cache_unlock(cache);
+    cache_free(cache);
+    return;
+  }
+  cache_unlock(cache);
+}
+#endif
+
+SF3_EXPORT int sf3_cache_create(size_t budget, sf3_cache *cache){
+  err = SF3_OK;
+  struct handle_cache *c = (struct handle_cache *)sf3_calloc(1, sizeof(struct handle_cache));
+  if(!c){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  c->bucket_count = CACHE_MIN_BUCKETS;
+  c->buckets = (struct cache_entry **)sf3_calloc(c->bucket_count, sizeof(struct cache_entry *));
+  if(!c->buckets){
+    sf3_free(c);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  c->budget = (budget)? budget : (size_t)-1;
+#if defined(HAVE_THREADS)
+  mutex_init(&c->lock);
+#endif
+  *cache = c;
+  return 1;
+}
+
+SF3_EXPORT int sf3_cache_open(sf3_cache cache, const char *path, sf3_handle *handle){
+  err = SF3_OK;
+  struct handle_cache *c = (struct handle_cache *)cache;
+  if(!c){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+#if defined(HAVE_HANDLE_CACHE)
+  struct stat stat_buf;
+  struct cache_key key;
+  if(stat(path, &stat_buf) == -1){
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  cache_key_from_stat(&key, &stat_buf);
+
+  cache_lock(c);
+  struct cache_entry *entry = cache_acquire(c, &key);
+  if(entry) c->hits++;
+  else c->misses++;
+  cache_unlock(c);
+  if(entry){
+    *handle = &entry->handle;
+    return ((struct sf3_identifier *)entry->handle.addr)->format_id;
+  }
+
+  // Map the file outside of the lock, so that other files can still
+  // be served in the meantime.
+  entry = (struct cache_entry *)sf3_calloc(1, sizeof(struct cache_entry));
+  if(!entry){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  int type = open_handle(&entry->handle, path, SF3_OPEN_READ_ONLY);
+  if(!type){
+    sf3_free(entry);
+    return 0;
+  }
+  // The file may have been replaced between the stat and the open, so
+  // key the entry by what we actually mapped.
+  if(fstat(entry->handle.fd, &stat_buf) == 0)
+    cache_key_from_stat(&key, &stat_buf);
+  entry->key = key;
+  entry->refs = 1;
+  entry->handle.cache = c;
+
+  cache_lock(c);
+  struct cache_entry *existing = cache_acquire(c, &key);
+  if(existing){
+    // Another thread mapped the same file concurrently, so share its
+    // mapping instead.
+    cache_unlock(c);
+    close_handle(&entry->handle);
+    sf3_free(entry);
+    *handle = &existing->handle;
+    return type;
+  }
+  size_t index = cache_hash(&key, c->bucket_count);
+  entry->bucket_next = c->buckets[index];
+  c->buckets[index] = entry;
+  c->entry_count++;
+  c->live++;
+  c->mapped += entry->handle.size;
+  if(c->bucket_count < c->entry_count) cache_grow(c);
+  cache_evict(c);
+  cache_unlock(c);
+  *handle = &entry->handle;
+  return type;
+#else
+  return sf3_open(path, SF3_OPEN_READ_ONLY, handle);
+#endif
+}
+
+SF3_EXPORT void sf3_cache_stats(sf3_cache cache, struct sf3_cache_stats *stats){
+  struct handle_cache *c = (struct handle_cache *)cache;
+  memset(stats, 0, sizeof(struct sf3_cache_stats));
+  if(!c) return;
+  cache_lock(c);
+  stats->entries = c->entry_count;
+  stats->mapped_bytes = c->mapped;
+  stats->hits = c->hits;
+  stats->misses = c->misses;
+  stats->evictions = c->evictions;
+  cache_unlock(c);
+}
+
+SF3_EXPORT void sf3_cache_destroy(sf3_cache cache){
+  struct handle_cache *c = (struct handle_cache *)cache;
+  if(!c) return;
+#if defined(HAVE_HANDLE_CACHE)
+  cache_lock(c);
+  c->closing = 1;
+  while(c->lru_head){
+    struct cache_entry *entry = c->lru_head;
+    cache_lru_remove(c, entry);
+    if(!entry->stale) cache_unlink(c, entry);
+    cache_free_entry(c, entry);
+  }
+  // Handles that are still open keep the cache alive until the last
+  // one of them is closed.
+  if(c->live){
+    cache_unlock(c);
+    return;
+  }
+  cache_unlock(c);
+#endif
+  cache_free(c);
+}
+
+#define BUILDER_DEFAULT_RESERVE (64*1024)
+
+struct builder_entry{
+  char *path;
+  char *mime_type;
+  uint16_t path_length;
+  uint8_t mime_length;
+  int64_t modtime;
+  sf3_crc32_checksum checksum;
+  // The offset of the file's length field from the payload start.
+  uint64_t offset;
+};
+
+struct archive_builder{
+  int fd;
+  char *path;
+  struct sf3_allocator allocator;
+  struct builder_entry *entries;
+  size_t count;
+  size_t capacity;
+  uint64_t metadata_size;
+  // Where the payload region starts in the output file.
+  uint64_t reserve;
+  // How many bytes of the payload region have been emitted so far.
+  uint64_t written;
+  // The running checksum of the payload region, which we need to
+  // compute the file's checksum in the end without reading it back.
+  struct sf3_crc32_state crc;
+  uint8_t *buffer;
+  size_t buffered;
+};
+
+static int seek_write(int fd, uint64_t offset, const void *data, size_t size){
+  if(lseek(fd, (off_t)offset, SEEK_SET) == (off_t) -1) return 0;
+  return write_all(fd, data, size);
+}
+
+static int seek_read(int fd, uint64_t offset, void *data, size_t size){
+  if(lseek(fd, (off_t)offset, SEEK_SET) == (off_t) -1) return 0;
+  uint8_t *bytes = (uint8_t *)data;
+  while(0 < size){
+    ssize_t result = read(fd, bytes, size);
+    if(result <= 0) return 0;
+    bytes += result;
+    size -= result;
+  }
+  return 1;
+}
+
+static int builder_flush(struct archive_builder *b){
+  if(b->buffered == 0) return 1;
+  uint64_t offset = b->reserve + b->written - b->buffered;
+  if(!seek_write(b->fd, offset, b->buffer, b->buffered)) return 0;
+  b->buffered = 0;
+  return 1;
+}
+
+// Appends to the payload region, batching small writes together.
+static int builder_emit(struct archive_builder *b, const void *data, size_t size){
+  if(WRITE_CHUNK_SIZE - b->buffered < size){
+    if(!builder_flush(b)) return 0;
+    if(WRITE_CHUNK_SIZE <= size){
+      b->written += size;
+      return seek_write(b->fd, b->reserve + b->written - size, data, size);
+    }
+  }
+  memcpy(b->buffer+b->buffered, data, size);
+  b->buffered += size;
+  b->written += size;
+  return 1;
+}
+
+static int builder_write(struct archive_builder *b, const void *data, size_t size){
+  sf3_crc32_update(&b->crc, data, size);
+  return builder_emit(b, data, size);
+}
+
+static char *builder_string(struct archive_builder *b, const char *string, size_t length){
+  char *copy = (char *)allocator_malloc(&b->allocator, length);
+  if(copy) memcpy(copy, string, length);
+  return copy;
+}
+
+// Records a new entry whose payload of LENGTH bytes follows next.
+static struct builder_entry *builder_entry(struct archive_builder *b, const char *path, const char *mime_type, int64_t modtime, uint64_t length){
+  if(!mime_type) mime_type = "application/octet-stream";
+  size_t path_length = strlen(path)+1;
+  size_t mime_length = strlen(mime_type)+1;
+  if(UINT16_MAX < path_length || UINT8_MAX < mime_length){
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+  if(b->count == b->capacity){
+    size_t capacity = (b->capacity)? b->capacity*2 : 64;
+    struct builder_entry *entries = (struct builder_entry *)allocator_malloc(&b->allocator, capacity*sizeof(struct builder_entry));
+    if(!entries){
+      err = SF3_OUT_OF_MEMORY;
+      return 0;
+    }
+    if(b->entries){
+      memcpy(entries, b->entries, b->count*sizeof(struct builder_entry));
+      allocator_free(&b->allocator, b->entries);
+    }
+    b->entries = entries;
+    b->capacity = capacity;
+  }
+  struct builder_entry *entry = &b->entries[b->count];
+  entry->path = builder_string(b, path, path_length);
+  entry->mime_type = builder_string(b, mime_type, mime_length);
+  if(!entry->path || !entry->mime_type){
+    if(entry->path) allocator_free(&b->allocator, entry->path);
+    if(entry->mime_type) allocator_free(&b->allocator, entry->mime_type);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  entry->path_length = (uint16_t)path_length;
+  entry->mime_length = (uint8_t)mime_length;
+  entry->modtime = modtime;
+  entry->offset = b->written;
+  if(!builder_write(b, &length, sizeof(uint64_t))){
+    allocator_free(&b->allocator, entry->path);
+    allocator_free(&b->allocator, entry->mime_type);
+    err = SF3_WRITE_FAILED;
+    return 0;
+  }
+  b->count++;
+  b->metadata_size += sizeof(int64_t) + sizeof(sf3_crc32_checksum)
+    + sizeof(uint8_t) + mime_length + sizeof(uint16_t) + path_length;
+  return entry;
+}
+
+static void builder_free(struct archive_builder *b){
+  for(size_t i=0; i<b->count; ++i){
+    allocator_free(&b->allocator, b->entries[i].path);
+    allocator_free(&b->allocator, b->entries[i].mime_type);
+  }
+  if(b->entries) allocator_free(&b->allocator, b->entries);
+  if(b->buffer) allocator_free(&b->allocator, b->buffer);
+  if(0 <= b->fd) close(b->fd);
+  if(b->path) allocator_free(&b->allocator, b->path);
+  struct sf3_allocator allocator = b->allocator;
+  allocator_free(&allocator, b);
+}
+
+SF3_EXPORT int sf3_archive_builder_create(const char *path, size_t reserve, const struct sf3_allocator *allocator, sf3_archive_builder *builder){
+  err = SF3_OK;
+  struct archive_builder *b = (struct archive_builder *)allocator_calloc(allocator, 1, sizeof(struct archive_builder));
+  if(!b){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  if(allocator) b->allocator = *allocator;
+  b->fd = -1;
+  b->buffer = (uint8_t *)allocator_malloc(&b->allocator, WRITE_CHUNK_SIZE);
+  if(!b->buffer){
+    err = SF3_OUT_OF_MEMORY;
+    builder_free(b);
+    return 0;
+  }
+  b->path = builder_string(b, path, strlen(path)+1);
+  if(!b->path){
+    err = SF3_OUT_OF_MEMORY;
+    builder_free(b);
+    return 0;
+  }
+  b->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(b->fd == -1){
+    err = SF3_OPEN_FAILED;
+    builder_free(b);
+    return 0;
+  }
+  b->reserve = (reserve)? reserve : BUILDER_DEFAULT_RESERVE;
+  if(b->reserve < sizeof(struct sf3_archive)) b->reserve = sizeof(struct sf3_archive);
+  sf3_crc32_init(&b->crc);
+  *builder = b;
+  return 1;
+}
+
+SF3_EXPORT int sf3_archive_builder_add(sf3_archive_builder builder, const char *path, const char *mime_type, int64_t modtime, const void *data, size_t length){
+  err = SF3_OK;
+  struct archive_builder *b = (struct archive_builder *)builder;
+  struct builder_entry *entry = builder_entry(b, path, mime_type, modtime, length);
+  if(!entry) return 0;
+  entry->checksum = sf3_compute_checksum(data, length);
+  if(!builder_write(b, data, length)){
+    err = SF3_WRITE_FAILED;
+    return 0;
+  }
+  return 1;
+}
+
+SF3_EXPORT int sf3_archive_builder_add_checksummed(sf3_archive_builder builder, const char *path, const char *mime_type, int64_t modtime, const void *data, size_t length, sf3_crc32_checksum checksum){
+  err = SF3_OK;
+  struct archive_builder *b = (struct archive_builder *)builder;
+  struct builder_entry *entry = builder_entry(b, path, mime_type, modtime, length);
+  if(!entry) return 0;
+  entry->checksum = checksum;
+  // Fold the known checksum into the running one instead of passing
+  // the payload through the CRC again.
+  b->crc.crc = sf3_crc32_combine(sf3_crc32_final(&b->crc), checksum, length) ^ 0xFFFFFFFF;
+  b->crc.length += length;
+  if(!builder_emit(b, data, length)){
+    err = SF3_WRITE_FAILED;
+    return 0;
+  }
+  return 1;
+}
+
+SF3_EXPORT int sf3_archive_builder_add_fd(sf3_archive_builder builder, const char *path, const char *mime_type, int64_t modtime, int fd){
+  err = SF3_OK;
+  struct archive_builder *b = (struct archive_builder *)builder;
+  ssize_t size = file_size(fd);
+  if(size < 0 || lseek(fd, 0, SEEK_SET) == (off_t) -1){
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  struct builder_entry *entry = builder_entry(b, path, mime_type, modtime, (uint64_t)size);
+  if(!entry) return 0;
+  // Read straight into the write buffer, so that small members only
+  // ever get copied once.
+  struct sf3_crc32_state crc;
+  sf3_crc32_init(&crc);
+  for(uint64_t remaining = (uint64_t)size; 0 < remaining;){
+    if(b->buffered == WRITE_CHUNK_SIZE && !builder_flush(b)){
+      err = SF3_WRITE_FAILED;
+      return 0;
+    }
+    size_t chunk = WRITE_CHUNK_SIZE - b->buffered;
+    if(remaining < chunk) chunk = (size_t)remaining;
+    ssize_t result = read(fd, b->buffer+b->buffered, chunk);
+    if(result <= 0){
+      // The file shrank under us, and the length we wrote is wrong.
+      err = SF3_OPEN_FAILED;
+      return 0;
+    }
+    sf3_crc32_update(&crc, b->buffer+b->buffered, result);
+    sf3_crc32_update(&b->crc, b->buffer+b->buffered, result);
+    b->buffered += result;
+    b->written += result;
+    remaining -= result;
+  }
+  entry->checksum = sf3_crc32_final(&crc);
+  return 1;
+}
+
+// Moves the payload region further back, for when the tables did not
+// fit into the reserved space. Copies from the end, as the source and
+// destination may overlap.
+static int builder_shift(struct archive_builder *b, uint64_t reserve){
+  uint64_t end = b->written;
+  while(0 < end){
+    size_t chunk = (end < WRITE_CHUNK_SIZE)? (size_t)end : WRITE_CHUNK_SIZE;
+    end -= chunk;
+    if(!seek_read(b->fd, b->reserve+end, b->buffer, chunk)) return 0;
+    if(!seek_write(b->fd, reserve+end, b->buffer, chunk)) return 0;
+  }
+  b->reserve = reserve;
+  return 1;
+}
+
+SF3_EXPORT int sf3_archive_builder_finish(sf3_archive_builder builder){
+  err = SF3_OK;
+  struct archive_builder *b = (struct archive_builder *)builder;
+  if(!b){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  uint64_t count = b->count;
+  uint64_t head_size = sizeof(struct sf3_archive) + count*sizeof(uint64_t) + b->metadata_size + count*sizeof(uint64_t);
+  uint8_t *head = 0;
+  if(!builder_flush(b)) goto fail;
+  if(b->reserve < head_size && !builder_shift(b, head_size)) goto fail;
+  if(count == 0) b->reserve = head_size;
+  uint64_t gap = b->reserve - head_size;
+
+  head = (uint8_t *)allocator_calloc(&b->allocator, 1, head_size);
+  if(!head){
+    err = SF3_OUT_OF_MEMORY;
+    goto cleanup;
+  }
+  struct sf3_archive *archive = (struct sf3_archive *)head;
+  archive->count = count;
+  // The metadata size includes the entry offset table.
+  archive->metadata_size = count*sizeof(uint64_t) + b->metadata_size;
+  uint8_t *metadata = (uint8_t *)&archive->entry_offset[count];
+  uint64_t *file_offsets = (uint64_t *)(metadata + b->metadata_size);
+  uint8_t *cursor = metadata;
+  for(uint64_t i=0; i<count; ++i){
+    struct builder_entry *entry = &b->entries[i];
+    archive->entry_offset[i] = cursor - metadata;
+    memcpy(cursor, &entry->modtime, sizeof(int64_t));
+    cursor += sizeof(int64_t);
+    memcpy(cursor, &entry->checksum, sizeof(sf3_crc32_checksum));
+    cursor += sizeof(sf3_crc32_checksum);
+    *cursor++ = entry->mime_length;
+    memcpy(cursor, entry->mime_type, entry->mime_length);
+    cursor += entry->mime_length;
+    memcpy(cursor, &entry->path_length, sizeof(uint16_t));
+    cursor += sizeof(uint16_t);
+    memcpy(cursor, entry->path, entry->path_length);
+    cursor += entry->path_length;
+    uint64_t offset = gap + entry->offset;
+    memcpy(&file_offsets[i], &offset, sizeof(uint64_t));
+  }
+
+  // The file's checksum covers the tables, the unused rest of the
+  // reserved space, which is all zeroes, and the payload region.
+  struct sf3_crc32_state crc;
+  sf3_crc32_init(&crc);
+  sf3_crc32_update(&crc, head+sizeof(struct sf3_identifier), head_size-sizeof(struct sf3_identifier));
+  memset(b->buffer, 0, WRITE_CHUNK_SIZE);
+  for(uint64_t remaining = gap; 0 < remaining;){
+    size_t chunk = (remaining < WRITE_CHUNK_SIZE)? (size_t)remaining : WRITE_CHUNK_SIZE;
+    sf3_crc32_update(&crc, b->buffer, chunk);
+    remaining -= chunk;
+  }
+  sf3_crc32_checksum checksum = sf3_crc32_combine(sf3_crc32_final(&crc), sf3_crc32_final(&b->crc), b->written);
+  sf3_write_identifier(SF3_FORMAT_ID_ARCHIVE, checksum, head);
+  if(!seek_write(b->fd, 0, head, head_size)) goto fail;
+  // Make sure an unused reserve at the end of an empty archive does
+  // not stick around.
+  if(ftruncate(b->fd, b->reserve + b->written) != 0) goto fail;
+  allocator_free(&b->allocator, head);
+  builder_free(b);
+  return 1;
+
+ fail:
+  err = SF3_WRITE_FAILED;
+ cleanup:
+  if(head) allocator_free(&b->allocator, head);
+  sf3_archive_builder_abort(b);
+  return 0;
+}
+
+SF3_EXPORT void sf3_archive_builder_abort(sf3_archive_builder builder){
+  struct archive_builder *b = (struct archive_builder *)builder;
+  if(b){
+    if(0 <= b->fd) unlink(b->path);
+    builder_free(b);
+  }
+}
+
+#define ARCHIVE_INDEX_MAGIC "sf3index"
+// Also serves to reject sidecars written on a machine of the other
+// byte order, as the version then reads differently.
+#define ARCHIVE_INDEX_VERSION 1
+
+struct SF3_PACK archive_index_header{
+  char magic[8];
+  uint32_t version;
+  /// The checksum of the archive the index was built for.
+  sf3_crc32_checksum checksum;
+  uint64_t count;
+  /// The number of slots, always a power of two.
+  uint64_t capacity;
+};
+
+struct SF3_PACK archive_index_slot{
+  uint32_t hash;
+  /// The member index plus one, or zero if the slot is empty.
+  uint32_t index;
+};
+
+struct archive_index{
+  const struct sf3_archive *archive;
+  /// The header immediately followed by the slots, laid out exactly
+  /// as in the sidecar file.
+  struct archive_index_header *header;
+  struct archive_index_slot *slots;
+  size_t size;
+  int mapped;
+};
+
+// FNV-1a, which is cheap and distributes paths well enough.
+static uint32_t archive_path_hash(const char *path){
+  uint32_t hash = 2166136261u;
+  for(; *path; ++path){
+    hash ^= (uint8_t)*path;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct archive_index *archive_index_allocate(const struct sf3_archive *archive, size_t size){
+  struct archive_index *index = (struct archive_index *)sf3_calloc(1, sizeof(struct archive_index));
+  if(!index) return 0;
+  index->archive = archive;
+  index->size = size;
+  return index;
+}
+
+SF3_EXPORT int sf3_archive_index_build(const struct sf3_archive *archive, sf3_archive_index *index){
+  err = SF3_OK;
+  if(UINT32_MAX <= archive->count){
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+  // Keep the table at most half full so probe sequences stay short.
+  uint64_t capacity = 16;
+  while(capacity < archive->count*2) capacity *= 2;
+  size_t size = sizeof(struct archive_index_header) + capacity*sizeof(struct archive_index_slot);
+  struct archive_index *i = archive_index_allocate(archive, size);
+  if(i) i->header = (struct archive_index_header *)sf3_calloc(1, size);
+  if(!i || !i->header){
+    if(i) sf3_free(i);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  memcpy(i->header->magic, ARCHIVE_INDEX_MAGIC, sizeof(i->header->magic));
+  i->header->version = ARCHIVE_INDEX_VERSION;
+  i->header->checksum = archive->identifier.checksum;
+  i->header->count = archive->count;
+  i->header->capacity = capacity;
+  i->slots = (struct archive_index_slot *)(i->header+1);
+
+  uint64_t mask = capacity-1;
+  for(uint64_t m=0; m<archive->count; ++m){
+    const char *path = sf3_archive_meta_path(sf3_archive_meta_entry(archive, m));
+    uint32_t hash = archive_path_hash(path);
+    uint64_t s = hash & mask;
+    for(; i->slots[s].index; s = (s+1) & mask){
+      // On duplicate paths the first member wins.
+      if(i->slots[s].hash == hash
+         && strcmp(path, sf3_archive_meta_path(sf3_archive_meta_entry(archive, i->slots[s].index-1))) == 0)
+        break;
+    }
+    if(!i->slots[s].index){
+      i->slots[s].hash = hash;
+      i->slots[s].index = (uint32_t)(m+1);
+    }
+  }
+  *index = i;
+  return 1;
+}
+
+SF3_EXPORT int sf3_archive_index_load(const struct sf3_archive *archive, const char *path, sf3_archive_index *index){
+  err = SF3_OK;
+  int fd = open(path, O_RDONLY);
+  if(fd == -1){
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  struct archive_index_header header;
+  off_t size = lseek(fd, 0, SEEK_END);
+  if(size < (off_t)sizeof(header) || !seek_read(fd, 0, &header, sizeof(header))
+     || memcmp(header.magic, ARCHIVE_INDEX_MAGIC, sizeof(header.magic)) != 0
+     || header.version != ARCHIVE_INDEX_VERSION
+     || header.checksum != archive->identifier.checksum
+     || header.count != archive->count
+     || header.capacity == 0 || header.capacity < header.count || (header.capacity & (header.capacity-1)) != 0
+     // Divide rather than multiply, so that a huge capacity cannot wrap.
+     || ((uint64_t)size - sizeof(header)) / sizeof(struct archive_index_slot) < header.capacity
+     || (uint64_t)size != sizeof(header) + header.capacity*sizeof(struct archive_index_slot)){
+    close(fd);
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+  struct archive_index *i = archive_index_allocate(archive, (size_t)size);
+  if(!i){
+    close(fd);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+  void *addr = mmap(0, i->size, PROT_READ, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED){
+    close(fd);
+    sf3_free(i);
+    err = SF3_MMAP_FAILED;
+    return 0;
+  }
+  i->header = (struct archive_index_header *)addr;
+  i->mapped = 1;
+#else
+  i->header = (struct archive_index_header *)sf3_malloc(i->size);
+  if(!i->header || !seek_read(fd, 0, i->header, i->size)){
+    err = (i->header)? SF3_OPEN_FAILED : SF3_OUT_OF_MEMORY;
+    if(i->header) sf3_free(i->header);
+    close(fd);
+    sf3_free(i);
+    return 0;
+  }
+#endif
+  close(fd);
+  i->slots = (struct archive_index_slot *)(i->header+1);
+  *index = i;
+  return 1;
+}
+
+SF3_EXPORT int sf3_archive_index_save(sf3_archive_index index, const char *path){
+  err = SF3_OK;
+  struct archive_index *i = (struct archive_index *)index;
+#if defined(_WIN32)
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+  if(fd == -1){
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  int ok = write_all(fd, i->header, i->size);
+  close(fd);
+#else
+  // Write to a fresh file and rename it into place, so that readers
+  // which have the old sidecar mapped never see it change.
+  char *temporary = temporary_path(path);
+  if(!temporary){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  int fd = create_temporary(temporary);
+  if(fd == -1){
+    sf3_free(temporary);
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  copy_permissions(fd, path);
+  int ok = write_all(fd, i->header, i->size);
+  close(fd);
+  if(ok) ok = (rename(temporary, path) == 0);
+  if(!ok) unlink(temporary);
+  sf3_free(temporary);
+#endif
+  if(!ok) err = SF3_WRITE_FAILED;
+  return ok;
+}
+
+static int64_t archive_index_lookup(const struct archive_index *i, const char *path, uint32_t hash){
+  const struct sf3_archive *archive = i->archive;
+  uint64_t mask = i->header->capacity-1;
+  uint64_t s = hash & mask;
+  // Bound the probe so that a damaged sidecar cannot make us loop.
+  for(uint64_t probe=0; probe<=mask; ++probe, s = (s+1) & mask){
+    struct archive_index_slot slot = i->slots[s];
+    if(!slot.index) return -1;
+    if(slot.hash == hash && slot.index <= archive->count
+       && strcmp(path, sf3_archive_meta_path(sf3_archive_meta_entry(archive, slot.index-1))) == 0)
+      return (int64_t)slot.index-1;
+  }
+  return -1;
+}
+
+SF3_EXPORT int64_t sf3_archive_find(sf3_archive_index index, const char *path){
+  return archive_index_lookup((const struct archive_index *)index, path, archive_path_hash(path));
+}
+
+SF3_EXPORT void sf3_archive_index_free(sf3_archive_index index){
+  struct archive_index *i = (struct archive_index *)index;
+  if(!i) return;
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+  if(i->mapped) munmap(i->header, i->size);
+  else
+#endif
+    sf3_free(i->header);
+  sf3_free(i);
+}
+
+#define OVERLAY_BLOOM_BITS 10
+#define OVERLAY_BLOOM_HASHES 7
+#define OVERLAY_CACHE_MAX (1024*1024)
+// Cache slots pack the layer above the member index, so that a slot
+// can be read and written in one atomic operation.
+#define OVERLAY_INDEX_BITS 40
+
+struct overlay_name{
+  const char *path;
+  uint64_t index;
+};
+
+struct overlay_layer{
+  const struct sf3_archive *archive;
+  struct archive_index *index;
+  uint64_t *bloom;
+  uint64_t bloom_mask;
+  /// The members sorted by path, for listing by prefix.
+  struct overlay_name *names;
+};
+
+struct overlay{
+  struct overlay_layer *layers;
+  size_t count;
+  size_t capacity;
+  uint64_t *cache;
+  uint64_t cache_mask;
+};
+
+// Derives a second hash for double hashing in the Bloom filter from
+// the path hash the index uses, so that paths only need to be
+// hashed once per lookup however many layers there are.
+static uint32_t overlay_rehash(uint32_t hash){
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash | 1;
+}
+
+static void overlay_bloom_add(struct overlay_layer *layer, uint32_t hash){
+  uint32_t step = overlay_rehash(hash);
+  for(int k=0; k<OVERLAY_BLOOM_HASHES; ++k){
+    uint64_t bit = (hash + (uint64_t)k*step) & layer->bloom_mask;
+    layer->bloom[bit/64] |= (uint64_t)1 << (bit%64);
+  }
+}
+
+static int overlay_bloom_test(const struct overlay_layer *layer, uint32_t hash){
+  uint32_t step = overlay_rehash(hash);
+  for(int k=0; k<OVERLAY_BLOOM_HASHES; ++k){
+    uint64_t bit = (hash + (uint64_t)k*step) & layer->bloom_mask;
+    if(!(layer->bloom[bit/64] & ((uint64_t)1 << (bit%64)))) return 0;
+  }
+  return 1;
+}
+
+static int overlay_name_compare(const void *a, const void *b){
+  const struct overlay_name *x = (const struct overlay_name *)a;
+  const struct overlay_name *y = (const struct overlay_name *)b;
+  int order = strcmp(x->path, y->path);
+  if(order != 0) return order;
+  return (x->index < y->index)? -1 : (x->index > y->index);
+}
+
+static void overlay_layer_free(struct overlay_layer *layer){
+  if(layer->index) sf3_archive_index_free(layer->index);
+  if(layer->bloom) sf3_free(layer->bloom);
+  if(layer->names) sf3_free(layer->names);
+}
+
+static void overlay_entry(const struct overlay *o, size_t layer, uint64_t index, struct sf3_overlay_entry *entry){
+  const struct sf3_archive *archive = o->layers[layer].archive;
+  entry->layer = layer;
+  entry->index = index;
+  entry->meta = sf3_archive_meta_entry(archive, index);
+  entry->file = sf3_archive_file(archive, index);
+  entry->path = sf3_archive_meta_path(entry->meta);
+}
+
+SF3_EXPORT int sf3_overlay_create(sf3_overlay *overlay){
+  err = SF3_OK;
+  struct overlay *o = (struct overlay *)sf3_calloc(1, sizeof(struct overlay));
+  if(!o){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  *overlay = o;
+  return 1;
+}
+
+SF3_EXPORT int sf3_overlay_push(sf3_overlay overlay, const struct sf3_archive *archive, sf3_archive_index index){
+  err = SF3_OK;
+  struct overlay *o = (struct overlay *)overlay;
+  struct overlay_layer layer = {0};
+  layer.archive = archive;
+  layer.index = (struct archive_index *)index;
+  if(!layer.index && !sf3_archive_index_build(archive, (sf3_archive_index *)&layer.index))
+    return 0;
+  if(layer.index->archive != archive){
+    if(!index) sf3_archive_index_free(layer.index);
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+
+  uint64_t bits = 64;
+  while(bits < archive->count*OVERLAY_BLOOM_BITS) bits *= 2;
+  layer.bloom_mask = bits-1;
+  layer.bloom = (uint64_t *)sf3_calloc(bits/64, sizeof(uint64_t));
+  layer.names = (struct overlay_name *)sf3_calloc(archive->count+1, sizeof(struct overlay_name));
+  size_t total = archive->count;
+  for(size_t l=0; l<o->count; ++l) total += o->layers[l].archive->count;
+  uint64_t cache_size = 1024;
+  while(cache_size < total && cache_size < OVERLAY_CACHE_MAX) cache_size *= 2;
+  uint64_t *cache = (uint64_t *)sf3_calloc(cache_size, sizeof(uint64_t));
+  if(o->count == o->capacity){
+    size_t capacity = (o->capacity)? o->capacity*2 : 8;
+    struct overlay_layer *layers = (struct overlay_layer *)sf3_calloc(capacity, sizeof(struct overlay_layer));
+    if(layers){
+      if(o->layers){
+        memcpy(layers, o->layers, o->count*sizeof(struct overlay_layer));
+        sf3_free(o->layers);
+      }
+      o->layers = layers;
+      o->capacity = capacity;
+    }
+  }
+  if(!layer.bloom || !layer.names || !cache || o->count == o->capacity){
+    if(cache) sf3_free(cache);
+    if(index) layer.index = 0;
+    overlay_layer_free(&layer);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+
+  for(uint64_t m=0; m<archive->count; ++m){
+    const char *path = sf3_archive_meta_path(sf3_archive_meta_entry(archive, m));
+    overlay_bloom_add(&layer, archive_path_hash(path));
+    layer.names[m].path = path;
+    layer.names[m].index = m;
+  }
+  qsort(layer.names, archive->count, sizeof(struct overlay_name), overlay_name_compare);
+
+  // The new layer may shadow members that are cached from below.
+  if(o->cache) sf3_free(o->cache);
+  o->cache = cache;
+  o->cache_mask = cache_size-1;
+  o->layers[o->count++] = layer;
+  return 1;
+}
+
+SF3_EXPORT size_t sf3_overlay_layers(sf3_overlay overlay){
+  return ((struct overlay *)overlay)->count;
+}
+
+SF3_EXPORT const struct sf3_file *sf3_overlay_find(sf3_overlay overlay, const char *path, struct sf3_overlay_entry *entry){
+  const struct overlay *o = (const struct overlay *)overlay;
+  if(o->count == 0) return 0;
+  uint32_t hash = archive_path_hash(path);
+  uint64_t *slot = &o->cache[hash & o->cache_mask];
+  uint64_t cached = atomic_load(slot);
+  if(cached){
+    size_t layer = (size_t)(cached >> OVERLAY_INDEX_BITS)-1;
+    uint64_t index = cached & (((uint64_t)1 << OVERLAY_INDEX_BITS)-1);
+    // The slot may belong to a different path with the same bucket.
+    const struct sf3_archive *archive = o->layers[layer].archive;
+    if(strcmp(path, sf3_archive_meta_path(sf3_archive_meta_entry(archive, index))) == 0){
+      if(entry) overlay_entry(o, layer, index, entry);
+      return sf3_archive_file(archive, index);
+    }
+  }
+  for(size_t layer=o->count; 0 < layer--;){
+    if(!overlay_bloom_test(&o->layers[layer], hash)) continue;
+    int64_t index = archive_index_lookup(o->layers[layer].index, path, hash);
+    if(index < 0) continue;
+    atomic_store(slot, ((uint64_t)(layer+1) << OVERLAY_INDEX_BITS) | (uint64_t)index);
+    if(entry) overlay_entry(o, layer, (uint64_t)index, entry);
+    return sf3_archive_file(o->layers[layer].archive, (uint64_t)index);
+  }
+  return 0;
+}
+
+// Returns the position of the first name in the layer that is not
+// ordered before PREFIX.
+static size_t overlay_lower_bound(const struct overlay_layer *layer, const char *prefix){
+  size_t low = 0, high = (size_t)layer->archive->count;
+  while(low < high){
+    size_t mid = low + (high-low)/2;
+    if(strcmp(layer->names[mid].path, prefix) < 0) low = mid+1;
+    else high = mid;
+  }
+  return low;
+}
+
+SF3_EXPORT size_t sf3_overlay_list(sf3_overlay overlay, const char *prefix, int (*callback)(const struct sf3_overlay_entry *entry, void *user), void *user){
+  err = SF3_OK;
+  const struct overlay *o = (const struct overlay *)overlay;
+  if(!prefix) prefix = "";
+  size_t prefix_length = strlen(prefix);
+  size_t *cursors = (size_t *)sf3_calloc(o->count+1, sizeof(size_t));
+  if(!cursors){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  for(size_t l=0; l<o->count; ++l)
+    cursors[l] = overlay_lower_bound(&o->layers[l], prefix);
+
+  // Merge the sorted runs of all layers. On equal paths the topmost
+  // layer wins, and the members it shadows are skipped.
+  size_t listed = 0;
+  while(1){
+    const char *best = 0;
+    size_t best_layer = 0;
+    for(size_t l=o->count; 0 < l--;){
+      const struct overlay_layer *layer = &o->layers[l];
+      if(layer->archive->count <= cursors[l]) continue;
+      const char *path = layer->names[cursors[l]].path;
+      if(strncmp(path, prefix, prefix_length) != 0) continue;
+      if(!best || strcmp(path, best) < 0){
+        best = path;
+        best_layer = l;
+      }
+    }
+    if(!best) break;
+    struct sf3_overlay_entry entry;
+    overlay_entry(o, best_layer, o->layers[best_layer].names[cursors[best_layer]].index, &entry);
+    for(size_t l=0; l<o->count; ++l){
+      const struct overlay_layer *layer = &o->layers[l];
+      while(cursors[l] < layer->archive->count && strcmp(layer->names[cursors[l]].path, entry.path) == 0)
+        cursors[l]++;
+    }
+    ++listed;
+    if(!callback(&entry, user)) break;
+  }
+  sf3_free(cursors);
+  return listed;
+}
+
+SF3_EXPORT void sf3_overlay_free(sf3_overlay overlay){
+  struct overlay *o = (struct overlay *)overlay;
+  if(!o) return;
+  for(size_t l=0; l<o->count; ++l)
+    overlay_layer_free(&o->layers[l]);
+  if(o->layers) sf3_free(o->layers);
+  if(o->cache) sf3_free(o->cache);
+  sf3_free(o);
+}
+
+// Each member takes two bits of a handle's verification bitmap.
+#define MEMBER_CHECKED 0x1
+#define MEMBER_CORRUPT 0x2
+#define MEMBERS_PER_WORD 32
+
+// Returns the archive in the handle, after making sure that its
+// tables lie within the file, so that members can be looked up.
+static const struct sf3_archive *handle_archive(struct handle *h){
+  if(!h || !h->addr){
+    err = SF3_INVALID_HANDLE;
+    return 0;
+  }
+  const struct sf3_archive *archive = (const struct sf3_archive *)h->addr;
+  size_t tables = h->size - sizeof(struct sf3_archive);
+  if(h->size < sizeof(struct sf3_archive)
+     || sf3_check(h->addr, h->size) != SF3_FORMAT_ID_ARCHIVE
+     || tables < archive->metadata_size
+     || archive->metadata_size / sizeof(uint64_t) < archive->count
+     || (tables - archive->metadata_size) / sizeof(uint64_t) < archive->count){
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+  return archive;
+}
+
+// Returns the member's contents and stored checksum, or null if the
+// member does not lie within the file.
+static const struct sf3_file *member_file(const struct handle *h, const struct sf3_archive *archive, uint64_t index, sf3_crc32_checksum *checksum){
+  uint64_t entries = archive->metadata_size - archive->count*sizeof(uint64_t);
+  if(entries < sizeof(struct sf3_archive_meta) || entries - sizeof(struct sf3_archive_meta) < archive->entry_offset[index])
+    return 0;
+  *checksum = sf3_archive_meta_entry(archive, index)->checksum;
+  const uint8_t *offsets = (const uint8_t *)&archive->entry_offset[0] + archive->metadata_size;
+  uint64_t base = (offsets - (const uint8_t *)h->addr) + archive->count*sizeof(uint64_t);
+  uint64_t offset = ((const uint64_t *)offsets)[index];
+  if(h->size - base < sizeof(uint64_t) || h->size - base - sizeof(uint64_t) < offset)
+    return 0;
+  const struct sf3_file *file = (const struct sf3_file *)((const uint8_t *)h->addr + base + offset);
+  if(h->size - base - offset - sizeof(uint64_t) < file->length)
+    return 0;
+  return file;
+}
+
+static uint64_t *handle_verified(struct handle *h, uint64_t count){
+  uint64_t *verified = atomic_load(&h->verified);
+  if(verified) return verified;
+  // This may be called from several threads at once, so the bitmap
+  // comes from the global allocator rather than the handle's, which
+  // need not be thread-safe.
+  uint64_t *fresh = (uint64_t *)sf3_calloc((size_t)(count/MEMBERS_PER_WORD+1), sizeof(uint64_t));
+  if(!fresh){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  if(atomic_compare_exchange(&h->verified, &verified, fresh))
+    return fresh;
+  // Someone else was faster.
+  sf3_free(fresh);
+  return verified;
+}
+
+static int member_state(uint64_t *verified, uint64_t index){
+  uint64_t word = atomic_load(&verified[index/MEMBERS_PER_WORD]);
+  return (int)(word >> (2*(index%MEMBERS_PER_WORD))) & (MEMBER_CHECKED | MEMBER_CORRUPT);
+}
+
+static void record_member(uint64_t *verified, uint64_t index, int corrupt){
+  uint64_t state = MEMBER_CHECKED | ((corrupt)? MEMBER_CORRUPT : 0);
+  atomic_fetch_or(&verified[index/MEMBERS_PER_WORD], state << (2*(index%MEMBERS_PER_WORD)));
+}
+
+SF3_EXPORT int sf3_archive_verify_member(sf3_handle handle, uint64_t index){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  const struct sf3_archive *archive = handle_archive(h);
+  if(!archive) return 0;
+  if(archive->count <= index){
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+  uint64_t *verified = handle_verified(h, archive->count);
+  if(!verified) return 0;
+  int state = member_state(verified, index);
+  if(!(state & MEMBER_CHECKED)){
+    sf3_crc32_checksum checksum;
+    const struct sf3_file *file = member_file(h, archive, index, &checksum);
+    int corrupt = !file || sf3_compute_checksum(file->data, file->length) != checksum;
+    record_member(verified, index, corrupt);
+    state = (corrupt)? MEMBER_CORRUPT : 0;
+  }
+  if(state & MEMBER_CORRUPT){
+    err = SF3_CHECKSUM_MISMATCH;
+    return 0;
+  }
+  return 1;
+}
+
+struct member_verify_job{
+  size_t block;
+  /// The members that still need checking.
+  uint64_t *pending;
+  const struct sf3_file **files;
+  /// The first block of each pending member, plus one past the last.
+  size_t *first;
+  size_t pending_count;
+  sf3_crc32_checksum *checksums;
+};
+
+// Members are split into blocks so that a few large members do not
+// end up on a single thread.
+static void verify_member_block(size_t index, void *data){
+  struct member_verify_job *job = (struct member_verify_job *)data;
+  size_t low = 0, high = job->pending_count;
+  while(low+1 < high){
+    size_t mid = low + (high-low)/2;
+    if(job->first[mid] <= index) low = mid;
+    else high = mid;
+  }
+  const struct sf3_file *file = job->files[low];
+  size_t start = (index - job->first[low]) * job->block;
+  size_t size = file->length - start;
+  if(job->block < size) size = job->block;
+  job->checksums[index] = sf3_compute_checksum(file->data+start, size);
+}
+
+SF3_EXPORT int sf3_archive_verify_all(sf3_handle handle, unsigned int threads, uint64_t *corrupt, size_t *count){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  size_t capacity = (corrupt && count)? *count : 0;
+  if(count) *count = 0;
+  const struct sf3_archive *archive = handle_archive(h);
+  if(!archive) return 0;
+  uint64_t *verified = handle_verified(h, archive->count);
+  if(!verified) return 0;
+
+  struct member_verify_job job = {0};
+  job.block = VERIFY_MIN_BLOCK;
+  for(uint64_t i=0; i<archive->count; ++i){
+    if(!(member_state(verified, i) & MEMBER_CHECKED)) job.pending_count++;
+  }
+  if(job.pending_count){
+    job.pending = (uint64_t *)sf3_calloc(job.pending_count, sizeof(uint64_t));
+    job.files = (const struct sf3_file **)sf3_calloc(job.pending_count, sizeof(struct sf3_file *));
+    job.first = (size_t *)sf3_calloc(job.pending_count+1, sizeof(size_t));
+    if(!job.pending || !job.files || !job.first){
+      err = SF3_OUT_OF_MEMORY;
+      goto cleanup;
+    }
+    size_t p = 0, blocks = 0;
+    for(uint64_t i=0; i<archive->count && p<job.pending_count; ++i){
+      if(member_state(verified, i) & MEMBER_CHECKED) continue;
+      sf3_crc32_checksum checksum;
+      job.pending[p] = i;
+      job.files[p] = member_file(h, archive, i, &checksum);
+      job.first[p] = blocks;
+      // Members out of bounds get no blocks and are corrupt anyway.
+      if(!job.files[p]) record_member(verified, i, 1);
+      else blocks += (job.files[p]->length + job.block - 1) / job.block + (job.files[p]->length == 0);
+      ++p;
+    }
+    job.pending_count = p;
+    job.first[p] = blocks;
+    job.checksums = (sf3_crc32_checksum *)sf3_calloc(blocks+1, sizeof(sf3_crc32_checksum));
+    if(!job.checksums){
+      err = SF3_OUT_OF_MEMORY;
+      goto cleanup;
+    }
+    // Members without blocks are never picked by the search, as the
+    // next member starts on the same block.
+    parallel_for(threads, blocks, verify_member_block, &job);
+
+    for(p=0; p<job.pending_count; ++p){
+      if(!job.files[p]) continue;
+      sf3_crc32_checksum checksum = job.checksums[job.first[p]];
+      uint64_t length = job.files[p]->length;
+      for(size_t b=job.first[p]+1; b<job.first[p+1]; ++b){
+        size_t size = (b+1 < job.first[p+1])? job.block : length - (b-job.first[p])*job.block;
+        checksum = sf3_crc32_combine(checksum, job.checksums[b], size);
+      }
+      record_member(verified, job.pending[p], checksum != sf3_archive_meta_entry(archive, job.pending[p])->checksum);
+    }
+  }
+
+  size_t found = 0;
+  for(uint64_t i=0; i<archive->count; ++i){
+    if(member_state(verified, i) & MEMBER_CORRUPT){
+      if(found < capacity) corrupt[found] = i;
+      ++found;
+    }
+  }
+  if(count) *count = found;
+  if(found) err = SF3_CHECKSUM_MISMATCH;
+
+ cleanup:
+  if(job.pending) sf3_free(job.pending);
+  if(job.files) sf3_free(job.files);
+  if(job.first) sf3_free(job.first);
+  if(job.checksums) sf3_free(job.checksums);
+  return err == SF3_OK;
+}
+
+static void retain_handle(struct handle *h){
+#if defined(HAVE_HANDLE_CACHE)
+  // Cached handles are shared, and their entry counts the references.
+  if(h->cache){
+    atomic_fetch_add(&((struct cache_entry *)h)->refs, 1);
+    return;
+  }
+#endif
+  atomic_fetch_add(&h->refs, 1);
+}
+
+SF3_EXPORT int sf3_archive_open_member(sf3_handle handle, uint64_t index, sf3_handle *member){
+  err = SF3_OK;
+  struct handle *h = (struct handle *)handle;
+  const struct sf3_archive *archive = handle_archive(h);
+  if(!archive) return 0;
+  if(archive->count <= index){
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+  sf3_crc32_checksum checksum;
+  const struct sf3_file *file = member_file(h, archive, index, &checksum);
+  int type = (file)? sf3_check(file->data, file->length) : 0;
+  if(!type){
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+  struct handle *m = (struct handle *)allocator_calloc(&h->allocator, 1, sizeof(struct handle));
+  if(!m){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  m->mode = SF3_OPEN_READ_ONLY;
+#if defined(_WIN32)
+  m->fd = NULL;
+  m->handle = NULL;
+#else
+  m->fd = -1;
+#endif
+  m->addr = (void *)file->data;
+  m->size = file->length;
+  m->allocator = h->allocator;
+  m->parent = h;
+  retain_handle(h);
+  *member = m;
+  return type;
+}
+
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+#define HAVE_LOG_WRITER 1
+#define LOG_DEFAULT_CHUNK_SIZE (1024*1024)
+#define LOG_MAX_CHUNK_SIZE ((size_t)1 << 31)
+// The default number of entries per chunk assumes entries of about
+// this many bytes.
+#define LOG_TYPICAL_ENTRY_SIZE 128
+// Reservations count entries in the upper and bytes in the lower
+// half of a single word, so that both can be taken at once.
+#define LOG_RESERVE_ENTRY ((uint64_t)1 << 32)
+#define LOG_RESERVE_BYTES (LOG_RESERVE_ENTRY-1)
+
+struct log_chunk_state{
+  uint64_t reserved;
+  /// The number of entries that fit into the chunk, which is known
+  /// once a reservation overflowed it.
+  uint32_t limit;
+  /// Which entries have been written completely.
+  uint64_t *done;
+  /// The number of entries counted in the file.
+  uint32_t published;
+};
+
+struct log_writer{
+  int fd;
+  uint8_t *addr;
+  /// The length of the mapping, which covers the largest size the
+  /// file may grow to, so that it never has to move.
+  size_t mapped;
+  size_t size;
+  size_t chunk_size;
+  uint32_t capacity;
+  /// The size of a chunk's header including its offset table.
+  uint64_t chunk_header;
+  uint32_t max_chunks;
+  uint32_t current;
+  /// The time of the last entry counted in the file.
+  uint64_t last_time;
+  struct log_chunk_state *chunks;
+#if defined(HAVE_THREADS)
+  mutex_t lock;
+#endif
+};
+
+#if defined(HAVE_THREADS)
+#define log_lock(W) mutex_lock(&(W)->lock)
+#define log_unlock(W) mutex_unlock(&(W)->lock)
+#else
+#define log_lock(W)
+#define log_unlock(W)
+#endif
+
+static int64_t current_millis(){
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+static struct sf3_log *log_header(struct log_writer *w){
+  return (struct sf3_log *)w->addr;
+}
+
+static struct sf3_log_chunk *log_chunk(struct log_writer *w, uint32_t index){
+  return (struct sf3_log_chunk *)(w->addr + sizeof(struct sf3_log) + (size_t)index*w->chunk_size);
+}
+
+static int extend_file(int fd, size_t from, size_t to){
+#if defined(HAVE_FALLOCATE)
+  if(fallocate(fd, 0, (off_t)from, (off_t)(to-from)) == 0) return 1;
+#endif
+  return ftruncate(fd, (off_t)to) == 0;
+}
+
+// Appends a fresh chunk to the file. The new chunk only becomes
+// visible to appending threads once the current index moves to it.
+static int log_add_chunk(struct log_writer *w){
+  struct sf3_log *log = log_header(w);
+  uint32_t index = log->chunk_count;
+  if(w->max_chunks <= index) return 0;
+  struct log_chunk_state *state = &w->chunks[index];
+  state->done = (uint64_t *)sf3_calloc(w->capacity/64+1, sizeof(uint64_t));
+  if(!state->done) return 0;
+  if(!extend_file(w->fd, w->size, w->size+w->chunk_size)){
+    sf3_free(state->done);
+    state->done = 0;
+    return 0;
+  }
+  w->size += w->chunk_size;
+  state->limit = UINT32_MAX;
+  struct sf3_log_chunk *chunk = log_chunk(w, index);
+  chunk->size = w->chunk_size;
+  chunk->entry_count = 0;
+  chunk->entry_offset[0] = w->chunk_header;
+  uint16_t count = (uint16_t)(index+1);
+  // Go through the file rather than the mapping for the counts, so
+  // that anyone watching the file is notified.
+  return pwrite_all(w->fd, &count, sizeof(count), offsetof(struct sf3_log, chunk_count));
+}
+
+// Counts the entries of the chunk up to UPTO that have been written
+// in the file. If WAIT is set, this waits for the threads that are
+// still writing them, otherwise it stops at the first unfinished one.
+static int log_publish(struct log_writer *w, uint32_t index, uint32_t upto, int wait){
+  struct log_chunk_state *state = &w->chunks[index];
+  struct sf3_log_chunk *chunk = log_chunk(w, index);
+  uint32_t count = state->published;
+  for(; count<upto; ++count){
+    while(!(atomic_load(&state->done[count/64]) & ((uint64_t)1 << (count%64)))){
+      if(!wait) break;
+      // UPTO may come from a later overflowing entry that stored its
+      // limit first. The entries before it that overflowed as well
+      // are never written, but lower the limit once they notice.
+      if(atomic_load(&state->limit) <= count) break;
+#if defined(HAVE_THREADS)
+      sched_yield();
+#endif
+    }
+    if(!(atomic_load(&state->done[count/64]) & ((uint64_t)1 << (count%64)))) break;
+    // Entries are reserved in one order and timestamped in another,
+    // so threads racing each other may leave the times slightly out
+    // of order. Readers rely on them never decreasing.
+    struct sf3_log_entry *entry = (struct sf3_log_entry *)(((uint8_t *)chunk) + chunk->entry_offset[count]);
+    if(entry->time < w->last_time) entry->time = w->last_time;
+    w->last_time = entry->time;
+  }
+  if(count == state->published) return 1;
+  state->published = count;
+  return pwrite_all(w->fd, &count, sizeof(count), ((uint8_t *)&chunk->entry_count) - w->addr);
+}
+
+// The number of entries that were reserved successfully in the chunk.
+static uint32_t log_reserved_entries(struct log_writer *w, uint32_t index){
+  struct log_chunk_state *state = &w->chunks[index];
+  uint32_t reserved = (uint32_t)(atomic_load(&state->reserved) >> 32);
+  uint32_t limit = atomic_load(&state->limit);
+  if(limit < reserved) reserved = limit;
+  if(w->capacity < reserved) reserved = w->capacity;
+  return reserved;
+}
+
+static int log_roll(struct log_writer *w, uint32_t index){
+  struct log_chunk_state *state = &w->chunks[index];
+  if(!log_publish(w, index, log_reserved_entries(w, index), 1)) return 0;
+  if(!log_add_chunk(w)) return 0;
+  // Nobody is going to write into the old chunk anymore.
+  sf3_free(state->done);
+  state->done = 0;
+  atomic_store(&w->current, index+1);
+  return 1;
+}
+
+static int log_append(struct log_writer *w, uint64_t time, int8_t severity, const char *source, const char *category, const char *message){
+  size_t source_length = strlen(source)+1;
+  size_t category_length = strlen(category)+1;
+  size_t message_length = strlen(message)+1;
+  uint32_t size = (uint32_t)(sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint8_t)
+                             + sizeof(uint8_t) + source_length
+                             + sizeof(uint8_t) + category_length
+                             + sizeof(uint16_t) + message_length);
+  if(UINT8_MAX < source_length || UINT8_MAX < category_length || UINT16_MAX < message_length
+     || w->chunk_size - w->chunk_header < size){
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+  for(;;){
+    uint32_t index = atomic_load(&w->current);
+    struct log_chunk_state *state = &w->chunks[index];
+    uint64_t reserved = atomic_fetch_add(&state->reserved, LOG_RESERVE_ENTRY + size);
+    uint32_t entry = (uint32_t)(reserved >> 32);
+    uint64_t offset = w->chunk_header + (reserved & LOG_RESERVE_BYTES);
+    if(entry < w->capacity && offset + size <= w->chunk_size){
+      struct sf3_log_chunk *chunk = log_chunk(w, index);
+      uint8_t *base = ((uint8_t *)chunk) + offset;
+      uint8_t source_size = (uint8_t)source_length;
+      uint8_t category_size = (uint8_t)category_length;
+      uint16_t message_size = (uint16_t)message_length;
+      memcpy(base, &size, sizeof(uint32_t)); base += sizeof(uint32_t);
+      memcpy(base, &time, sizeof(uint64_t)); base += sizeof(uint64_t);
+      *base++ = (uint8_t)severity;
+      *base++ = source_size;
+      memcpy(base, source, source_length); base += source_length;
+      *base++ = category_size;
+      memcpy(base, category, category_length); base += category_length;
+      memcpy(base, &message_size, sizeof(uint16_t)); base += sizeof(uint16_t);
+      memcpy(base, message, message_length);
+      chunk->entry_offset[entry] = offset;
+      atomic_fetch_or(&state->done[entry/64], (uint64_t)1 << (entry%64));
+      return 1;
+    }
+    // The chunk is full. Reservations only ever grow, so the first
+    // one to overflow tells how many entries made it in. Whoever gets
+    // the lock first then moves everyone on to a fresh chunk.
+    uint32_t limit = atomic_load(&state->limit);
+    while(entry < limit && !atomic_compare_exchange(&state->limit, &limit, entry));
+    int ok = 1;
+    log_lock(w);
+    if(atomic_load(&w->current) == index) ok = log_roll(w, index);
+    log_unlock(w);
+    if(!ok){
+      err = SF3_WRITE_FAILED;
+      return 0;
+    }
+  }
+}
+
+static void log_writer_free(struct log_writer *w){
+  if(w->chunks){
+    for(uint32_t i=0; i<w->max_chunks; ++i){
+      if(w->chunks[i].done) sf3_free(w->chunks[i].done);
+    }
+    sf3_free(w->chunks);
+  }
+  if(w->addr) munmap(w->addr, w->mapped);
+  if(0 <= w->fd) close(w->fd);
+#if defined(HAVE_THREADS)
+  mutex_destroy(&w->lock);
+#endif
+  sf3_free(w);
+}
+#endif
+
+SF3_EXPORT int sf3_log_writer_create(const char *path, int64_t start, size_t chunk_size, uint32_t chunk_entries, sf3_log_writer *writer){
+  err = SF3_OK;
+#if defined(HAVE_LOG_WRITER)
+  if(chunk_size == 0) chunk_size = LOG_DEFAULT_CHUNK_SIZE;
+  if(chunk_entries == 0) chunk_entries = (uint32_t)(chunk_size / LOG_TYPICAL_ENTRY_SIZE);
+  uint64_t chunk_header = sizeof(struct sf3_log_chunk) + (uint64_t)chunk_entries*sizeof(uint64_t);
+  if(LOG_MAX_CHUNK_SIZE < chunk_size || chunk_entries == 0 || chunk_size <= chunk_header){
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+  struct log_writer *w = (struct log_writer *)sf3_calloc(1, sizeof(struct log_writer));
+  if(!w){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+#if defined(HAVE_THREADS)
+  mutex_init(&w->lock);
+#endif
+  w->chunk_size = chunk_size;
+  w->capacity = chunk_entries;
+  w->chunk_header = chunk_header;
+  w->size = sizeof(struct sf3_log);
+  w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(w->fd == -1){
+    err = SF3_OPEN_FAILED;
+    log_writer_free(w);
+    return 0;
+  }
+  // Reserve address space for as many chunks as the format allows,
+  // or as many as we can get. Pages past the end of the file are
+  // never touched, as the file is extended before a chunk is used.
+  w->max_chunks = UINT16_MAX;
+  w->addr = MAP_FAILED;
+  while(w->addr == MAP_FAILED && 0 < w->max_chunks){
+    w->mapped = sizeof(struct sf3_log) + (size_t)w->max_chunks*chunk_size;
+    w->addr = (uint8_t *)mmap(0, w->mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, w->fd, 0);
+    if(w->addr == MAP_FAILED) w->max_chunks /= 2;
+  }
+  if(w->addr == MAP_FAILED){
+    w->addr = 0;
+    err = SF3_MMAP_FAILED;
+    log_writer_free(w);
+    return 0;
+  }
+  w->chunks = (struct log_chunk_state *)sf3_calloc(w->max_chunks, sizeof(struct log_chunk_state));
+  if(!w->chunks || !extend_file(w->fd, 0, w->size)){
+    err = (w->chunks)? SF3_WRITE_FAILED : SF3_OUT_OF_MEMORY;
+    log_writer_free(w);
+    return 0;
+  }
+  struct sf3_log *log = log_header(w);
+  // The checksum is only filled in once the log is closed.
+  sf3_write_identifier(SF3_FORMAT_ID_LOG, 0, log);
+  log->start = (start)? start : current_millis()/1000;
+  log->end = INT64_MAX;
+  log->chunk_count = 0;
+  if(!log_add_chunk(w)){
+    err = SF3_WRITE_FAILED;
+    log_writer_free(w);
+    unlink(path);
+    return 0;
+  }
+  *writer = w;
+  return 1;
+#else
+  err = SF3_MMAP_FAILED;
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_log_append(sf3_log_writer writer, int8_t severity, const char *source, const char *category, const char *message){
+  err = SF3_OK;
+#if defined(HAVE_LOG_WRITER)
+  struct log_writer *w = (struct log_writer *)writer;
+  int64_t time = current_millis() - log_header(w)->start*1000;
+  return log_append(w, (time < 0)? 0 : (uint64_t)time, severity, source, category, message);
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_log_append_at(sf3_log_writer writer, uint64_t time, int8_t severity, const char *source, const char *category, const char *message){
+  err = SF3_OK;
+#if defined(HAVE_LOG_WRITER)
+  return log_append((struct log_writer *)writer, time, severity, source, category, message);
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_log_writer_flush(sf3_log_writer writer){
+  err = SF3_OK;
+#if defined(HAVE_LOG_WRITER)
+  struct log_writer *w = (struct log_writer *)writer;
+  log_lock(w);
+  uint32_t index = atomic_load(&w->current);
+  int ok = log_publish(w, index, log_reserved_entries(w, index), 0);
+  log_unlock(w);
+  if(!ok) err = SF3_WRITE_FAILED;
+  return ok;
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_log_writer_close(sf3_log_writer writer){
+  err = SF3_OK;
+#if defined(HAVE_LOG_WRITER)
+  struct log_writer *w = (struct log_writer *)writer;
+  uint32_t index = w->current;
+  struct log_chunk_state *state = &w->chunks[index];
+  int ok = log_publish(w, index, log_reserved_entries(w, index), 1);
+
+  // Cut the last chunk down to what it actually holds.
+  struct sf3_log_chunk *chunk = log_chunk(w, index);
+  uint64_t used = w->chunk_size;
+  if(state->limit == UINT32_MAX) used = w->chunk_header + (state->reserved & LOG_RESERVE_BYTES);
+  chunk->size = used;
+  size_t size = w->size - w->chunk_size + used;
+
+  struct sf3_log *log = log_header(w);
+  log->end = log->start + (int64_t)((w->last_time+999)/1000);
+  if(log->end < log->start) log->end = log->start;
+  sf3_crc32_checksum checksum = checksum_parallel(w->addr+sizeof(struct sf3_identifier), size-sizeof(struct sf3_identifier), 0);
+  sf3_write_identifier(SF3_FORMAT_ID_LOG, checksum, log);
+  ok = ok && msync(w->addr, size, MS_SYNC) == 0;
+  munmap(w->addr, w->mapped);
+  w->addr = 0;
+  ok = ok && ftruncate(w->fd, (off_t)size) == 0;
+  log_writer_free(w);
+  if(!ok) err = SF3_WRITE_FAILED;
+  return ok;
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+struct log_index_chunk{
+  const struct sf3_log_chunk *chunk;
+  uint64_t min;
+  uint64_t max;
+};
+
+struct log_index{
+  const struct sf3_log *log;
+  /// Only chunks that hold any entries are listed.
+  struct log_index_chunk *chunks;
+  uint32_t count;
+  /// Whether the chunks follow each other in time, so that they can
+  /// be searched rather than scanned.
+  int ordered;
+};
+
+static uint64_t log_entry_time(const struct sf3_log_chunk *chunk, uint32_t entry){
+  return ((const struct sf3_log_entry *)(((const uint8_t *)chunk)+chunk->entry_offset[entry]))->time;
+}
+
+// Returns the first entry of the chunk whose time is not before TIME.
+static uint32_t log_chunk_lower_bound(const struct sf3_log_chunk *chunk, uint64_t time){
+  uint32_t first = 0, count = chunk->entry_count;
+  while(0 < count){
+    uint32_t half = count/2;
+    if(log_entry_time(chunk, first+half) < time){
+      first += half+1;
+      count -= half+1;
+    }else{
+      count = half;
+    }
+  }
+  return first;
+}
+
+// Returns the first indexed chunk that may hold entries at or after
+// TIME.
+static uint32_t log_index_first_chunk(const struct log_index *i, uint64_t time){
+  if(!i->ordered) return 0;
+  uint32_t first = 0, count = i->count;
+  while(0 < count){
+    uint32_t half = count/2;
+    if(i->chunks[first+half].max < time){
+      first += half+1;
+      count -= half+1;
+    }else{
+      count = half;
+    }
+  }
+  return first;
+}
+
+SF3_EXPORT int sf3_log_index_build(const struct sf3_log *log, sf3_log_index *index){
+  err = SF3_OK;
+  struct log_index *i = (struct log_index *)sf3_calloc(1, sizeof(struct log_index));
+  if(i && log->chunk_count) i->chunks = (struct log_index_chunk *)sf3_calloc(log->chunk_count, sizeof(struct log_index_chunk));
+  if(!i || (log->chunk_count && !i->chunks)){
+    if(i) sf3_free(i);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  i->log = log;
+  i->ordered = 1;
+  // Entries within a chunk are ordered, so only the first and last
+  // entry of each chunk need to be looked at.
+  const struct sf3_log_chunk *chunk = &log->chunks[0];
+  for(uint16_t c=0; c<log->chunk_count; ++c){
+    if(0 < chunk->entry_count){
+      struct log_index_chunk *entry = &i->chunks[i->count];
+      entry->chunk = chunk;
+      entry->min = log_entry_time(chunk, 0);
+      entry->max = log_entry_time(chunk, chunk->entry_count-1);
+      if(0 < i->count && entry->min < i->chunks[i->count-1].max) i->ordered = 0;
+      i->count++;
+    }
+    chunk = sf3_log_next_chunk(chunk);
+  }
+  *index = i;
+  return 1;
+}
+
+SF3_EXPORT size_t sf3_log_query(sf3_log_index index, uint64_t from, uint64_t to, int (*callback)(const struct sf3_log_entry *entry, void *user), void *user){
+  err = SF3_OK;
+  struct log_index *i = (struct log_index *)index;
+  size_t count = 0;
+  for(uint32_t c=log_index_first_chunk(i, from); c<i->count; ++c){
+    const struct log_index_chunk *entry = &i->chunks[c];
+    if(to <= entry->min){
+      if(i->ordered) break;
+      continue;
+    }
+    if(entry->max < from) continue;
+    uint32_t e = (from <= entry->min)? 0 : log_chunk_lower_bound(entry->chunk, from);
+    for(; e<entry->chunk->entry_count; ++e){
+      const struct sf3_log_entry *log_entry = sf3_log_entry(entry->chunk, e);
+      if(to <= log_entry->time) break;
+      ++count;
+      if(!callback(log_entry, user)) return count;
+    }
+  }
+  return count;
+}
+
+SF3_EXPORT void sf3_log_index_free(sf3_log_index index){
+  struct log_index *i = (struct log_index *)index;
+  if(i->chunks) sf3_free(i->chunks);
+  sf3_free(i);
+}
+
+// Strings of the filter are compiled into keys, so that entries can
+// usually be rejected by their length and first eight bytes without
+// touching the rest of the string.
+struct log_filter_key{
+  uint8_t length;
+  uint64_t prefix;
+  const char *str;
+};
+
+struct log_filter_keys{
+  struct log_filter_key *keys;
+  size_t count;
+};
+
+typedef int (*log_search_fn)(const char *haystack, size_t length, const char *needle, size_t needle_length);
+
+struct log_filter{
+  int8_t severity;
+  struct log_filter_keys sources;
+  struct log_filter_keys categories;
+  char *message;
+  size_t message_length;
+  log_search_fn search;
+  /// The copies of all filter strings.
+  char *strings;
+};
+
+struct log_matches_chunk{
+  uint64_t *bits;
+  uint32_t count;
+};
+
+struct log_matches{
+  struct log_matches_chunk *chunks;
+  uint16_t chunk_count;
+  size_t count;
+  uint64_t *bits;
+};
+
+static uint64_t log_string_prefix(const char *str, size_t length){
+  uint64_t prefix = 0;
+  memcpy(&prefix, str, (length < sizeof(prefix))? length : sizeof(prefix));
+  return prefix;
+}
+
+static int log_filter_keys_match(const struct log_filter_keys *keys, const sf3_str8 *str){
+  if(keys->count == 0) return 1;
+  uint64_t prefix = 0;
+  int loaded = 0;
+  for(size_t i=0; i<keys->count; ++i){
+    const struct log_filter_key *key = &keys->keys[i];
+    if(key->length != str->length) continue;
+    if(!loaded){
+      prefix = log_string_prefix(str->str, str->length);
+      loaded = 1;
+    }
+    if(key->prefix != prefix) continue;
+    if(key->length <= sizeof(prefix) || memcmp(key->str+8, str->str+8, key->length-8) == 0) return 1;
+  }
+  return 0;
+}
+
+// The vectorised searches look for the first and last byte of the
+// needle at once across a whole register, and only compare the full
+// needle where both match, as per Wojciech Muła's "SIMD-friendly
+// algorithms for substring searching". NEEDLE_LENGTH must be at
+// least two.
+static int log_search_scalar(const char *haystack, size_t length, const char *needle, size_t needle_length){
+  char first = needle[0], last = needle[needle_length-1];
+  for(size_t i=0; i+needle_length<=length; ++i){
+    if(haystack[i] == first && haystack[i+needle_length-1] == last
+       && memcmp(haystack+i+1, needle+1, needle_length-2) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+#if defined(HAVE_SIMD_SEARCH)
+__attribute__((target("sse2")))
+static int log_search_sse2(const char *haystack, size_t length, const char *needle, size_t needle_length){
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_length-1]);
+  size_t i = 0;
+  for(; i+needle_length-1+16<=length; i+=16){
+    __m128i a = _mm_loadu_si128((const __m128i *)(haystack+i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(haystack+i+needle_length-1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for(; mask; mask &= mask-1){
+      if(memcmp(haystack+i+__builtin_ctz(mask)+1, needle+1, needle_length-2) == 0) return 1;
+    }
+  }
+  return log_search_scalar(haystack+i, length-i, needle, needle_length);
+}
+
+__attribute__((target("avx2")))
+static int log_search_avx2(const char *haystack, size_t length, const char *needle, size_t needle_length){
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_length-1]);
+  size_t i = 0;
+  for(; i+needle_length-1+32<=length; i+=32){
+    __m256i a = _mm256_loadu_si256((const __m256i *)(haystack+i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(haystack+i+needle_length-1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    for(; mask; mask &= mask-1){
+      if(memcmp(haystack+i+__builtin_ctz(mask)+1, needle+1, needle_length-2) == 0) return 1;
+    }
+  }
+  return log_search_sse2(haystack+i, length-i, needle, needle_length);
+}
+#endif
+
+static log_search_fn log_best_search(){
+#if defined(HAVE_SIMD_SEARCH)
+  if(__builtin_cpu_supports("avx2")) return log_search_avx2;
+  if(__builtin_cpu_supports("sse2")) return log_search_sse2;
+#endif
+  return log_search_scalar;
+}
+
+static int log_filter_match(const struct log_filter *f, const struct sf3_log_entry *entry){
+  if((int8_t)entry->severity < f->severity) return 0;
+  if(!log_filter_keys_match(&f->sources, &entry->source)) return 0;
+  const sf3_str8 *category = (const sf3_str8 *)SF3_SKIP_STR(entry->source);
+  if(!log_filter_keys_match(&f->categories, category)) return 0;
+  if(f->message_length == 0) return 1;
+  const sf3_str16 *message = (const sf3_str16 *)SF3_SKIP_STRP(category);
+  // The stored length includes the null terminator.
+  size_t length = (message->length)? message->length-1 : 0;
+  if(length < f->message_length) return 0;
+  if(f->message_length == 1) return memchr(message->str, f->message[0], length) != 0;
+  return f->search(message->str, length, f->message, f->message_length);
+}
+
+static char *log_filter_keys_compile(struct log_filter_keys *keys, const char **strings, size_t count, char *copy){
+  for(size_t i=0; i<count; ++i){
+    size_t length = strlen(strings[i])+1;
+    struct log_filter_key *key = &keys->keys[keys->count++];
+    memcpy(copy, strings[i], length);
+    key->length = (uint8_t)length;
+    key->prefix = log_string_prefix(copy, length);
+    key->str = copy;
+    copy += length;
+  }
+  return copy;
+}
+
+SF3_EXPORT int sf3_log_filter_compile(const struct sf3_log_filter_spec *spec, sf3_log_filter *filter){
+  err = SF3_OK;
+  size_t strings = (spec->message)? strlen(spec->message)+1 : 0;
+  for(size_t i=0; i<spec->source_count; ++i){
+    if(UINT8_MAX <= strlen(spec->sources[i])){
+      err = SF3_INVALID_ARGUMENT;
+      return 0;
+    }
+    strings += strlen(spec->sources[i])+1;
+  }
+  for(size_t i=0; i<spec->category_count; ++i){
+    if(UINT8_MAX <= strlen(spec->categories[i])){
+      err = SF3_INVALID_ARGUMENT;
+      return 0;
+    }
+    strings += strlen(spec->categories[i])+1;
+  }
+  size_t keys = spec->source_count + spec->category_count;
+  struct log_filter *f = (struct log_filter *)sf3_calloc(1, sizeof(struct log_filter));
+  if(f && keys) f->sources.keys = (struct log_filter_key *)sf3_calloc(keys, sizeof(struct log_filter_key));
+  if(f && strings) f->strings = (char *)sf3_calloc(strings, 1);
+  if(!f || (keys && !f->sources.keys) || (strings && !f->strings)){
+    if(f) sf3_log_filter_free(f);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  f->severity = spec->severity;
+  f->search = log_best_search();
+  char *copy = log_filter_keys_compile(&f->sources, spec->sources, spec->source_count, f->strings);
+  f->categories.keys = f->sources.keys + spec->source_count;
+  copy = log_filter_keys_compile(&f->categories, spec->categories, spec->category_count, copy);
+  if(spec->message){
+    f->message_length = strlen(spec->message);
+    f->message = copy;
+    memcpy(f->message, spec->message, f->message_length+1);
+  }
+  *filter = f;
+  return 1;
+}
+
+SF3_EXPORT void sf3_log_filter_free(sf3_log_filter filter){
+  struct log_filter *f = (struct log_filter *)filter;
+  if(f->sources.keys) sf3_free(f->sources.keys);
+  if(f->strings) sf3_free(f->strings);
+  sf3_free(f);
+}
+
+struct log_filter_job{
+  const struct log_filter *filter;
+  const struct sf3_log_chunk **chunks;
+  struct log_matches *matches;
+};
+
+static void log_filter_chunk(size_t index, void *data){
+  struct log_filter_job *job = (struct log_filter_job *)data;
+  const struct sf3_log_chunk *chunk = job->chunks[index];
+  struct log_matches_chunk *matches = &job->matches->chunks[index];
+  uint32_t count = 0;
+  for(uint32_t e=0; e<chunk->entry_count; ++e){
+    if(log_filter_match(job->filter, sf3_log_entry(chunk, e))){
+      matches->bits[e/64] |= (uint64_t)1 << (e%64);
+      ++count;
+    }
+  }
+  matches->count = count;
+}
+
+SF3_EXPORT int sf3_log_filter_run(sf3_log_filter filter, const struct sf3_log *log, unsigned int threads, sf3_log_matches *matches){
+  err = SF3_OK;
+  struct log_matches *m = (struct log_matches *)sf3_calloc(1, sizeof(struct log_matches));
+  const struct sf3_log_chunk **chunks = (const struct sf3_log_chunk **)sf3_calloc(log->chunk_count+1, sizeof(struct sf3_log_chunk *));
+  if(m && log->chunk_count) m->chunks = (struct log_matches_chunk *)sf3_calloc(log->chunk_count, sizeof(struct log_matches_chunk));
+  if(!m || !chunks || (log->chunk_count && !m->chunks)){
+    if(chunks) sf3_free(chunks);
+    if(m) sf3_log_matches_free(m);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  // Lay out the bitmaps of all chunks in one block, each starting on
+  // its own word so that the chunks can be filled independently.
+  size_t words = 0;
+  const struct sf3_log_chunk *chunk = &log->chunks[0];
+  for(uint16_t c=0; c<log->chunk_count; ++c){
+    chunks[c] = chunk;
+    words += (chunk->entry_count+63)/64;
+    chunk = sf3_log_next_chunk(chunk);
+  }
+  m->chunk_count = log->chunk_count;
+  m->bits = (uint64_t *)sf3_calloc(words+1, sizeof(uint64_t));
+  if(!m->bits){
+    sf3_free(chunks);
+    sf3_log_matches_free(m);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  words = 0;
+  for(uint16_t c=0; c<log->chunk_count; ++c){
+    m->chunks[c].bits = m->bits + words;
+    words += (chunks[c]->entry_count+63)/64;
+  }
+  struct log_filter_job job = {(struct log_filter *)filter, chunks, m};
+  parallel_for(threads, log->chunk_count, log_filter_chunk, &job);
+  for(uint16_t c=0; c<log->chunk_count; ++c){
+    m->count += m->chunks[c].count;
+  }
+  sf3_free(chunks);
+  *matches = m;
+  return 1;
+}
+
+SF3_EXPORT size_t sf3_log_matches_count(sf3_log_matches matches){
+  return ((struct log_matches *)matches)->count;
+}
+
+SF3_EXPORT const uint64_t *sf3_log_matches_chunk(sf3_log_matches matches, uint16_t chunk, uint32_t *count){
+  err = SF3_OK;
+  struct log_matches *m = (struct log_matches *)matches;
+  if(m->chunk_count <= chunk){
+    err = SF3_INVALID_ARGUMENT;
+    return 0;
+  }
+  if(count) *count = m->chunks[chunk].count;
+  return m->chunks[chunk].bits;
+}
+
+SF3_EXPORT void sf3_log_matches_free(sf3_log_matches matches){
+  struct log_matches *m = (struct log_matches *)matches;
+  if(m->chunks) sf3_free(m->chunks);
+  if(m->bits) sf3_free(m->bits);
+  sf3_free(m);
+}
+
+struct log_cursor{
+  const struct sf3_log *log;
+  const struct sf3_log_chunk *chunk;
+  uint16_t chunk_index;
+  uint32_t entry;
+  /// The milliseconds between the merged log's start and this one's.
+  uint64_t offset;
+  /// The time of the current entry in the merged log.
+  uint64_t time;
+  /// The position of the log among the inputs, which breaks ties.
+  size_t order;
+};
+
+// Moves the cursor to the next entry at or after its current
+// position, skipping empty chunks. Returns zero once the log is
+// exhausted.
+static int log_cursor_settle(struct log_cursor *c){
+  while(c->chunk->entry_count <= c->entry){
+    if(c->log->chunk_count <= (uint32_t)c->chunk_index+1) return 0;
+    c->chunk = sf3_log_next_chunk(c->chunk);
+    c->chunk_index++;
+    c->entry = 0;
+  }
+  c->time = c->offset + sf3_log_entry(c->chunk, c->entry)->time;
+  return 1;
+}
+
+static int log_cursor_before(const struct log_cursor *a, const struct log_cursor *b){
+  return (a->time < b->time) || (a->time == b->time && a->order < b->order);
+}
+
+static void log_heap_down(struct log_cursor **heap, size_t count, size_t i){
+  for(;;){
+    size_t least = i, l = 2*i+1, r = 2*i+2;
+    if(l < count && log_cursor_before(heap[l], heap[least])) least = l;
+    if(r < count && log_cursor_before(heap[r], heap[least])) least = r;
+    if(least == i) return;
+    struct log_cursor *tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+SF3_EXPORT int sf3_log_merge(const struct sf3_log **logs, size_t count, const char *path, size_t chunk_size, uint32_t chunk_entries){
+  err = SF3_OK;
+  struct log_cursor *cursors = (struct log_cursor *)sf3_calloc(count+1, sizeof(struct log_cursor));
+  struct log_cursor **heap = (struct log_cursor **)sf3_calloc(count+1, sizeof(struct log_cursor *));
+  if(!cursors || !heap){
+    if(cursors) sf3_free(cursors);
+    if(heap) sf3_free(heap);
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  int64_t start = (0 < count)? logs[0]->start : 0;
+  for(size_t i=1; i<count; ++i){
+    if(logs[i]->start < start) start = logs[i]->start;
+  }
+  // The writer takes zero to mean now, so move a log that actually
+  // starts at the epoch back by a second.
+  if(start == 0) start = -1;
+  size_t live = 0;
+  for(size_t i=0; i<count; ++i){
+    struct log_cursor *c = &cursors[i];
+    c->log = logs[i];
+    c->chunk = &logs[i]->chunks[0];
+    c->offset = (uint64_t)(logs[i]->start - start)*1000;
+    c->order = i;
+    if(0 < logs[i]->chunk_count && log_cursor_settle(c)) heap[live++] = c;
+  }
+  for(size_t i=live/2; 0<i--;){
+    log_heap_down(heap, live, i);
+  }
+
+  sf3_log_writer writer;
+  if(!sf3_log_writer_create(path, start, chunk_size, chunk_entries, &writer)){
+    sf3_free(cursors);
+    sf3_free(heap);
+    return 0;
+  }
+  int ok = 1;
+  while(ok && 0 < live){
+    struct log_cursor *c = heap[0];
+    const struct sf3_log_entry *entry = sf3_log_entry(c->chunk, c->entry);
+    ok = sf3_log_append_at(writer, c->time, (int8_t)entry->severity,
+                           sf3_log_entry_source(entry), sf3_log_entry_category(entry), sf3_log_entry_message(entry));
+    c->entry++;
+    if(!log_cursor_settle(c)) heap[0] = heap[--live];
+    log_heap_down(heap, live, 0);
+  }
+  sf3_free(cursors);
+  sf3_free(heap);
+  if(!ok){
+    enum sf3_error error = err;
+    sf3_log_writer_close(writer);
+    unlink(path);
+    err = error;
+    return 0;
+  }
+  return sf3_log_writer_close(writer);
+}
+
+#if defined(HAVE_MMAN_H) && !defined(_WIN32)
+#define HAVE_LOG_FOLLOW 1
+
+struct log_follower{
+  int fd;
+  /// The inotify descriptor watching the file, or -1.
+  int watch;
+  uint8_t *addr;
+  size_t size;
+  /// The position of the next entry to deliver.
+  uint16_t chunk;
+  uint64_t chunk_offset;
+  uint32_t entry;
+};
+
+// Maps the file anew if it changed size since we last looked.
+static int log_follow_refresh(struct log_follower *f){
+  struct stat stat;
+  if(fstat(f->fd, &stat) != 0){
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  size_t size = (size_t)stat.st_size;
+  if(size == f->size) return 1;
+  void *addr = MAP_FAILED;
+  if(f->addr){
+#if defined(MREMAP_MAYMOVE)
+    addr = mremap(f->addr, f->size, size, MREMAP_MAYMOVE);
+#else
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if(addr != MAP_FAILED) munmap(f->addr, f->size);
+#endif
+  }else if(0 < size){
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, f->fd, 0);
+  }
+  if(addr == MAP_FAILED){
+    err = SF3_MMAP_FAILED;
+    return 0;
+  }
+  f->addr = (uint8_t *)addr;
+  f->size = size;
+  return 1;
+}
+
+// Returns the next entry if it has been published and lies within
+// the current mapping, and null otherwise.
+static const struct sf3_log_entry *log_follow_peek(struct log_follower *f){
+  const struct sf3_log *log = (const struct sf3_log *)f->addr;
+  for(;;){
+    if(log->chunk_count <= f->chunk) return 0;
+    if(f->size < f->chunk_offset + sizeof(struct sf3_log_chunk)) return 0;
+    const struct sf3_log_chunk *chunk = (const struct sf3_log_chunk *)(f->addr + f->chunk_offset);
+    if(f->entry < chunk->entry_count){
+      if(f->size < f->chunk_offset + sizeof(struct sf3_log_chunk) + (uint64_t)(f->entry+1)*sizeof(uint64_t)) return 0;
+      uint64_t offset = f->chunk_offset + chunk->entry_offset[f->entry];
+      if(f->size < offset + sizeof(uint32_t)) return 0;
+      const struct sf3_log_entry *entry = (const struct sf3_log_entry *)(f->addr + offset);
+      if(f->size < offset + entry->size) return 0;
+      return entry;
+    }
+    // A chunk is complete once the next one has been added.
+    if(log->chunk_count <= f->chunk+1) return 0;
+    f->chunk_offset += chunk->size;
+    f->chunk++;
+    f->entry = 0;
+  }
+}
+#endif
+
+SF3_EXPORT int sf3_log_follow(const char *path, sf3_log_follower *follower){
+  err = SF3_OK;
+#if defined(HAVE_LOG_FOLLOW)
+  struct log_follower *f = (struct log_follower *)sf3_calloc(1, sizeof(struct log_follower));
+  if(!f){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  f->watch = -1;
+  f->chunk_offset = sizeof(struct sf3_log);
+  f->fd = open(path, O_RDONLY);
+  if(f->fd == -1){
+    sf3_free(f);
+    err = SF3_OPEN_FAILED;
+    return 0;
+  }
+  if(!log_follow_refresh(f)){
+    sf3_log_follow_close(f);
+    return 0;
+  }
+  if(f->size < sizeof(struct sf3_log) || sf3_check(f->addr, f->size) != SF3_FORMAT_ID_LOG){
+    sf3_log_follow_close(f);
+    err = SF3_INVALID_FILE;
+    return 0;
+  }
+#if defined(HAVE_INOTIFY_H)
+  // Without inotify, waiting falls back to sleeping.
+  f->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(0 <= f->watch && inotify_add_watch(f->watch, path, IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF) < 0){
+    close(f->watch);
+    f->watch = -1;
+  }
+#endif
+  *follower = f;
+  return 1;
+#else
+  err = SF3_MMAP_FAILED;
+  return 0;
+#endif
+}
+
+SF3_EXPORT const struct sf3_log_entry *sf3_log_follow_next(sf3_log_follower follower){
+  err = SF3_OK;
+#if defined(HAVE_LOG_FOLLOW)
+  struct log_follower *f = (struct log_follower *)follower;
+  const struct sf3_log_entry *entry = log_follow_peek(f);
+  // The file may have grown past our mapping since we last looked.
+  if(!entry && log_follow_refresh(f)) entry = log_follow_peek(f);
+  if(entry) f->entry++;
+  return entry;
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_log_follow_wait(sf3_log_follower follower, int timeout){
+  err = SF3_OK;
+#if defined(HAVE_LOG_FOLLOW)
+  struct log_follower *f = (struct log_follower *)follower;
+  if(log_follow_peek(f)) return 1;
+#if defined(HAVE_INOTIFY_H)
+  if(0 <= f->watch){
+    struct pollfd poll_fd = {f->watch, POLLIN, 0};
+    int result = poll(&poll_fd, 1, timeout);
+    // Drain the events, we only care that something happened.
+    char events[4096];
+    while(0 < read(f->watch, events, sizeof(events)));
+    // On interruptions the caller simply looks again.
+    return result != 0;
+  }
+#endif
+  struct timespec duration = {(timeout < 0)? 1 : timeout/1000, (timeout < 0)? 0 : (timeout%1000)*1000000L};
+  nanosleep(&duration, 0);
+  return 1;
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+SF3_EXPORT const struct sf3_log *sf3_log_follow_log(sf3_log_follower follower){
+  err = SF3_OK;
+#if defined(HAVE_LOG_FOLLOW)
+  return (const struct sf3_log *)((struct log_follower *)follower)->addr;
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+SF3_EXPORT int sf3_log_follow_closed(sf3_log_follower follower){
+  err = SF3_OK;
+#if defined(HAVE_LOG_FOLLOW)
+  const struct sf3_log *log = (const struct sf3_log *)((struct log_follower *)follower)->addr;
+  return log->end != INT64_MAX;
+#else
+  err = SF3_INVALID_HANDLE;
+  return 0;
+#endif
+}
+
+SF3_EXPORT void sf3_log_follow_close(sf3_log_follower follower){
+#if defined(HAVE_LOG_FOLLOW)
+  struct log_follower *f = (struct log_follower *)follower;
+  if(f->addr) munmap(f->addr, f->size);
+  if(0 <= f->watch) close(f->watch);
+  if(0 <= f->fd) close(f->fd);
+  sf3_free(f);
+#endif
+}
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_DEFAULT_BLOCK (64*1024)
+
+struct arena_block{
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+};
+
+// The block's data starts after the header, rounded up to keep it
+// aligned.
+#define ARENA_HEADER ((sizeof(struct arena_block)+ARENA_ALIGNMENT-1) & ~(size_t)(ARENA_ALIGNMENT-1))
+
+struct arena{
+  struct arena_block *blocks;
+  size_t block_size;
+};
+
+static struct arena_block *arena_add_block(struct arena *arena, size_t size){
+  if(size < arena->block_size) size = arena->block_size;
+  struct arena_block *block = (struct arena_block *)sf3_malloc(ARENA_HEADER+size);
+  if(!block) return 0;
+  block->size = size;
+  block->used = 0;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  return block;
+}
+
+static void *arena_allocate(void *user, size_t size, int clear){
+  struct arena *arena = (struct arena *)user;
+  struct arena_block *block = arena->blocks;
+  size = (size + ARENA_ALIGNMENT-1) & ~(size_t)(ARENA_ALIGNMENT-1);
+  if(!block || block->size - block->used < size){
+    block = arena_add_block(arena, size);
+    if(!block) return 0;
+  }
+  uint8_t *ptr = ((uint8_t *)block) + ARENA_HEADER + block->used;
+  block->used += size;
+  if(clear) memset(ptr, 0, size);
+  return ptr;
+}
+
+SF3_EXPORT int sf3_arena_create(size_t block_size, sf3_arena *arena){
+  err = SF3_OK;
+  struct arena *a = (struct arena *)sf3_calloc(1, sizeof(struct arena));
+  if(!a){
+    err = SF3_OUT_OF_MEMORY;
+    return 0;
+  }
+  a->block_size = (block_size)? block_size : ARENA_DEFAULT_BLOCK;
+  *arena = a;
+  return 1;
+}
+
+SF3_EXPORT void sf3_arena_allocator(sf3_arena arena, struct sf3_allocator *allocator){
+  allocator->allocate = arena_allocate;
+  allocator->release = 0;
+  allocator->user = arena;
+}
+
+SF3_EXPORT void sf3_arena_reset(sf3_arena arena){
+  struct arena *a = (struct arena *)arena;
+  if(!a || !a->blocks) return;
+  // Keep the most recent block around to serve the next round of
+  // allocations from.
+  struct arena_block *block = a->blocks->next;
+  while(block){
+    struct arena_block *next = block->next;
+    sf3_free(block);
+    block = next;
+  }
+  a->blocks->next = 0;
+  a->blocks->used = 0;
+}
+
+SF3_EXPORT void sf3_arena_destroy(sf3_arena arena){
+  struct arena *a = (struct arena *)arena;
+  if(!a) return;
+  struct arena_block *block = a->blocks;
+  while(block){
+    struct arena_block *next = block->next;
+    sf3_free(block);
+    block = next;
+  }
+  sf3_free(a);
 }
 
 #ifndef SF3_NO_CUSTOM_ALLOCATOR
 void *(*sf3_calloc)(size_t num, size_t size) = calloc;
+void *(*sf3_malloc)(size_t size) = malloc;
 void (*sf3_free)(void *ptr) = free;
 #endif
@@ -36,6 +36,63 @@ extern "C" {
     /// is not guaranteed that other applications will be able to see
     /// the changes until after sf3_write has returned successfully.
     SF3_OPEN_READ_WRITE = 1,
+    /// Hint that the file will be read front to back, which enables
+    /// aggressive readahead. May be combined with the other flags.
+    SF3_OPEN_SEQUENTIAL = 0x02,
+    /// Hint that the file will be read in random order, which disables
+    /// readahead. May be combined with the other flags.
+    SF3_OPEN_RANDOM = 0x04,
+    /// Fault the entire file into memory while opening it, so that no
+    /// page faults occur on later accesses. May be combined with the
+    /// other flags.
+    SF3_OPEN_POPULATE = 0x08,
+    /// Ask for the mapping to be backed by huge pages where
+    /// supported. May be combined with the other flags.
+    SF3_OPEN_HUGEPAGES = 0x10,
+    /// Lock the file's pages into memory so they cannot be paged
+    /// out. This is subject to the process' locked memory limit. May
+    /// be combined with the other flags.
+    SF3_OPEN_LOCK = 0x20,
+  };
+
+  enum sf3_advice{
+    /// Reset the access pattern to the default.
+    SF3_ADVISE_NORMAL = 0,
+    /// The memory will be accessed sequentially.
+    SF3_ADVISE_SEQUENTIAL,
+    /// The memory will be accessed in random order.
+    SF3_ADVISE_RANDOM,
+    /// The memory will be accessed soon, and should be read ahead.
+    SF3_ADVISE_WILLNEED,
+    /// The memory will not be accessed any time soon, and may be
+    /// released.
+    SF3_ADVISE_DONTNEED,
+    /// The memory should be backed by huge pages, if possible.
+    SF3_ADVISE_HUGEPAGE,
+    /// Lock the memory so it cannot be paged out.
+    SF3_ADVISE_LOCK,
+    /// Undo a previous SF3_ADVISE_LOCK.
+    SF3_ADVISE_UNLOCK,
+  };
+
+  enum sf3_section{
+    /// The entire file.
+    SF3_SECTION_ALL = 0,
+    /// The metadata entries of an archive, including their paths and
+    /// mime-types.
+    SF3_SECTION_ARCHIVE_METADATA,
+    /// The payloads of a range of archive members.
+    SF3_SECTION_ARCHIVE_FILES,
+    /// A range of chunks of a log, including their entries.
+    SF3_SECTION_LOG_CHUNKS,
+    /// The face indices of a model.
+    SF3_SECTION_MODEL_FACES,
+    /// The vertex data of a model.
+    SF3_SECTION_MODEL_VERTICES,
+    /// The column specifications of a table.
+    SF3_SECTION_TABLE_SPEC,
+    /// A range of rows of a table.
+    SF3_SECTION_TABLE_ROWS,
   };
 
   enum sf3_error{
@@ -54,11 +111,160 @@ extern "C" {
     SF3_WRITE_FAILED,
     /// The file is not a valid SF3 file.
     SF3_INVALID_FILE,
+    /// The memory access advice could not be applied.
+    SF3_ADVISE_FAILED,
+    /// The requested section does not exist in the file.
+    SF3_INVALID_SECTION,
+    /// The CRC32 checksum stored in the file does not match its
+    /// contents.
+    SF3_CHECKSUM_MISMATCH,
+    /// An argument is outside of the range permitted by the format,
+    /// such as a string that is too long.
+    SF3_INVALID_ARGUMENT,
   };
 
   /// Opaque representation of a file handle.
   typedef void *sf3_handle;
 
+  /// Flags for sf3_verify_file.
+  enum sf3_verify_flags{
+    /// Use and update the persisted verification record of the file.
+    SF3_VERIFY_CACHED = 0x01,
+    /// Fall back to a sidecar file for the verification record if
+    /// extended attributes are not available.
+    SF3_VERIFY_SIDECAR = 0x02,
+  };
+
+  /// An allocation context that can be passed to functions which
+  /// allocate memory, instead of using the global sf3_calloc and
+  /// sf3_free.
+  ///
+  /// If ALLOCATE is null, the global allocation functions are used.
+  ///
+  /// See sf3_open_with
+  /// See sf3_arena_allocator
+  struct sf3_allocator{
+    /// Allocates SIZE octets of memory aligned for any type. If CLEAR
+    /// is non-zero the memory must be cleared to 0, otherwise its
+    /// contents may be anything. Returns 0 if the allocation failed.
+    void *(*allocate)(void *user, size_t size, int clear);
+    /// Releases memory returned by ALLOCATE. May be null if memory is
+    /// released in bulk instead, as is the case for arenas.
+    void (*release)(void *user, void *ptr);
+    /// Arbitrary data passed to the two functions.
+    void *user;
+  };
+
+  /// Opaque representation of an arena allocator.
+  /// See sf3_arena_create
+  typedef void *sf3_arena;
+
+  /// Opaque representation of an archive that is being written.
+  /// See sf3_archive_builder_create
+  typedef void *sf3_archive_builder;
+
+  /// Opaque representation of a path lookup table for an archive.
+  /// See sf3_archive_index_build
+  typedef void *sf3_archive_index;
+
+  /// Opaque representation of a stack of archives.
+  /// See sf3_overlay_create
+  typedef void *sf3_overlay;
+
+  /// Opaque representation of a log file that is being written.
+  /// See sf3_log_writer_create
+  typedef void *sf3_log_writer;
+
+  /// Opaque representation of a time lookup table for a log.
+  /// See sf3_log_index_build
+  typedef void *sf3_log_index;
+
+  /// The entries an sf3_log_filter accepts. An entry must satisfy
+  /// every part of the filter to be accepted.
+  struct sf3_log_filter_spec{
+    /// The lowest severity that is accepted. Use INT8_MIN to accept
+    /// every severity.
+    int8_t severity;
+    /// The sources that are accepted.
+    const char **sources;
+    /// The number of SOURCES, or zero to accept any source.
+    size_t source_count;
+    /// The categories that are accepted.
+    const char **categories;
+    /// The number of CATEGORIES, or zero to accept any category.
+    size_t category_count;
+    /// A string that must occur within the message, or null to accept
+    /// any message.
+    const char *message;
+  };
+
+  /// Opaque representation of a compiled log filter.
+  /// See sf3_log_filter_compile
+  typedef void *sf3_log_filter;
+
+  /// Opaque representation of the entries that matched a filter.
+  /// See sf3_log_filter_run
+  typedef void *sf3_log_matches;
+
+  /// Opaque representation of a log file that is being followed.
+  /// See sf3_log_follow
+  typedef void *sf3_log_follower;
+
+  /// A member as resolved through an sf3_overlay.
+  struct sf3_overlay_entry{
+    /// The layer the member comes from, counting up from the bottom.
+    size_t layer;
+    /// The index of the member within the layer's archive.
+    uint64_t index;
+    /// The path of the member.
+    const char *path;
+    /// The member's metadata entry.
+    const struct sf3_archive_meta *meta;
+    /// The member's contents.
+    const struct sf3_file *file;
+  };
+
+  /// Opaque representation of a shared handle cache.
+  /// See sf3_cache_create
+  typedef void *sf3_cache;
+
+  /// Statistics about the state of an sf3_cache.
+  struct sf3_cache_stats{
+    /// The number of files currently in the cache.
+    size_t entries;
+    /// The number of bytes currently mapped by the cache, including
+    /// files that are still in use after being invalidated.
+    size_t mapped_bytes;
+    /// The number of opens served from an existing mapping.
+    size_t hits;
+    /// The number of opens that had to map the file.
+    size_t misses;
+    /// The number of idle files that were unmapped to stay within
+    /// the budget.
+    size_t evictions;
+  };
+
+  /// Opaque representation of a batch verification engine.
+  /// See sf3_engine_create
+  typedef void *sf3_engine;
+
+  enum sf3_engine_flags{
+    /// Do not use io_uring, even if the system supports it, and
+    /// perform all I/O on the worker threads instead.
+    SF3_ENGINE_NO_IO_URING = 0x01,
+  };
+
+  /// The outcome of a file verification by an sf3_engine.
+  struct sf3_engine_result{
+    /// The pointer that was passed to sf3_engine_submit.
+    void *user;
+    /// The sf3_format_id of the file if it was verified successfully,
+    /// or zero otherwise.
+    int format_id;
+    /// The reason the verification failed, or SF3_OK.
+    enum sf3_error error;
+  };
+
   /// Return the error code.
   /// This is thread local.
   SF3_EXPORT enum sf3_error sf3_error();
@@ -74,6 +280,21 @@ extern "C" {
   /// the file.
   SF3_EXPORT int sf3_tell(const char *path);
 
+  /// Determines the sf3_format_id of many files at once.
+  ///
+  /// This calls sf3_tell for each of the COUNT paths in PATHS, and
+  /// stores the result in the corresponding slot of IDS, which must
+  /// have room for COUNT entries. The files are processed on up to
+  /// THREADS threads at once, including the calling thread. If
+  /// THREADS is zero, the number of available processors is used.
+  /// The other threads are started for each call and joined before
+  /// it returns, so this is best used for large batches.
+  ///
+  /// Returns the number of files that were successfully identified.
+  /// Note that sf3_error is not meaningful after this call, inspect
+  /// the IDS array instead.
+  SF3_EXPORT size_t sf3_tell_many(const char **paths, size_t count, int *ids, unsigned int threads);
+
   /// Opens the SF3 file at the given path.
   /// 
   /// If successful returns the format ID and stores the handle in
@@ -83,8 +304,68 @@ extern "C" {
   ///
   /// If the file open fails, the application is out of memory, or the
   /// file is not a valid SF3 file, zero is returned instead.
+  ///
+  /// MODE may have any of the access hint flags of sf3_open_mode
+  /// combined into it. These hints are applied on a best-effort basis,
+  /// and failing to apply them does not make the open fail.
   SF3_EXPORT int sf3_open(const char *path, enum sf3_open_mode mode, sf3_handle *handle);
 
+  /// Open an SF3 file, allocating through the given allocator.
+  ///
+  /// This is the same as sf3_open, except that the handle and any
+  /// memory it needs, such as the file buffer on systems without
+  /// mmap, are allocated through ALLOCATOR rather than the global
+  /// allocation functions. The allocator is copied into the handle,
+  /// and must stay usable until the handle is closed. ALLOCATOR may
+  /// be null to use the global functions.
+  SF3_EXPORT int sf3_open_with(const char *path, enum sf3_open_mode mode, const struct sf3_allocator *allocator, sf3_handle *handle);
+
+  /// Open an SF3 file from an open file descriptor.
+  ///
+  /// The descriptor is duplicated, so the caller remains responsible
+  /// for closing FD. The file is mapped from its start as with
+  /// sf3_open.
+  ///
+  /// Unlike sf3_open, this verifies the file's checksum, as the
+  /// descriptor usually comes from another process. The check is
+  /// skipped if the file is sealed against writes and shrinking,
+  /// which is the case for files shared with sf3_create_shared and
+  /// sf3_seal: the seals guarantee that nobody changed the file
+  /// after its checksum was written. The receiver thus only needs to
+  /// trust the sender, not everyone else with access to the file.
+  ///
+  /// Returns the same as sf3_open. If the checksum does not match,
+  /// sf3_error is set to SF3_CHECKSUM_MISMATCH. If a sealed file is
+  /// shorter than its header claims, it is set to SF3_INVALID_FILE.
+  SF3_EXPORT int sf3_open_fd(int fd, enum sf3_open_mode mode, sf3_handle *handle);
+
+  /// Creates a file of SIZE bytes in shared memory, to build an SF3
+  /// file in that can be handed to other processes without copying.
+  ///
+  /// The file is backed by a memfd where available, and by an
+  /// unlinked temporary file otherwise. The returned handle is
+  /// writable, and its memory is cleared. Once the contents are in
+  /// place, call sf3_seal, and pass the descriptor from sf3_fd to the
+  /// other processes, for instance over a Unix domain socket. They
+  /// can then open it with sf3_open_fd.
+  ///
+  /// This is not supported on Windows.
+  SF3_EXPORT int sf3_create_shared(size_t size, sf3_handle *handle);
+
+  /// Finishes a file created with sf3_create_shared.
+  ///
+  /// This writes the SF3 header with a fresh checksum, cuts the file
+  /// down to the size of its contents, and seals it so that it can
+  /// no longer be changed by anyone. The handle becomes read-only,
+  /// and its memory may move, so fetch it anew with sf3_data.
+  ///
+  /// Returns the sf3_format_id of the file, or zero on failure.
+  SF3_EXPORT int sf3_seal(sf3_handle handle);
+
+  /// Returns the file descriptor backing the handle, or -1 if there
+  /// is none. The descriptor remains owned by the handle.
+  SF3_EXPORT int sf3_fd(sf3_handle handle);
+
   /// Closes the file handle.
   ///
   /// After closing the handle is discarded and calling any function
@@ -100,6 +381,38 @@ extern "C" {
   /// pointer is returned.
   SF3_EXPORT void *sf3_data(sf3_handle handle, size_t *size);
 
+  /// Advise the system about how a region of the file will be used.
+  ///
+  /// OFFSET and LENGTH describe the byte range within the file the
+  /// advice applies to, and are clamped to the size of the file. The
+  /// range is widened to page boundaries as required.
+  ///
+  /// Returns zero and sets SF3_ADVISE_FAILED if the system rejected
+  /// the advice, for instance because the locked memory limit was
+  /// exceeded. Advice the platform does not support is ignored.
+  SF3_EXPORT int sf3_advise(sf3_handle handle, size_t offset, size_t length, enum sf3_advice advice);
+
+  /// Computes the byte range of a section of an SF3 file.
+  ///
+  /// For sections that consist of a sequence of elements, such as
+  /// SF3_SECTION_TABLE_ROWS, FIRST and COUNT select the elements to
+  /// include, and are clamped to the number of elements in the file.
+  /// For all other sections they are ignored.
+  ///
+  /// On success, the offset from ADDR and the length of the section
+  /// in bytes are stored in OFFSET and LENGTH. If the section does not
+  /// apply to the format of the file, zero is returned and the error
+  /// is set to SF3_INVALID_SECTION.
+  SF3_EXPORT int sf3_section_range(const void *addr, size_t size, enum sf3_section section, uint64_t first, uint64_t count, size_t *offset, size_t *length);
+
+  /// Prefetches a section of the file into memory.
+  ///
+  /// This asks the system to start reading the pages of the section
+  /// in the background, so that a later access does not stall on page
+  /// faults, without touching the rest of the file. See
+  /// sf3_section_range for the meaning of the arguments.
+  SF3_EXPORT int sf3_prefetch(sf3_handle handle, enum sf3_section section, uint64_t first, uint64_t count);
+
   /// Create a handle from a given SF3 file payload in memory.
   ///
   /// This may be useful if you want to call sf3_write to serialize
@@ -110,6 +423,45 @@ extern "C" {
   /// are computed automatically when sf3_write is called.
   SF3_EXPORT int sf3_create(void *addr, size_t size, sf3_handle *handle);
 
+  /// Ensures that the handle's file and memory span at least
+  /// CAPACITY bytes.
+  ///
+  /// This only works for handles obtained through sf3_open with mode
+  /// set to SF3_OPEN_READ_WRITE. If the handle is already at least
+  /// CAPACITY bytes large, nothing happens. Otherwise the file is
+  /// extended, with its blocks allocated up front where possible, and
+  /// the memory mapping is grown to match. The new bytes are zero.
+  ///
+  /// Growing the mapping may move it to a different address. After a
+  /// successful call that changed the size, all pointers into the
+  /// handle's memory, including ones returned by sf3_data, must be
+  /// considered invalid and be fetched anew with sf3_data. Offsets
+  /// remain valid. A call that does not change the size never moves
+  /// the memory. Since every size change may move and copy the
+  /// mapping, appends should reserve capacity in growing steps
+  /// rather than one record at a time.
+  ///
+  /// The capacity is not tracked separately from the size: this is
+  /// simply an sf3_resize that never shrinks. Afterwards the handle
+  /// is CAPACITY bytes large, sf3_data reports that size, and the
+  /// reserved bytes are part of the file, including when it is
+  /// written with sf3_write. The SF3 header is not touched, so the
+  /// size it describes only changes once you update it. Call
+  /// sf3_resize with the final size of the contents to cut off the
+  /// reserved bytes that were not used.
+  ///
+  /// See sf3_resize
+  SF3_EXPORT int sf3_reserve(sf3_handle handle, size_t capacity);
+
+  /// Changes the size of the handle's file and memory to exactly
+  /// SIZE bytes.
+  ///
+  /// This is like sf3_reserve, but can also shrink the file, for
+  /// instance to cut off unused reserved capacity once you are done
+  /// appending. SIZE may not be smaller than an SF3 header. The same
+  /// pointer stability rules as for sf3_reserve apply.
+  SF3_EXPORT int sf3_resize(sf3_handle handle, size_t size);
+
   /// Write the SF3 file back out to a file.
   ///
   /// PATH may be a null pointer if the handle was obtained through
@@ -125,8 +477,562 @@ extern "C" {
   /// of the SF3 file after writing.
   SF3_EXPORT int sf3_write(const char *path, sf3_handle handle);
 
+  /// Atomically and durably write the SF3 file out to a file.
+  ///
+  /// This is like sf3_write with a PATH, except that the contents are
+  /// first written to a temporary file in the same directory, which
+  /// is flushed to disk and then renamed over PATH. Readers of PATH
+  /// thus only ever see either the old or the complete new file, even
+  /// if the process or system crashes midway through.
+  ///
+  /// Where supported, the temporary file is anonymous until it is
+  /// complete, its space is preallocated, and the payload of a
+  /// handle obtained through sf3_open is copied within the kernel
+  /// without passing through user space.
+  ///
+  /// If the header claims more bytes than the handle holds, this
+  /// fails with SF3_INVALID_FILE.
+  SF3_EXPORT int sf3_write_atomic(const char *path, sf3_handle handle);
+
+  /// Marks a byte range of the file as about to be modified.
+  ///
+  /// This only works for handles obtained through sf3_open with mode
+  /// set to SF3_OPEN_READ_WRITE, and must be called **before** the
+  /// bytes in the range are changed, as it captures the CRC32 of
+  /// their current contents. OFFSET is relative to the start of the
+  /// file, including the header.
+  ///
+  /// Once any range has been marked, the next call to sf3_write with
+  /// a null PATH will update the stored CRC32 checksum by only looking
+  /// at the marked ranges, and will only flush the pages they touch,
+  /// making small edits to large files cheap. This relies on the
+  /// checksum stored in the file being correct before the first range
+  /// was marked. If the size of the SF3 file changed in the meantime,
+  /// or the ranges could not be tracked due to a lack of memory, the
+  /// entire file is checksummed and flushed as usual instead.
+  ///
+  /// Modifying bytes that were not marked results in an invalid
+  /// checksum.
+  SF3_EXPORT int sf3_mark_dirty(sf3_handle handle, size_t offset, size_t length);
+
+  /// Checks whether a chunk of memory is a valid SF3 file, including a
+  /// CRC32 checksum verification, using multiple threads.
+  ///
+  /// This behaves exactly like sf3_verify, but splits the payload
+  /// into blocks that are checksummed on up to THREADS threads, the
+  /// results of which are then merged via sf3_crc32_combine. If
+  /// THREADS is zero, the number of available processors is used.
+  /// The threads are started for each call and joined before it
+  /// returns, so small payloads are verified on the calling thread.
+  SF3_EXPORT int sf3_verify_parallel(const void *addr, size_t size, unsigned int threads);
+
+  /// Verifies the file at PATH, including its CRC32 checksum.
+  ///
+  /// FLAGS is a combination of sf3_verify_flags. With
+  /// SF3_VERIFY_CACHED, a successful verification is remembered in
+  /// the file's "user.sf3.verified" extended attribute, together with
+  /// the file's checksum, size, inode and modification time. Later
+  /// calls for the unchanged file then only compare that record rather
+  /// than checksumming the whole file again. If SF3_VERIFY_SIDECAR is
+  /// also passed, a PATH.sf3-verified file is used instead when the
+  /// file system does not support extended attributes.
+  ///
+  /// Note that the cache relies on the modification time, so it
+  /// cannot detect changes made by tools that forge it.
+  ///
+  /// Returns the sf3_format_id of the file if it is valid, and zero
+  /// otherwise, with sf3_error set to SF3_CHECKSUM_MISMATCH if only
+  /// the checksum did not match.
+  SF3_EXPORT int sf3_verify_file(const char *path, int flags);
+
+  /// Creates a cache that shares handles between repeated opens.
+  ///
+  /// Files opened through the cache are identified by their device,
+  /// inode, modification time and size, and opening the same
+  /// unchanged file again returns the same handle, with the mapping
+  /// shared between all users. Once the last user closes a handle, it
+  /// is kept around for later opens until the total mapped size
+  /// exceeds BUDGET bytes, at which point the least recently used
+  /// idle handles are unmapped. A BUDGET of zero means no limit.
+  ///
+  /// The cache may be used from multiple threads at once.
+  ///
+  /// See sf3_cache_open
+  /// See sf3_cache_destroy
+  SF3_EXPORT int sf3_cache_create(size_t budget, sf3_cache *cache);
+
+  /// Opens the file at PATH read-only through the cache.
+  ///
+  /// The returned handle may be shared with other callers and must be
+  /// treated as read-only. It is released again with sf3_close. If the
+  /// file has changed on disk since it was cached, a fresh handle is
+  /// opened, and the stale one is unmapped once its last user closes
+  /// it. Returns the same as sf3_open.
+  ///
+  /// On systems where files cannot be identified, this is equivalent
+  /// to sf3_open with SF3_OPEN_READ_ONLY.
+  SF3_EXPORT int sf3_cache_open(sf3_cache cache, const char *path, sf3_handle *handle);
+
+  /// Fills STATS with the current statistics of the cache.
+  SF3_EXPORT void sf3_cache_stats(sf3_cache cache, struct sf3_cache_stats *stats);
+
+  /// Destroys the cache.
+  ///
+  /// Idle handles are unmapped immediately. Handles that are still in
+  /// use remain valid, and the cache is freed once the last of them
+  /// is closed.
+  SF3_EXPORT void sf3_cache_destroy(sf3_cache cache);
+
+  /// Creates an engine for opening and verifying many files at once.
+  ///
+  /// Where available, the engine uses io_uring to keep up to DEPTH
+  /// file opens and reads in flight at once from a single I/O thread,
+  /// and checksums the completed files on THREADS worker threads.
+  /// Otherwise, or if SF3_ENGINE_NO_IO_URING is passed in FLAGS, the
+  /// worker threads perform the I/O themselves. Files too large to be
+  /// buffered are mapped into memory and verified by the workers.
+  ///
+  /// If THREADS is zero, the number of available processors is used.
+  /// If DEPTH is zero, a default depth is used.
+  ///
+  /// See sf3_engine_submit
+  /// See sf3_engine_complete
+  /// See sf3_engine_destroy
+  SF3_EXPORT int sf3_engine_create(unsigned int threads, unsigned int depth, int flags, sf3_engine *engine);
+
+  /// Returns whether the engine is using io_uring for its I/O.
+  SF3_EXPORT int sf3_engine_uses_io_uring(sf3_engine engine);
+
+  /// Queues the file at PATH for verification.
+  ///
+  /// The path is copied. USER is handed back in the result when the
+  /// verification completes, and can be used to tell results apart.
+  /// Returns zero if the job could not be queued.
+  SF3_EXPORT int sf3_engine_submit(sf3_engine engine, const char *path, void *user);
+
+  /// Retrieves the results of completed verifications.
+  ///
+  /// Up to COUNT results are stored into RESULTS, and the number of
+  /// stored results is returned. Results are returned in the order in
+  /// which the files complete, not in which they were submitted. If
+  /// WAIT is non-zero and no results are available yet, this blocks
+  /// until at least one is, unless there are no outstanding
+  /// submissions at all.
+  SF3_EXPORT size_t sf3_engine_complete(sf3_engine engine, struct sf3_engine_result *results, size_t count, int wait);
+
+  /// Stops the engine and releases all of its resources.
+  ///
+  /// Submissions that have not been started yet are dropped, and any
+  /// results that have not been retrieved are discarded.
+  SF3_EXPORT void sf3_engine_destroy(sf3_engine engine);
+
+  /// Starts writing an SF3 archive to the file at PATH.
+  ///
+  /// Members are appended with sf3_archive_builder_add or
+  /// sf3_archive_builder_add_fd, and their payloads are written out
+  /// to the file right away, so only the member names are kept in
+  /// memory. The tables at the start of the archive are filled in by
+  /// sf3_archive_builder_finish, into the first RESERVE bytes of the
+  /// file that are kept free for them. If the tables turn out to be
+  /// larger, the payloads are moved back to make room, which is
+  /// costly for large archives, so if the number of members is known
+  /// up front, reserve about 32 bytes plus the path length for each.
+  /// If RESERVE is zero, a default is used. Unused reserved space is
+  /// left as padding between the tables and the payloads.
+  ///
+  /// All memory is allocated through ALLOCATOR, which may be null.
+  ///
+  /// See sf3_archive_builder_finish
+  /// See sf3_archive_builder_abort
+  SF3_EXPORT int sf3_archive_builder_create(const char *path, size_t reserve, const struct sf3_allocator *allocator, sf3_archive_builder *builder);
+
+  /// Appends a member with the given contents to the archive.
+  ///
+  /// PATH is the member's path within the archive and may be at most
+  /// 65534 bytes long. MIME_TYPE may be at most 254 bytes long, or
+  /// null for application/octet-stream. MODTIME is a UNIX timestamp.
+  /// The member's checksum is computed as the payload is written.
+  /// If this fails with anything other than SF3_INVALID_ARGUMENT or
+  /// SF3_OUT_OF_MEMORY, the archive is incomplete and the builder
+  /// should be aborted.
+  SF3_EXPORT int sf3_archive_builder_add(sf3_archive_builder builder, const char *path, const char *mime_type, int64_t modtime, const void *data, size_t length);
+
+  /// Appends a member whose checksum has already been computed.
+  ///
+  /// This is like sf3_archive_builder_add, but takes the CRC32
+  /// checksum of DATA as computed by sf3_compute_checksum, so that
+  /// members can be checksummed on other threads while the builder
+  /// writes. The checksum is not checked, and a wrong one results in
+  /// an invalid archive.
+  SF3_EXPORT int sf3_archive_builder_add_checksummed(sf3_archive_builder builder, const char *path, const char *mime_type, int64_t modtime, const void *data, size_t length, sf3_crc32_checksum checksum);
+
+  /// Appends a member with the contents of the file behind FD.
+  ///
+  /// This is like sf3_archive_builder_add, except that the contents
+  /// are streamed from the whole file behind FD, regardless of its
+  /// current position, without holding them in memory at once.
+  SF3_EXPORT int sf3_archive_builder_add_fd(sf3_archive_builder builder, const char *path, const char *mime_type, int64_t modtime, int fd);
+
+  /// Writes the archive tables and header and closes the builder.
+  ///
+  /// The builder is freed regardless of whether this succeeds. On
+  /// failure the output file is deleted.
+  SF3_EXPORT int sf3_archive_builder_finish(sf3_archive_builder builder);
+
+  /// Discards the builder and deletes the partially written file.
+  SF3_EXPORT void sf3_archive_builder_abort(sf3_archive_builder builder);
+
+  /// Builds a table to look up archive members by their path.
+  ///
+  /// All paths are hashed once, so that sf3_archive_find only needs
+  /// to compare the paths of members whose hash matches. The index
+  /// refers to ARCHIVE, which must stay valid for as long as the index
+  /// is used. If several members share a path, the first one is found.
+  /// Archives with 2^32-1 or more members are not supported.
+  ///
+  /// The index can be saved with sf3_archive_index_save and mapped
+  /// back in with sf3_archive_index_load to skip building it again.
+  ///
+  /// See sf3_archive_index_free
+  SF3_EXPORT int sf3_archive_index_build(const struct sf3_archive *archive, sf3_archive_index *index);
+
+  /// Maps an index saved with sf3_archive_index_save from PATH.
+  ///
+  /// The index is checked against the checksum and member count of
+  /// ARCHIVE, and if it was built for a different archive, or on a
+  /// machine of different byte order, this fails with
+  /// SF3_INVALID_FILE, in which case it should be built anew.
+  SF3_EXPORT int sf3_archive_index_load(const struct sf3_archive *archive, const char *path, sf3_archive_index *index);
+
+  /// Saves the index to a sidecar file at PATH.
+  ///
+  /// The file is replaced atomically, so indexes that are currently
+  /// loaded from it remain intact.
+  SF3_EXPORT int sf3_archive_index_save(sf3_archive_index index, const char *path);
+
+  /// Returns the index of the archive member with the given PATH, or
+  /// -1 if there is none.
+  ///
+  /// This may be called from many threads at once.
+  SF3_EXPORT int64_t sf3_archive_find(sf3_archive_index index, const char *path);
+
+  /// Releases the index.
+  SF3_EXPORT void sf3_archive_index_free(sf3_archive_index index);
+
+  /// Verifies the checksum of a single archive member.
+  ///
+  /// HANDLE must hold an archive. Unlike sf3_verify, this only reads
+  /// the member at INDEX. The outcome is remembered in the handle, so
+  /// each member is only checked once, no matter how often this is
+  /// called, though threads racing on the same member may both check
+  /// it. Writing to the handle through sf3_mark_dirty or resizing it
+  /// discards the remembered outcomes.
+  ///
+  /// Returns 1 if the member is intact. If it is not, or does not
+  /// lie within the file, this fails with SF3_CHECKSUM_MISMATCH.
+  /// This may be called from many threads at once.
+  SF3_EXPORT int sf3_archive_verify_member(sf3_handle handle, uint64_t index);
+
+  /// Verifies the checksums of all archive members on up to THREADS
+  /// threads, or as many as there are CPUs if THREADS is zero. The
+  /// threads are started for this call and joined before it returns.
+  ///
+  /// Members already checked through sf3_archive_verify_member are
+  /// not checked again, and the outcomes for the others are
+  /// remembered in the same way. COUNT must point to the number of
+  /// entries that fit into CORRUPT. The indices of the corrupt
+  /// members are stored into CORRUPT, and COUNT is set to the total
+  /// number of corrupt members, which may be larger than the number
+  /// of stored indices. CORRUPT may be null if the indices are not
+  /// needed.
+  ///
+  /// Returns 1 if all members are intact, and fails with
+  /// SF3_CHECKSUM_MISMATCH otherwise.
+  SF3_EXPORT int sf3_archive_verify_all(sf3_handle handle, unsigned int threads, uint64_t *corrupt, size_t *count);
+
+  /// Opens the archive member at INDEX as an SF3 file of its own.
+  ///
+  /// The new handle refers to the member's bytes within HANDLE's
+  /// memory, so nothing is copied and no file is opened. It is
+  /// read-only and has no file descriptor. The member is checked
+  /// with sf3_check, but not verified.
+  ///
+  /// The member handle keeps HANDLE alive: HANDLE may be closed
+  /// before the member handle, in which case its memory is released
+  /// once the member handle is closed as well. While member handles
+  /// are open, HANDLE cannot be resized or sealed.
+  ///
+  /// Returns the sf3_format_id of the member, or zero if it is not an
+  /// SF3 file, in which case this fails with SF3_INVALID_FILE.
+  SF3_EXPORT int sf3_archive_open_member(sf3_handle handle, uint64_t index, sf3_handle *member);
+
+  /// Creates an empty stack of archives that paths are resolved
+  /// against, such as a base archive with patches on top.
+  ///
+  /// See sf3_overlay_push
+  /// See sf3_overlay_find
+  /// See sf3_overlay_list
+  SF3_EXPORT int sf3_overlay_create(sf3_overlay *overlay);
+
+  /// Adds ARCHIVE as the new topmost layer of the overlay.
+  ///
+  /// Members of the new layer shadow members of the same path in the
+  /// layers below. INDEX may be an index for ARCHIVE, such as one
+  /// loaded with sf3_archive_index_load, which the overlay then takes
+  /// ownership of, or null to build one. The archive must stay valid
+  /// for as long as the overlay is used.
+  ///
+  /// This must not be called while other threads use the overlay.
+  SF3_EXPORT int sf3_overlay_push(sf3_overlay overlay, const struct sf3_archive *archive, sf3_archive_index index);
+
+  /// Returns the number of layers in the overlay.
+  SF3_EXPORT size_t sf3_overlay_layers(sf3_overlay overlay);
+
+  /// Resolves PATH to the member in the topmost layer that has it.
+  ///
+  /// Returns the member's contents, which point straight into the
+  /// archive, or null if no layer has the path. If ENTRY is not
+  /// null, it is filled with the details of the member.
+  ///
+  /// Each layer keeps a Bloom filter of its paths, so layers that do
+  /// not have the path are usually skipped without a lookup, and the
+  /// winning layer for a path is remembered in a cache. This may be
+  /// called from many threads at once.
+  SF3_EXPORT const struct sf3_file *sf3_overlay_find(sf3_overlay overlay, const char *path, struct sf3_overlay_entry *entry);
+
+  /// Lists the visible members whose path starts with PREFIX.
+  ///
+  /// CALLBACK is called for each member in the order of their paths,
+  /// with members shadowed by higher layers left out. If it returns
+  /// zero the listing stops. PREFIX may be null to list everything.
+  /// Returns the number of members passed to CALLBACK.
+  SF3_EXPORT size_t sf3_overlay_list(sf3_overlay overlay, const char *prefix, int (*callback)(const struct sf3_overlay_entry *entry, void *user), void *user);
+
+  /// Releases the overlay and the indexes of its layers. The archives
+  /// themselves are left alone.
+  SF3_EXPORT void sf3_overlay_free(sf3_overlay overlay);
+
+  /// Creates a new log file at PATH that entries can be appended to
+  /// from any number of threads at once.
+  ///
+  /// START is the time of the log's start in seconds since the UNIX
+  /// epoch, or zero for the current time. Entries are stored in
+  /// chunks of CHUNK_SIZE bytes, or 1MiB if zero, each of which holds
+  /// up to CHUNK_ENTRIES entries, or one per 128 bytes if zero. No
+  /// single entry may be larger than a chunk.
+  ///
+  /// Appending threads claim space in the current chunk without
+  /// taking any locks. Only when a chunk is full is a new one added
+  /// to the end of the file. Entries are visible to readers of the
+  /// file once the chunk is full, or after sf3_log_writer_flush.
+  ///
+  /// The file is only complete and its checksum only correct once
+  /// sf3_log_writer_close has been called.
+  ///
+  /// This is only available on systems with mmap, and fails with
+  /// SF3_MMAP_FAILED elsewhere.
+  ///
+  /// See sf3_log_append
+  /// See sf3_log_writer_flush
+  /// See sf3_log_writer_close
+  SF3_EXPORT int sf3_log_writer_create(const char *path, int64_t start, size_t chunk_size, uint32_t chunk_entries, sf3_log_writer *writer);
+
+  /// Appends an entry with the current time to the log.
+  ///
+  /// The strings are copied and may be freed once this returns. The
+  /// source and category may be at most 254 bytes long, the message
+  /// at most 65534 bytes. This may be called from any number of
+  /// threads at once.
+  ///
+  /// Entries of a log are ordered by time. Entries appended at the
+  /// same time by different threads may be stored in either order,
+  /// in which case the later one's time is moved forward to match.
+  SF3_EXPORT int sf3_log_append(sf3_log_writer writer, int8_t severity, const char *source, const char *category, const char *message);
+
+  /// Appends an entry at TIME milliseconds since the log's start.
+  ///
+  /// Times should not decrease between appends. An entry that is
+  /// earlier than the one before it is stored with the earlier
+  /// entry's time instead.
+  ///
+  /// See sf3_log_append
+  SF3_EXPORT int sf3_log_append_at(sf3_log_writer writer, uint64_t time, int8_t severity, const char *source, const char *category, const char *message);
+
+  /// Makes all entries that are completely written visible to readers
+  /// of the file.
+  ///
+  /// Entries that other threads are still in the middle of appending
+  /// are skipped, along with all entries after them.
+  SF3_EXPORT int sf3_log_writer_flush(sf3_log_writer writer);
+
+  /// Completes the log file and frees the writer.
+  ///
+  /// This waits for appends that are still in progress, trims the
+  /// last chunk, sets the end time of the log and its checksum. No
+  /// other thread may be appending to the log once this is called.
+  SF3_EXPORT int sf3_log_writer_close(sf3_log_writer writer);
+
+  /// Builds a table to look up the entries of LOG by their time.
+  ///
+  /// The index records the time range of every chunk, so that
+  /// sf3_log_query can skip chunks that lie outside of the requested
+  /// range, and binary search within the others. Entries within a
+  /// chunk must be ordered by time, as written by sf3_log_writer.
+  /// Chunks may be in any order, though queries are fastest if they
+  /// follow each other in time as well. The index refers to LOG,
+  /// which must stay valid and must not grow while the index is used.
+  ///
+  /// See sf3_log_index_free
+  SF3_EXPORT int sf3_log_index_build(const struct sf3_log *log, sf3_log_index *index);
+
+  /// Calls CALLBACK for every entry whose time lies in [FROM, TO),
+  /// in milliseconds since the log's start.
+  ///
+  /// Entries are passed in the order of the chunks, and by time
+  /// within each chunk. If CALLBACK returns zero the query stops.
+  /// Returns the number of entries passed to CALLBACK. This may be
+  /// called from many threads at once.
+  SF3_EXPORT size_t sf3_log_query(sf3_log_index index, uint64_t from, uint64_t to, int (*callback)(const struct sf3_log_entry *entry, void *user), void *user);
+
+  /// Releases the index.
+  SF3_EXPORT void sf3_log_index_free(sf3_log_index index);
+
+  /// Compiles the description of a filter for log entries.
+  ///
+  /// The strings of SPEC are copied, so SPEC does not need to outlive
+  /// the filter. Sources and categories are compared exactly, and
+  /// may be at most 254 bytes long. The message is searched for with
+  /// the widest SIMD instructions the machine supports.
+  ///
+  /// See sf3_log_filter_run
+  /// See sf3_log_filter_free
+  SF3_EXPORT int sf3_log_filter_compile(const struct sf3_log_filter_spec *spec, sf3_log_filter *filter);
+
+  /// Runs the filter over every entry of LOG.
+  ///
+  /// The chunks of the log are distributed over up to THREADS
+  /// threads, or one per CPU if zero, which are started for this call
+  /// and joined before it returns. The result records which
+  /// entries of each chunk matched, and must be freed with
+  /// sf3_log_matches_free. A filter may be run from many threads at
+  /// once.
+  ///
+  /// See sf3_log_matches_chunk
+  SF3_EXPORT int sf3_log_filter_run(sf3_log_filter filter, const struct sf3_log *log, unsigned int threads, sf3_log_matches *matches);
+
+  /// Releases the filter.
+  SF3_EXPORT void sf3_log_filter_free(sf3_log_filter filter);
+
+  /// Returns the total number of entries that matched.
+  SF3_EXPORT size_t sf3_log_matches_count(sf3_log_matches matches);
+
+  /// Returns the bitmap of the matching entries of the chunk at index
+  /// CHUNK in the log.
+  ///
+  /// Bit E%64 of word E/64 is set if entry E of the chunk matched.
+  /// If COUNT is not null, it is set to the number of entries of the
+  /// chunk that matched.
+  SF3_EXPORT const uint64_t *sf3_log_matches_chunk(sf3_log_matches matches, uint16_t chunk, uint32_t *count);
+
+  /// Releases the matches.
+  SF3_EXPORT void sf3_log_matches_free(sf3_log_matches matches);
+
+  /// Merges the entries of COUNT logs into a new log at PATH, ordered
+  /// by time.
+  ///
+  /// The merged log starts at the earliest start of the inputs, and
+  /// the times of all entries are rebased onto it. Entries at the
+  /// same time are taken from the inputs in the order they are given.
+  /// The entries of each input are expected to be ordered by time.
+  /// CHUNK_SIZE and CHUNK_ENTRIES size the chunks of the merged log as
+  /// for sf3_log_writer_create.
+  ///
+  /// The inputs are read as the merge progresses, so if they are
+  /// mapped files, only a few pages of each need to be in memory at a
+  /// time. On failure the output file is deleted.
+  SF3_EXPORT int sf3_log_merge(const struct sf3_log **logs, size_t count, const char *path, size_t chunk_size, uint32_t chunk_entries);
+
+  /// Opens the log at PATH to read its entries as they are written.
+  ///
+  /// The follower starts at the first entry of the log, and remembers
+  /// the position of the last entry it delivered, so that every entry
+  /// is delivered exactly once. It sees the entries that an
+  /// sf3_log_writer has made visible.
+  ///
+  /// This is only available on systems with mmap, and fails with
+  /// SF3_MMAP_FAILED elsewhere.
+  ///
+  /// A typical loop over a log that is still written looks like this:
+  ///
+  ///   for(;;){
+  ///     int closed = sf3_log_follow_closed(follower);
+  ///     while((entry = sf3_log_follow_next(follower))) ...;
+  ///     if(closed) break;
+  ///     sf3_log_follow_wait(follower, -1);
+  ///   }
+  ///
+  /// See sf3_log_follow_next
+  /// See sf3_log_follow_wait
+  /// See sf3_log_follow_close
+  SF3_EXPORT int sf3_log_follow(const char *path, sf3_log_follower *follower);
+
+  /// Returns the next entry of the log, or null if no new entry has
+  /// been written yet.
+  ///
+  /// The file is mapped anew when it has grown, so the entry is only
+  /// valid until the next call to any sf3_log_follow function.
+  SF3_EXPORT const struct sf3_log_entry *sf3_log_follow_next(sf3_log_follower follower);
+
+  /// Waits until the log file changes, or TIMEOUT milliseconds pass.
+  /// A negative TIMEOUT waits indefinitely.
+  ///
+  /// Returns immediately if there already is an entry to read. The
+  /// file is watched with inotify where available, and polled at the
+  /// given timeout, or every second, elsewhere. Returns zero if the
+  /// timeout passed without a change.
+  SF3_EXPORT int sf3_log_follow_wait(sf3_log_follower follower, int timeout);
+
+  /// Returns the log header as it currently stands. The pointer is
+  /// only valid until the next call to any sf3_log_follow function.
+  SF3_EXPORT const struct sf3_log *sf3_log_follow_log(sf3_log_follower follower);
+
+  /// Returns whether the writer has closed the log. Entries that were
+  /// written before checking this can still be read after.
+  SF3_EXPORT int sf3_log_follow_closed(sf3_log_follower follower);
+
+  /// Releases the follower and closes the file.
+  SF3_EXPORT void sf3_log_follow_close(sf3_log_follower follower);
+
+  /// Creates a bump allocator that serves allocations from blocks
+  /// of BLOCK_SIZE octets.
+  ///
+  /// Allocating from an arena only moves a pointer forward, and
+  /// releasing individual allocations does nothing. Instead all
+  /// memory is reclaimed at once with sf3_arena_reset or
+  /// sf3_arena_destroy. Allocations larger than a block get a block
+  /// of their own. If BLOCK_SIZE is zero, a default is used.
+  ///
+  /// Arenas are not thread-safe. Give each thread its own arena
+  /// instead, which also avoids contention on the global allocator.
+  ///
+  /// See sf3_arena_allocator
+  SF3_EXPORT int sf3_arena_create(size_t block_size, sf3_arena *arena);
+
+  /// Fills ALLOCATOR so that it allocates from the arena.
+  SF3_EXPORT void sf3_arena_allocator(sf3_arena arena, struct sf3_allocator *allocator);
+
+  /// Reclaims all memory allocated from the arena at once.
+  ///
+  /// Any memory previously returned by the arena must no longer be
+  /// used afterwards, including handles opened with its allocator.
+  SF3_EXPORT void sf3_arena_reset(sf3_arena arena);
+
+  /// Frees the arena and all memory allocated from it.
+  SF3_EXPORT void sf3_arena_destroy(sf3_arena arena);
+
 #ifdef SF3_NO_CUSTOM_ALLOCATOR
 #define sf3_calloc calloc
+#define sf3_malloc malloc
 #define sf3_free free
 #else
   /// Allocates a new block of memory.
@@ -139,6 +1045,15 @@ extern "C" {
   /// overlap with any other allocated memory regions.
   SF3_EXPORT extern void *(*sf3_calloc)(size_t num, size_t size);
 
+  /// Allocates a new block of memory without clearing it.
+  ///
+  /// This is used for buffers that are overwritten right away, such
+  /// as when reading files in. sf3_malloc must return either 0 or a
+  /// pointer to a memory region that is size octets large, under the
+  /// same conditions as sf3_calloc, but the contents of the region
+  /// may be anything. The region must be releasable with sf3_free.
+  SF3_EXPORT extern void *(*sf3_malloc)(size_t size);
+
   /// Releases a previously allocated region of memory.
   ///
   /// The behaviour is undefined if a pointer is passed to this function
@@ -67,7 +67,7 @@ SF3_INLINE const struct sf3_log_entry *sf3_log_next_entry(const struct sf3_log_e
 
 /// Returns the first entry of the chunk.
 SF3_INLINE const struct sf3_log_entry *sf3_log_first_entry(const struct sf3_log_chunk *chunk){
-  return (const struct sf3_log_entry*)chunk->entry_offset+chunk->entry_count;
+  return (const struct sf3_log_entry*)(((char*)chunk)+chunk->entry_offset[0]);
 }
 
 /// Returns the log entry at the requested index.
@@ -103,7 +103,7 @@ SF3_INLINE uint32_t sf3_log_chunk_remaining(const struct sf3_log_chunk *chunk){
 SF3_EXPORT size_t sf3_log_size(const struct sf3_log *log){
   if(log->chunk_count == 0) return sizeof(struct sf3_log);
   const struct sf3_log_chunk *last = &log->chunks[0];
-  for(uint16_t i=0; i<=log->chunk_count; ++i){
+  for(uint16_t i=0; i<log->chunk_count; ++i){
     last = sf3_log_next_chunk(last);
   }
   const void *start = (const void *)log;
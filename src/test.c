@@ -1,9 +1,1528 @@
 #define SF3_NO_CUSTOM_ALLOCATOR
 #include "sf3_lib.h"
 #include "sf3_lib.c"
+#include <dirent.h>
 
+int test_crc32_kernels(){
+  const enum sf3_crc32_kernel kernels[] = {SF3_CRC32_SLICE8, SF3_CRC32_SLICE16, SF3_CRC32_PCLMUL, SF3_CRC32_AUTO};
+  const char *names[] = {"slice8", "slice16", "pclmul", "auto"};
+  const size_t sizes[] = {0, 1, 7, 8, 15, 16, 17, 63, 64, 65, 127, 128, 129, 255, 1000, 4096, 65536+13};
+  int ok = 1;
+
+  if(sf3_compute_checksum("123456789", 9) != 0xCBF43926){
+    fprintf(stderr, "CRC32 check value mismatch!\n");
+    ok = 0;
+  }
+
+  size_t max = 65536+13+16;
+  uint8_t *buffer = calloc(1, max);
+  uint32_t seed = 0x5F3A1C07;
+  for(size_t i=0; i<max; ++i){
+    seed = seed * 1103515245 + 12345;
+    buffer[i] = seed >> 24;
+  }
+
+  for(size_t k=0; k<sizeof(kernels)/sizeof(kernels[0]); ++k){
+    if(!sf3_crc32_kernel_supported(kernels[k])){
+      fprintf(stderr, "CRC32 kernel %s not supported, skipping.\n", names[k]);
+      continue;
+    }
+    for(size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); ++s){
+      for(size_t offset=0; offset<16; offset+=5){
+        sf3_crc32_checksum expected = sf3_compute_checksum_with(SF3_CRC32_BYTEWISE, buffer+offset, sizes[s]);
+        sf3_crc32_checksum actual = sf3_compute_checksum_with(kernels[k], buffer+offset, sizes[s]);
+        if(expected != actual){
+          fprintf(stderr, "CRC32 kernel %s mismatch at size %lu offset %lu: %08x vs %08x\n",
+                  names[k], sizes[s], offset, actual, expected);
+          ok = 0;
+        }
+      }
+    }
+  }
+  free(buffer);
+  return ok;
+}
+
+int test_crc32_combine(){
+  int ok = 1;
+  size_t size = 3*VERIFY_MIN_BLOCK+4321;
+  uint8_t *buffer = calloc(1, size);
+  for(size_t i=0; i<size; ++i){
+    buffer[i] = (uint8_t)(i * 2654435761u >> 13);
+  }
+
+  const size_t splits[] = {0, 1, 17, 4096, size/2, size-1, size};
+  sf3_crc32_checksum expected = sf3_compute_checksum(buffer, size);
+  for(size_t s=0; s<sizeof(splits)/sizeof(splits[0]); ++s){
+    sf3_crc32_checksum a = sf3_compute_checksum(buffer, splits[s]);
+    sf3_crc32_checksum b = sf3_compute_checksum(buffer+splits[s], size-splits[s]);
+    if(sf3_crc32_combine(a, b, size-splits[s]) != expected){
+      fprintf(stderr, "CRC32 combine mismatch at split %lu\n", splits[s]);
+      ok = 0;
+    }
+  }
+
+  sf3_write_header(SF3_FORMAT_ID_TEXT, buffer, size);
+  for(unsigned int threads=0; threads<=4; ++threads){
+    if(sf3_verify_parallel(buffer, size, threads) != sf3_verify(buffer, size)){
+      fprintf(stderr, "Parallel verify mismatch with %u threads\n", threads);
+      ok = 0;
+    }
+  }
+  buffer[size/2] ^= 1;
+  if(sf3_verify_parallel(buffer, size, 4) != 0){
+    fprintf(stderr, "Parallel verify failed to detect corruption\n");
+    ok = 0;
+  }
+  free(buffer);
+  return ok;
+}
+
+void *make_text(const char *string, size_t *size){
+  uint64_t length = strlen(string)+1;
+  *size = sizeof(struct sf3_text)+sizeof(uint64_t)+length;
+  struct sf3_text *text = calloc(1, *size);
+  char *base = (char *)text->markup;
+  memcpy(base, &length, sizeof(uint64_t));
+  memcpy(base+sizeof(uint64_t), string, length);
+  sf3_write_header(SF3_FORMAT_ID_TEXT, text, *size);
+  return text;
+}
+
+int test_write(){
+  int ok = 1;
+  const char *path = "sf3_tester_write.txt.sf3";
+  size_t size;
+  void *text = make_text("The quick brown fox jumps over the lazy dog.", &size);
+  sf3_handle handle, reopened;
+
+  struct sf3_crc32_state crc;
+  const uint8_t *payload = (const uint8_t *)text+sizeof(struct sf3_identifier);
+  sf3_crc32_init(&crc);
+  for(size_t i=0; i<size-sizeof(struct sf3_identifier); i+=7){
+    size_t chunk = size-sizeof(struct sf3_identifier)-i;
+    sf3_crc32_update(&crc, payload+i, (chunk < 7)? chunk : 7);
+  }
+  if(sf3_crc32_final(&crc) != ((struct sf3_identifier *)text)->checksum){
+    fprintf(stderr, "Incremental CRC32 mismatch\n");
+    ok = 0;
+  }
+
+  sf3_create(text, size, &handle);
+  if(!sf3_write(path, handle)){
+    fprintf(stderr, "Failed to write %s: %s\n", path, sf3_strerror(-1));
+    ok = 0;
+  }else if(!sf3_open(path, SF3_OPEN_READ_ONLY, &reopened)){
+    fprintf(stderr, "Failed to reopen %s: %s\n", path, sf3_strerror(-1));
+    ok = 0;
+  }else{
+    size_t written_size;
+    void *written = sf3_data(reopened, &written_size);
+    if(written_size != size || !sf3_verify(written, written_size) || memcmp(written, text, size) != 0){
+      fprintf(stderr, "Written file does not match\n");
+      ok = 0;
+    }
+    sf3_close(reopened);
+  }
+  sf3_close(handle);
+  unlink(path);
+  free(text);
+  return ok;
+}
+
+int test_mark_dirty(){
+  int ok = 1;
+  const char *path = "sf3_tester_dirty.txt.sf3";
+  size_t size;
+  char *text = make_text("Lorem ipsum dolor sit amet, consectetur adipiscing elit.", &size);
+  sf3_handle handle;
+  sf3_create(text, size, &handle);
+  sf3_write(path, handle);
+  sf3_close(handle);
+  free(text);
+
+  if(!sf3_open(path, SF3_OPEN_READ_WRITE, &handle)){
+    fprintf(stderr, "Failed to open %s: %s\n", path, sf3_strerror(-1));
+    return 0;
+  }
+  char *data = sf3_data(handle, &size);
+  char *string = (char *)sf3_text_string((struct sf3_text *)data);
+  size_t offset = string-data;
+  sf3_mark_dirty(handle, offset+6, 5);
+  memcpy(string+6, "IPSUM", 5);
+  sf3_mark_dirty(handle, offset+8, 6);
+  memcpy(string+8, "sum do", 6);
+  sf3_mark_dirty(handle, offset+28, 4);
+  memcpy(string+28, "CONS", 4);
+  sf3_mark_dirty(handle, offset+27, 1);
+  string[27] = '_';
+  if(!sf3_write(NULL, handle)){
+    fprintf(stderr, "Failed to flush %s: %s\n", path, sf3_strerror(-1));
+    ok = 0;
+  }
+  sf3_close(handle);
+
+  if(!sf3_open(path, SF3_OPEN_READ_ONLY, &handle)){
+    fprintf(stderr, "Failed to reopen %s: %s\n", path, sf3_strerror(-1));
+    ok = 0;
+  }else{
+    data = sf3_data(handle, &size);
+    if(!sf3_verify(data, size)){
+      fprintf(stderr, "Incremental checksum does not match\n");
+      ok = 0;
+    }
+    if(strcmp(sf3_text_string((struct sf3_text *)data), "Lorem IPsum dolor sit amet,_CONSectetur adipiscing elit.") != 0){
+      fprintf(stderr, "Edit was not flushed\n");
+      ok = 0;
+    }
+    sf3_close(handle);
+  }
+  unlink(path);
+  return ok;
+}
+
+int test_tell(){
+  int ok = 1;
+  const char *paths[] = {"sf3_tester_tell.txt.sf3", "sf3_tester_missing.sf3", "sf3_tester_tell.txt.sf3"};
+  int ids[3];
+  size_t size;
+  void *text = make_text("Hello", &size);
+  sf3_handle handle;
+  sf3_create(text, size, &handle);
+  sf3_write(paths[0], handle);
+  sf3_close(handle);
+  free(text);
+
+  if(sf3_tell(paths[0]) != SF3_FORMAT_ID_TEXT || sf3_tell(paths[1]) != 0){
+    fprintf(stderr, "sf3_tell returned the wrong format\n");
+    ok = 0;
+  }
+  if(sf3_tell_many(paths, 3, ids, 2) != 2 || ids[0] != SF3_FORMAT_ID_TEXT || ids[1] != 0 || ids[2] != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "sf3_tell_many returned the wrong formats\n");
+    ok = 0;
+  }
+  unlink(paths[0]);
+  return ok;
+}
+
+int test_advise(){
+  int ok = 1;
+  const char *path = "sf3_tester_advise.txt.sf3";
+  size_t size;
+  void *text = make_text("Hello", &size);
+  sf3_handle handle;
+  sf3_create(text, size, &handle);
+  sf3_write(path, handle);
+  sf3_close(handle);
+  free(text);
+
+  if(!sf3_open(path, SF3_OPEN_READ_ONLY | SF3_OPEN_SEQUENTIAL | SF3_OPEN_POPULATE | SF3_OPEN_HUGEPAGES, &handle)){
+    fprintf(stderr, "Failed to open %s with hints: %s\n", path, sf3_strerror(-1));
+    ok = 0;
+  }else{
+    if(!sf3_advise(handle, 3, 10, SF3_ADVISE_RANDOM) || !sf3_advise(handle, 0, -1, SF3_ADVISE_WILLNEED)){
+      fprintf(stderr, "Failed to advise: %s\n", sf3_strerror(-1));
+      ok = 0;
+    }
+    size_t data_size;
+    void *data = sf3_data(handle, &data_size);
+    if(!sf3_verify(data, data_size)){
+      fprintf(stderr, "File opened with hints does not verify\n");
+      ok = 0;
+    }
+    sf3_close(handle);
+  }
+  unlink(path);
+  return ok;
+}
+
+int test_section_range(){
+  int ok = 1;
+  // A table with a single uint32 column named "id" and four rows.
+  size_t spec_length = sizeof(struct sf3_column_spec)+3;
+  size_t size = sizeof(struct sf3_table)+spec_length+4*sizeof(uint32_t);
+  struct sf3_table *table = calloc(1, size);
+  table->column_count = 1;
+  table->row_length = sizeof(uint32_t);
+  table->row_count = 4;
+  table->spec_length = spec_length;
+  table->columns[0].length = sizeof(uint32_t);
+  table->columns[0].type = SF3_COLUMN_UINT32;
+  table->columns[0].name.length = 3;
+  memcpy(table->columns[0].name.str, "id", 3);
+  sf3_write_header(SF3_FORMAT_ID_TABLE, table, size);
+
+  size_t offset, length;
+  size_t data = sf3_table_data(table) - (const char *)table;
+  if(!sf3_section_range(table, size, SF3_SECTION_TABLE_ROWS, 1, 2, &offset, &length)
+     || offset != data+sizeof(uint32_t) || length != 2*sizeof(uint32_t)){
+    fprintf(stderr, "Wrong table row section range\n");
+    ok = 0;
+  }
+  if(!sf3_section_range(table, size, SF3_SECTION_TABLE_ROWS, 3, -1, &offset, &length)
+     || offset+length != size){
+    fprintf(stderr, "Wrong clamped table row section range\n");
+    ok = 0;
+  }
+  if(!sf3_section_range(table, size, SF3_SECTION_TABLE_SPEC, 0, 0, &offset, &length)
+     || offset != sizeof(struct sf3_table) || length != spec_length){
+    fprintf(stderr, "Wrong table spec section range\n");
+    ok = 0;
+  }
+  if(sf3_section_range(table, size, SF3_SECTION_MODEL_FACES, 0, 0, &offset, &length)
+     || sf3_error() != SF3_INVALID_SECTION){
+    fprintf(stderr, "Model section accepted for a table\n");
+    ok = 0;
+  }
+  free(table);
+  return ok;
+}
+
+#if defined(HAVE_IO_URING)
+struct engine_hand_over{
+  struct engine *engine;
+  struct engine_job *job;
+};
+
+static void *engine_hand_over_later(void *data){
+  struct engine_hand_over *hand_over = (struct engine_hand_over *)data;
+  struct timespec delay = {0, 50*1000*1000};
+  nanosleep(&delay, 0);
+  engine_ring_done(hand_over->engine, hand_over->job);
+  return 0;
+}
+#endif
+
+int test_engine(){
+  int ok = 1;
+  const char *paths[] = {"sf3_tester_engine.txt.sf3", "sf3_tester_missing.sf3", "sf3_tester_corrupt.txt.sf3"};
+  enum sf3_error expected[] = {SF3_OK, SF3_OPEN_FAILED, SF3_CHECKSUM_MISMATCH};
+  size_t size;
+  void *text = make_text("Hello", &size);
+  sf3_handle handle;
+  sf3_create(text, size, &handle);
+  sf3_write(paths[0], handle);
+  ((char *)text)[size-1] ^= 0xFF;
+  sf3_write(paths[2], handle);
+  sf3_close(handle);
+  free(text);
+  // sf3_write recomputes the checksum, so corrupt the file afterwards.
+  FILE *file = fopen(paths[2], "r+b");
+  fseek(file, -1, SEEK_END);
+  fputc('!', file);
+  fclose(file);
+
+  for(int flags=0; flags<=SF3_ENGINE_NO_IO_URING; ++flags){
+    sf3_engine engine;
+    if(!sf3_engine_create(2, 4, flags, &engine)){
+      fprintf(stderr, "Failed to create engine: %s\n", sf3_strerror(sf3_error()));
+      ok = 0;
+      continue;
+    }
+    for(int i=0; i<12; ++i)
+      sf3_engine_submit(engine, paths[i%3], (void *)(intptr_t)(i%3));
+    struct sf3_engine_result results[12];
+    size_t done = 0, count;
+    while((count = sf3_engine_complete(engine, results+done, 12-done, 1)))
+      done += count;
+    if(done != 12){
+      fprintf(stderr, "Engine returned %zu of 12 results\n", done);
+      ok = 0;
+    }
+    for(size_t i=0; i<done; ++i){
+      int index = (int)(intptr_t)results[i].user;
+      if(results[i].error != expected[index]
+         || results[i].format_id != ((index == 0)? SF3_FORMAT_ID_TEXT : 0)){
+        fprintf(stderr, "Engine returned the wrong result for %s (%s): %s\n", paths[index],
+                sf3_engine_uses_io_uring(engine)? "io_uring" : "threads", sf3_strerror(results[i].error));
+        ok = 0;
+      }
+    }
+    sf3_engine_destroy(engine);
+  }
+
+#if defined(HAVE_IO_URING)
+  // Break the ring behind the engine's back. The jobs that were on it
+  // fail, and the workers have to take over all others.
+  sf3_engine engine;
+  sf3_engine_create(2, 4, 0, &engine);
+  if(sf3_engine_uses_io_uring(engine)){
+    int null = open("/dev/null", O_RDONLY);
+    dup2(null, ((struct engine *)engine)->ring.fd);
+    close(null);
+    for(int round=0; round<2; ++round){
+      for(int i=0; i<12; ++i)
+        sf3_engine_submit(engine, paths[i%3], (void *)(intptr_t)(i%3));
+      struct sf3_engine_result results[12];
+      size_t done = 0, count;
+      while(done < 12 && (count = sf3_engine_complete(engine, results+done, 12-done, 1)))
+        done += count;
+      for(size_t i=0; i<done; ++i){
+        int index = (int)(intptr_t)results[i].user;
+        if(results[i].error != expected[index] && (round == 1 || results[i].error != SF3_OPEN_FAILED)){
+          fprintf(stderr, "Engine returned the wrong result for %s after the ring failed: %s\n",
+                  paths[index], sf3_strerror(results[i].error));
+          ok = 0;
+        }
+      }
+      if(done != 12 || sf3_engine_uses_io_uring(engine)){
+        fprintf(stderr, "Engine did not recover from a failed ring\n");
+        ok = 0;
+      }
+    }
+  }
+  sf3_engine_destroy(engine);
+
+  // Without any workers, waiting for a result has to verify what the
+  // ring hands over in the meantime. Stop the workers, and stand in
+  // for the ring, so that the job only arrives once we are waiting.
+  sf3_engine_create(2, 4, 0, &engine);
+  if(sf3_engine_uses_io_uring(engine)){
+    struct engine *e = (struct engine *)engine;
+    mutex_lock(&e->lock);
+    e->closing = 1;
+    cond_broadcast(&e->work_available);
+    mutex_unlock(&e->lock);
+    thread_join(e->io_thread);
+    for(unsigned int i=0; i<e->thread_count; ++i)
+      thread_join(e->threads[i]);
+    e->thread_count = 0;
+    e->closing = 0;
+    thread_start(&e->io_thread, engine_io_thread, e);
+
+    struct engine_job *job = (struct engine_job *)sf3_calloc(1, sizeof(struct engine_job));
+    job->path = (char *)sf3_calloc(1, strlen(paths[0])+1);
+    strcpy(job->path, paths[0]);
+    job->fd = -1;
+    mutex_lock(&e->lock);
+    e->outstanding++;
+    mutex_unlock(&e->lock);
+    struct engine_hand_over hand_over = {e, job};
+    thread_t ring;
+    thread_start(&ring, engine_hand_over_later, &hand_over);
+    struct sf3_engine_result result;
+    if(sf3_engine_complete(engine, &result, 1, 1) != 1 || result.format_id != SF3_FORMAT_ID_TEXT){
+      fprintf(stderr, "Engine without workers did not verify the ring's job\n");
+      ok = 0;
+    }
+    thread_join(ring);
+  }
+  sf3_engine_destroy(engine);
+#endif
+  unlink(paths[0]);
+  unlink(paths[2]);
+  return ok;
+}
+
+int write_text(const char *path, const char *string){
+  size_t size;
+  void *text = make_text(string, &size);
+  sf3_handle handle;
+  sf3_create(text, size, &handle);
+  int ok = sf3_write(path, handle);
+  sf3_close(handle);
+  free(text);
+  return ok;
+}
+
+struct cache_test{
+  sf3_cache cache;
+  const char *path;
+  int failed;
+};
+
+static void cache_test_open(size_t index, void *data){
+  struct cache_test *test = (struct cache_test *)data;
+  (void)index;
+  for(int i=0; i<100; ++i){
+    sf3_handle handle;
+    if(sf3_cache_open(test->cache, test->path, &handle) != SF3_FORMAT_ID_TEXT){
+      test->failed = 1;
+      return;
+    }
+    size_t size;
+    void *addr = sf3_data(handle, &size);
+    if(!sf3_verify(addr, size)) test->failed = 1;
+    sf3_close(handle);
+  }
+}
+
+// Keeps changing the file's modification time, so that the entries
+// the other threads are opening and closing go stale under them.
+static void cache_test_touch(size_t index, void *data){
+  struct cache_test *test = (struct cache_test *)data;
+  if(index != 0){
+    cache_test_open(index, data);
+    return;
+  }
+  for(int i=0; i<100; ++i){
+    struct timespec times[2] = {{0, UTIME_OMIT}, {1000000+i, i}};
+    utimensat(AT_FDCWD, test->path, times, 0);
+    sf3_handle handle;
+    if(sf3_cache_open(test->cache, test->path, &handle) != SF3_FORMAT_ID_TEXT){
+      test->failed = 1;
+      return;
+    }
+    sf3_close(handle);
+  }
+}
+
+int test_cache(){
+  int ok = 1;
+  const char *path = "sf3_tester_cache.txt.sf3";
+  struct sf3_cache_stats stats;
+  sf3_cache cache;
+  sf3_handle a, b, c;
+  write_text(path, "Hello");
+  sf3_cache_create(0, &cache);
+  sf3_cache_open(cache, path, &a);
+  sf3_cache_open(cache, path, &b);
+  sf3_cache_stats(cache, &stats);
+  if(a != b || stats.hits != 1 || stats.misses != 1 || stats.entries != 1){
+    fprintf(stderr, "Cache did not share the handle\n");
+    ok = 0;
+  }
+  sf3_close(a);
+  sf3_close(b);
+
+  // Changing the file has to invalidate the idle entry.
+  write_text(path, "Hello there");
+  sf3_cache_open(cache, path, &c);
+  size_t size;
+  sf3_data(c, &size);
+  sf3_cache_stats(cache, &stats);
+  if(stats.misses != 2 || stats.entries != 1 || stats.mapped_bytes != size){
+    fprintf(stderr, "Cache did not invalidate the changed file\n");
+    ok = 0;
+  }
+
+  struct cache_test test = {cache, path, 0};
+  parallel_for(8, 8, cache_test_open, &test);
+  if(test.failed){
+    fprintf(stderr, "Concurrent cache opens failed\n");
+    ok = 0;
+  }
+  parallel_for(8, 8, cache_test_touch, &test);
+  if(test.failed){
+    fprintf(stderr, "Concurrent cache opens of a changing file failed\n");
+    ok = 0;
+  }
+  sf3_cache_destroy(cache);
+  // The handle must outlive the cache.
+  void *data = sf3_data(c, &size);
+  if(!sf3_verify(data, size)){
+    fprintf(stderr, "Cached handle did not survive the cache\n");
+    ok = 0;
+  }
+  sf3_close(c);
+
+  sf3_cache_create(1, &cache);
+  sf3_cache_open(cache, path, &a);
+  sf3_close(a);
+  sf3_cache_stats(cache, &stats);
+  if(stats.entries != 0 || stats.mapped_bytes != 0 || stats.evictions != 1){
+    fprintf(stderr, "Cache did not evict over budget\n");
+    ok = 0;
+  }
+  sf3_cache_destroy(cache);
+  unlink(path);
+  return ok;
+}
+int test_verify_file(){
+  int ok = 1;
+  const char *path = "sf3_tester_verify.txt.sf3";
+  const int flags = SF3_VERIFY_CACHED | SF3_VERIFY_SIDECAR;
+  write_text(path, "Hello");
+  if(sf3_verify_file(path, flags) != SF3_FORMAT_ID_TEXT
+     || sf3_verify_file(path, flags) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Failed to verify the file\n");
+    ok = 0;
+  }
+
+  // Corrupt the payload behind the cache's back by restoring the
+  // modification time, which the cached verify can't tell apart.
+  struct stat before;
+  stat(path, &before);
+  FILE *file = fopen(path, "r+b");
+  fseek(file, -1, SEEK_END);
+  fputc('!', file);
+  fclose(file);
+  struct timespec times[2] = {before.st_atim, before.st_mtim};
+  utimensat(AT_FDCWD, path, times, 0);
+  if(sf3_verify_file(path, flags) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Verification record was not used\n");
+    ok = 0;
+  }
+  if(sf3_verify_file(path, 0) != 0 || sf3_error() != SF3_CHECKSUM_MISMATCH){
+    fprintf(stderr, "Uncached verify missed the corruption\n");
+    ok = 0;
+  }
+
+  // A regular write has to invalidate the record.
+  write_text(path, "Hello there");
+  file = fopen(path, "r+b");
+  fseek(file, -1, SEEK_END);
+  fputc('!', file);
+  fclose(file);
+  if(sf3_verify_file(path, flags) != 0){
+    fprintf(stderr, "Stale verification record was used\n");
+    ok = 0;
+  }
+  unlink(path);
+  unlink("sf3_tester_verify.txt.sf3.sf3-verified");
+  return ok;
+}
+int test_write_atomic(){
+  int ok = 1;
+  const char *path = "sf3_tester_atomic.txt.sf3";
+  const char *copy = "sf3_tester_atomic_copy.txt.sf3";
+  size_t size;
+  void *text = make_text("Hello", &size);
+  sf3_handle handle;
+  sf3_create(text, size, &handle);
+  // Write twice, so that the second has to replace the first.
+  if(!sf3_write_atomic(path, handle) || !sf3_write_atomic(path, handle)){
+    fprintf(stderr, "Failed to write atomically: %s\n", sf3_strerror(sf3_error()));
+    ok = 0;
+  }
+  sf3_close(handle);
+  free(text);
+
+  // Writing from a file-backed handle can copy within the kernel.
+  if(sf3_open(path, SF3_OPEN_READ_ONLY, &handle)){
+    if(!sf3_write_atomic(copy, handle)){
+      fprintf(stderr, "Failed to write a file-backed handle atomically\n");
+      ok = 0;
+    }
+    sf3_close(handle);
+  }
+  if(sf3_verify_file(path, 0) != SF3_FORMAT_ID_TEXT || sf3_verify_file(copy, 0) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Atomic write produced an invalid file\n");
+    ok = 0;
+  }
+
+#if defined(HAVE_STAT_H)
+  // New files get the usual permissions, replaced ones keep theirs.
+  struct stat info;
+  mode_t mask = umask(022);
+  umask(mask);
+  if(stat(copy, &info) != 0 || (info.st_mode & 07777) != (0666 & ~mask)){
+    fprintf(stderr, "Atomic write created a file with mode %o\n", (unsigned)(info.st_mode & 07777));
+    ok = 0;
+  }
+  chmod(path, 0640);
+  if(sf3_open(copy, SF3_OPEN_READ_ONLY, &handle)){
+    sf3_write_atomic(path, handle);
+    sf3_close(handle);
+  }
+  if(stat(path, &info) != 0 || (info.st_mode & 07777) != 0640){
+    fprintf(stderr, "Atomic write changed the mode of the file it replaced to %o\n", (unsigned)(info.st_mode & 07777));
+    ok = 0;
+  }
+#endif
+
+  // A header that claims more than the handle holds must not be read
+  // past its end.
+  text = make_text("Hello", &size);
+  sf3_create(text, size, &handle);
+  struct sf3_text *data = (struct sf3_text *)sf3_data(handle, 0);
+  ((sf3_str64 *)((char *)data->markup + data->markup_size))->length += 1024*1024;
+  if(sf3_write_atomic(path, handle) || sf3_error() != SF3_INVALID_FILE){
+    fprintf(stderr, "Atomic write accepted a header larger than its handle\n");
+    ok = 0;
+  }
+  sf3_close(handle);
+  free(text);
+
+  DIR *dir = opendir(".");
+  struct dirent *entry;
+  while(dir && (entry = readdir(dir))){
+    if(strncmp(entry->d_name, path, strlen(path)) == 0 && strlen(path) < strlen(entry->d_name)){
+      fprintf(stderr, "Atomic write left %s behind\n", entry->d_name);
+      ok = 0;
+    }
+  }
+  if(dir) closedir(dir);
+  unlink(path);
+  unlink(copy);
+  return ok;
+}
+int test_resize(){
+  int ok = 1;
+  const char *path = "sf3_tester_resize.txt.sf3";
+  write_text(path, "Hello");
+  sf3_handle handle;
+  size_t size, original;
+  sf3_open(path, SF3_OPEN_READ_WRITE, &handle);
+  void *addr = sf3_data(handle, &original);
+  if(!sf3_reserve(handle, 16) || sf3_data(handle, &size) != addr || size != original){
+    fprintf(stderr, "Reserving less than the size changed the handle\n");
+    ok = 0;
+  }
+  if(!sf3_reserve(handle, 1024*1024)){
+    fprintf(stderr, "Failed to reserve: %s\n", sf3_strerror(sf3_error()));
+    ok = 0;
+  }
+  uint8_t *data = sf3_data(handle, &size);
+  if(size != 1024*1024 || data[size-1] != 0 || !sf3_verify(data, original)){
+    fprintf(stderr, "Reserved mapping has the wrong contents\n");
+    ok = 0;
+  }
+  data[size-1] = 0xFF;
+  if(!sf3_resize(handle, original) || !sf3_write(0, handle)){
+    fprintf(stderr, "Failed to shrink: %s\n", sf3_strerror(sf3_error()));
+    ok = 0;
+  }
+  sf3_close(handle);
+
+  struct stat stat_buf;
+  stat(path, &stat_buf);
+  if((size_t)stat_buf.st_size != original || sf3_verify_file(path, 0) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Resized file is invalid\n");
+    ok = 0;
+  }
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  if(sf3_reserve(handle, 1024*1024) || sf3_error() != SF3_INVALID_HANDLE){
+    fprintf(stderr, "Read-only handle was resized\n");
+    ok = 0;
+  }
+  sf3_close(handle);
+  unlink(path);
+  return ok;
+}
+int test_arena(){
+  int ok = 1;
+  const char *path = "sf3_tester_arena.txt.sf3";
+  write_text(path, "Hello");
+  sf3_arena arena;
+  struct sf3_allocator allocator;
+  sf3_arena_create(256, &arena);
+  sf3_arena_allocator(arena, &allocator);
+
+  uint8_t *a = allocator.allocate(allocator.user, 3, 1);
+  uint8_t *b = allocator.allocate(allocator.user, 1000, 1);
+  if(!a || !b || ((uintptr_t)a % 16) || ((uintptr_t)b % 16) || b[999] != 0){
+    fprintf(stderr, "Arena returned bad allocations\n");
+    ok = 0;
+  }
+  sf3_handle handle;
+  size_t size;
+  int type = sf3_open_with(path, SF3_OPEN_READ_WRITE, &allocator, &handle);
+  void *data = sf3_data(handle, &size);
+  if(type != SF3_FORMAT_ID_TEXT || !sf3_verify(data, size)
+     || !sf3_mark_dirty(handle, sizeof(struct sf3_identifier), 1)){
+    fprintf(stderr, "Failed to open with an arena allocator\n");
+    ok = 0;
+  }
+  sf3_close(handle);
+  sf3_arena_reset(arena);
+  uint8_t *c = allocator.allocate(allocator.user, 16, 1);
+  if(!c){
+    fprintf(stderr, "Arena failed to allocate after a reset\n");
+    ok = 0;
+  }
+  sf3_arena_destroy(arena);
+  unlink(path);
+  return ok;
+}
+int test_shared(){
+  int ok = 1;
+  size_t size;
+  void *text = make_text("Hello", &size);
+  sf3_handle shared, received;
+  if(!sf3_create_shared(size+128, &shared)){
+    fprintf(stderr, "Failed to create a shared file: %s\n", sf3_strerror(sf3_error()));
+    free(text);
+    return 0;
+  }
+  memcpy(sf3_data(shared, 0), text, size);
+  if(sf3_seal(shared) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Failed to seal the shared file: %s\n", sf3_strerror(sf3_error()));
+    ok = 0;
+  }
+  int fd = sf3_fd(shared);
+  size_t shared_size;
+  sf3_data(shared, &shared_size);
+  if(shared_size != size){
+    fprintf(stderr, "Shared file was not cut down\n");
+    ok = 0;
+  }
+#if defined(HAVE_MEMFD_CREATE)
+  if(0 < pwrite(fd, "!", 1, size-1)){
+    fprintf(stderr, "Shared file was not sealed\n");
+    ok = 0;
+  }
+#endif
+  if(sf3_open_fd(fd, SF3_OPEN_READ_ONLY, &received) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Failed to open the shared file: %s\n", sf3_strerror(sf3_error()));
+    ok = 0;
+  }else{
+    sf3_close(received);
+  }
+  sf3_close(shared);
+
+#if defined(HAVE_MEMFD_CREATE)
+  // A sealed file still has to hold as much as its header claims.
+  fd = memfd_create("sf3_tester", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd != -1){
+    if(write(fd, text, size-1) != (ssize_t)(size-1)
+       || fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW) != 0){
+      fprintf(stderr, "Failed to prepare a short sealed file\n");
+      ok = 0;
+    }else if(sf3_open_fd(fd, SF3_OPEN_READ_ONLY, &received) || sf3_error() != SF3_INVALID_FILE){
+      fprintf(stderr, "Short sealed file was accepted\n");
+      ok = 0;
+    }
+    close(fd);
+  }
+#endif
+
+  // Unsealed descriptors have to be verified.
+  const char *path = "sf3_tester_fd.txt.sf3";
+  write_text(path, "Hello");
+  fd = open(path, O_RDWR);
+  if(sf3_open_fd(fd, SF3_OPEN_READ_ONLY, &received) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Failed to open a file descriptor\n");
+    ok = 0;
+  }else{
+    sf3_close(received);
+  }
+  pwrite(fd, "!", 1, size-1);
+  if(sf3_open_fd(fd, SF3_OPEN_READ_ONLY, &received) || sf3_error() != SF3_CHECKSUM_MISMATCH){
+    fprintf(stderr, "Corrupted file descriptor was accepted\n");
+    ok = 0;
+  }
+  close(fd);
+  unlink(path);
+  free(text);
+  return ok;
+}
+int test_archive_builder(){
+  int ok = 1;
+  const char *path = "sf3_tester_builder.ar.sf3";
+  const char *member = "sf3_tester_member.txt.sf3";
+  const char *contents[] = {"Hello", "", "A somewhat longer third member"};
+  write_text(member, "Member");
+  // A tiny reserve forces the payloads to be shifted on finish.
+  for(size_t reserve=16; reserve<=4096; reserve+=4080){
+    sf3_archive_builder builder;
+    sf3_arena arena;
+    struct sf3_allocator allocator;
+    sf3_arena_create(0, &arena);
+    sf3_arena_allocator(arena, &allocator);
+    sf3_archive_builder_create(path, reserve, &allocator, &builder);
+    for(int i=0; i<3; ++i){
+      char name[32];
+      sprintf(name, "dir/file-%d.txt", i);
+      size_t length = strlen(contents[i]);
+      if(i == 2)
+        sf3_archive_builder_add_checksummed(builder, name, "text/plain", 1000+i, contents[i], length,
+                                            sf3_compute_checksum(contents[i], length));
+      else
+        sf3_archive_builder_add(builder, name, "text/plain", 1000+i, contents[i], length);
+    }
+    int fd = open(member, O_RDONLY);
+    sf3_archive_builder_add_fd(builder, "member.sf3", 0, 42, fd);
+    close(fd);
+    if(!sf3_archive_builder_finish(builder)){
+      fprintf(stderr, "Failed to build the archive: %s\n", sf3_strerror(sf3_error()));
+      ok = 0;
+    }
+    sf3_arena_destroy(arena);
+
+    sf3_handle handle;
+    size_t size;
+    if(!sf3_open(path, SF3_OPEN_READ_ONLY, &handle)){
+      fprintf(stderr, "Failed to open the built archive\n");
+      ok = 0;
+      continue;
+    }
+    const struct sf3_archive *archive = sf3_data(handle, &size);
+    if(!sf3_verify(archive, size) || archive->count != 4 || sf3_archive_size(archive) != size){
+      fprintf(stderr, "Built archive is invalid\n");
+      ok = 0;
+    }
+    for(uint64_t i=0; i<archive->count && i<4; ++i){
+      const struct sf3_archive_meta *meta = sf3_archive_meta_entry(archive, i);
+      const struct sf3_file *file = sf3_archive_file(archive, i);
+      if(meta->checksum != sf3_compute_checksum(file->data, file->length)){
+        fprintf(stderr, "Archive member %d has the wrong checksum\n", (int)i);
+        ok = 0;
+      }
+      if(i < 3 && (file->length != strlen(contents[i]) || memcmp(file->data, contents[i], file->length)
+                   || meta->modtime != 1000+(int64_t)i
+                   || strcmp(sf3_archive_meta_mime_type(meta), "text/plain"))){
+        fprintf(stderr, "Archive member %d has the wrong contents\n", (int)i);
+        ok = 0;
+      }
+      if(i == 3 && (!sf3_verify(file->data, file->length)
+                    || strcmp(sf3_archive_meta_path(meta), "member.sf3")
+                    || strcmp(sf3_archive_meta_mime_type(meta), "application/octet-stream"))){
+        fprintf(stderr, "Archive member from a descriptor is wrong\n");
+        ok = 0;
+      }
+    }
+    sf3_close(handle);
+  }
+  unlink(path);
+  unlink(member);
+  return ok;
+}
+
+int test_archive_index(){
+  int ok = 1;
+  const char *path = "sf3_tester_index.ar.sf3";
+  const char *sidecar = "sf3_tester_index.ar.sf3-index";
+  sf3_archive_builder builder;
+  sf3_archive_builder_create(path, 0, 0, &builder);
+  for(int i=0; i<500; ++i){
+    char name[32];
+    sprintf(name, "dir-%d/file-%d", i%7, i);
+    sf3_archive_builder_add(builder, name, 0, 0, name, strlen(name));
+  }
+  sf3_archive_builder_add(builder, "dir-0/file-0", 0, 0, "duplicate", 9);
+  if(!sf3_archive_builder_finish(builder)){
+    fprintf(stderr, "Failed to build the archive to index\n");
+    return 0;
+  }
+
+  sf3_handle handle;
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  const struct sf3_archive *archive = sf3_data(handle, 0);
+  sf3_archive_index index;
+  if(!sf3_archive_index_build(archive, &index)){
+    fprintf(stderr, "Failed to build the archive index: %s\n", sf3_strerror(sf3_error()));
+    sf3_close(handle);
+    return 0;
+  }
+  for(int pass=0; pass<2; ++pass){
+    for(int i=0; i<500; ++i){
+      char name[32];
+      sprintf(name, "dir-%d/file-%d", i%7, i);
+      if(sf3_archive_find(index, name) != i){
+        fprintf(stderr, "Index did not find %s\n", name);
+        ok = 0;
+        break;
+      }
+    }
+    if(sf3_archive_find(index, "dir-0/file-500") != -1 || sf3_archive_find(index, "") != -1){
+      fprintf(stderr, "Index found a missing path\n");
+      ok = 0;
+    }
+    // Switch to the sidecar for the second pass.
+    if(pass == 0){
+      if(!sf3_archive_index_save(index, sidecar)){
+        fprintf(stderr, "Failed to save the archive index\n");
+        ok = 0;
+      }
+      sf3_archive_index_free(index);
+      if(!sf3_archive_index_load(archive, sidecar, &index)){
+        fprintf(stderr, "Failed to load the archive index: %s\n", sf3_strerror(sf3_error()));
+        sf3_close(handle);
+        unlink(path);
+        unlink(sidecar);
+        return 0;
+      }
+    }
+  }
+  sf3_archive_index_free(index);
+  sf3_close(handle);
+
+  // The sidecar must not be accepted for a different archive.
+  sf3_archive_builder_create(path, 0, 0, &builder);
+  sf3_archive_builder_add(builder, "other", 0, 0, "other", 5);
+  sf3_archive_builder_finish(builder);
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  if(sf3_archive_index_load(sf3_data(handle, 0), sidecar, &index) || sf3_error() != SF3_INVALID_FILE){
+    fprintf(stderr, "Stale archive index was accepted\n");
+    ok = 0;
+  }
+  sf3_close(handle);
+
+  // An empty table would turn every lookup into a read out of bounds.
+  sf3_archive_builder_create(path, 0, 0, &builder);
+  sf3_archive_builder_finish(builder);
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  archive = sf3_data(handle, 0);
+  struct archive_index_header header = {0};
+  memcpy(header.magic, ARCHIVE_INDEX_MAGIC, sizeof(header.magic));
+  header.version = ARCHIVE_INDEX_VERSION;
+  header.checksum = archive->identifier.checksum;
+  FILE *file = fopen(sidecar, "wb");
+  fwrite(&header, sizeof(header), 1, file);
+  fclose(file);
+  if(sf3_archive_index_load(archive, sidecar, &index) || sf3_error() != SF3_INVALID_FILE){
+    fprintf(stderr, "Archive index without slots was accepted\n");
+    ok = 0;
+  }
+  // Nor may a capacity so large that the size of its table wraps.
+  header.capacity = (uint64_t)1 << 61;
+  file = fopen(sidecar, "wb");
+  fwrite(&header, sizeof(header), 1, file);
+  fclose(file);
+  if(sf3_archive_index_load(archive, sidecar, &index) || sf3_error() != SF3_INVALID_FILE){
+    fprintf(stderr, "Archive index with an oversized capacity was accepted\n");
+    ok = 0;
+  }
+  sf3_close(handle);
+  unlink(path);
+  unlink(sidecar);
+  return ok;
+}
+
+static int count_overlay_entry(const struct sf3_overlay_entry *entry, void *user){
+  size_t *counts = (size_t *)user;
+  counts[entry->layer]++;
+  return 1;
+}
+
+int test_overlay(){
+  int ok = 1;
+  const char *paths[] = {"sf3_tester_base.ar.sf3", "sf3_tester_patch.ar.sf3"};
+  sf3_archive_builder builder;
+  sf3_archive_builder_create(paths[0], 0, 0, &builder);
+  for(int i=0; i<100; ++i){
+    char name[32];
+    sprintf(name, "a/%03d", i);
+    sf3_archive_builder_add(builder, name, 0, 0, "base", 4);
+  }
+  sf3_archive_builder_add(builder, "x", 0, 0, "base", 4);
+  sf3_archive_builder_finish(builder);
+  sf3_archive_builder_create(paths[1], 0, 0, &builder);
+  sf3_archive_builder_add(builder, "x", 0, 0, "patch", 5);
+  sf3_archive_builder_add(builder, "a/005", 0, 0, "patch", 5);
+  sf3_archive_builder_add(builder, "b/new", 0, 0, "patch", 5);
+  sf3_archive_builder_finish(builder);
+
+  sf3_handle handles[2];
+  sf3_overlay overlay;
+  sf3_overlay_create(&overlay);
+  for(int i=0; i<2; ++i){
+    sf3_open(paths[i], SF3_OPEN_READ_ONLY, &handles[i]);
+    if(!sf3_overlay_push(overlay, sf3_data(handles[i], 0), 0)){
+      fprintf(stderr, "Failed to push an overlay layer: %s\n", sf3_strerror(sf3_error()));
+      ok = 0;
+    }
+  }
+  // Look everything up twice to go through the cache as well.
+  for(int pass=0; pass<2; ++pass){
+    struct sf3_overlay_entry entry;
+    const struct sf3_file *file = sf3_overlay_find(overlay, "x", &entry);
+    if(!file || entry.layer != 1 || file->length != 5 || memcmp(file->data, "patch", 5)){
+      fprintf(stderr, "Overlay did not resolve to the top layer\n");
+      ok = 0;
+    }
+    file = sf3_overlay_find(overlay, "a/006", &entry);
+    if(!file || entry.layer != 0 || entry.index != 6 || strcmp(entry.path, "a/006")){
+      fprintf(stderr, "Overlay did not fall through to the base layer\n");
+      ok = 0;
+    }
+    if(sf3_overlay_find(overlay, "a/100", 0) || sf3_overlay_find(overlay, "b", 0)){
+      fprintf(stderr, "Overlay found a missing path\n");
+      ok = 0;
+    }
+  }
+  size_t counts[2] = {0, 0};
+  if(sf3_overlay_list(overlay, "a/", count_overlay_entry, counts) != 100 || counts[0] != 99 || counts[1] != 1){
+    fprintf(stderr, "Overlay listed the wrong members\n");
+    ok = 0;
+  }
+  if(sf3_overlay_list(overlay, 0, count_overlay_entry, counts) != 102
+     || sf3_overlay_list(overlay, "c", count_overlay_entry, counts) != 0){
+    fprintf(stderr, "Overlay listed the wrong number of members\n");
+    ok = 0;
+  }
+  sf3_overlay_free(overlay);
+  for(int i=0; i<2; ++i){
+    sf3_close(handles[i]);
+    unlink(paths[i]);
+  }
+  return ok;
+}
+
+int test_archive_verify(){
+  int ok = 1;
+  const char *path = "sf3_tester_verify.ar.sf3";
+  size_t big_size = 3*1024*1024+17;
+  char *big = calloc(big_size, 1);
+  for(size_t i=0; i<big_size; ++i) big[i] = (char)(i*7);
+  sf3_archive_builder builder;
+  sf3_archive_builder_create(path, 0, 0, &builder);
+  sf3_archive_builder_add(builder, "a", 0, 0, "first", 5);
+  sf3_archive_builder_add(builder, "b", 0, 0, "second", 6);
+  sf3_archive_builder_add(builder, "empty", 0, 0, "", 0);
+  sf3_archive_builder_add(builder, "big", 0, 0, big, big_size);
+  sf3_archive_builder_add(builder, "c", 0, 0, "third", 5);
+  sf3_archive_builder_finish(builder);
+  free(big);
+
+  // Corrupt the second member and the end of the big one.
+  sf3_handle handle;
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  const struct sf3_archive *archive = sf3_data(handle, 0);
+  off_t second = sf3_archive_file(archive, 1)->data - (const char *)archive;
+  off_t last = sf3_archive_file(archive, 3)->data + big_size-1 - (const char *)archive;
+  sf3_close(handle);
+  int fd = open(path, O_WRONLY);
+  pwrite(fd, "X", 1, second);
+  pwrite(fd, "X", 1, last);
+  close(fd);
+
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  if(!sf3_archive_verify_member(handle, 0) || !sf3_archive_verify_member(handle, 2)){
+    fprintf(stderr, "Intact archive member failed to verify\n");
+    ok = 0;
+  }
+  for(int pass=0; pass<2; ++pass){
+    if(sf3_archive_verify_member(handle, 1) || sf3_error() != SF3_CHECKSUM_MISMATCH){
+      fprintf(stderr, "Corrupt archive member verified\n");
+      ok = 0;
+    }
+  }
+  if(sf3_archive_verify_member(handle, 5) || sf3_error() != SF3_INVALID_ARGUMENT){
+    fprintf(stderr, "Verified an archive member out of range\n");
+    ok = 0;
+  }
+  for(int pass=0; pass<2; ++pass){
+    uint64_t corrupt[1];
+    size_t count = 1;
+    if(sf3_archive_verify_all(handle, 4, corrupt, &count) || count != 2 || corrupt[0] != 1){
+      fprintf(stderr, "Verifying all archive members found the wrong ones\n");
+      ok = 0;
+    }
+  }
+  sf3_close(handle);
+  unlink(path);
+  return ok;
+}
+
+int test_archive_open_member(){
+  int ok = 1;
+  const char *path = "sf3_tester_nested.ar.sf3";
+  size_t size;
+  struct sf3_text *text = make_text("Nested", &size);
+  sf3_archive_builder builder;
+  sf3_archive_builder_create(path, 0, 0, &builder);
+  sf3_archive_builder_add(builder, "plain", 0, 0, "plain", 5);
+  sf3_archive_builder_add(builder, "nested.txt.sf3", 0, 0, text, size);
+  sf3_archive_builder_finish(builder);
+  free(text);
+
+  sf3_handle handle, member, nested;
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  if(sf3_archive_open_member(handle, 0, &member) || sf3_error() != SF3_INVALID_FILE){
+    fprintf(stderr, "Opened a member that is not an SF3 file\n");
+    ok = 0;
+  }
+  if(sf3_archive_open_member(handle, 1, &member) != SF3_FORMAT_ID_TEXT){
+    fprintf(stderr, "Failed to open an archive member: %s\n", sf3_strerror(sf3_error()));
+    sf3_close(handle);
+    unlink(path);
+    return 0;
+  }
+  // The member must stay usable after its archive is closed.
+  sf3_close(handle);
+  size_t member_size;
+  const void *addr = sf3_data(member, &member_size);
+  if(member_size != size || !sf3_verify(addr, member_size)
+     || strcmp(sf3_text_string((const struct sf3_text *)addr), "Nested")
+     || sf3_fd(member) != -1 || sf3_archive_verify_member(member, 0)){
+    fprintf(stderr, "Archive member handle is wrong\n");
+    ok = 0;
+  }
+  sf3_close(member);
+
+  // Members of cached archives hold a reference to the cache entry.
+  sf3_cache cache;
+  sf3_cache_create(0, &cache);
+  sf3_cache_open(cache, path, &handle);
+  sf3_archive_open_member(handle, 1, &nested);
+  sf3_close(handle);
+  addr = sf3_data(nested, &member_size);
+  if(!sf3_verify(addr, member_size)){
+    fprintf(stderr, "Member of a cached archive is wrong\n");
+    ok = 0;
+  }
+  sf3_close(nested);
+  sf3_cache_destroy(cache);
+  unlink(path);
+  return ok;
+}
+
+#if defined(HAVE_LOG_WRITER) && defined(HAVE_THREADS)
+struct log_writer_test{
+  sf3_log_writer writer;
+  int ok;
+};
+
+static void append_log_entries(size_t index, void *data){
+  struct log_writer_test *test = (struct log_writer_test *)data;
+  char message[64];
+  for(int i=0; i<250; ++i){
+    snprintf(message, sizeof(message), "Message %d from %d", i, (int)index);
+    if(!sf3_log_append(test->writer, (int8_t)(i%5-2), "test", (i%2)? "odd" : "even", message))
+      test->ok = 0;
+  }
+}
+#endif
+
+int test_log_writer(){
+#if defined(HAVE_LOG_WRITER) && defined(HAVE_THREADS)
+  int ok = 1;
+  const char *path = "sf3_tester.log.sf3";
+  // Small chunks, so that the threads race over plenty of them, and
+  // tiny ones, so that many of them overflow each chunk at once.
+  size_t chunk_sizes[] = {4096, 512};
+  uint32_t chunk_entries[] = {32, 32};
+  for(int round=0; ok && round<2; ++round){
+    struct log_writer_test test = {0, 1};
+    if(!sf3_log_writer_create(path, 0, chunk_sizes[round], chunk_entries[round], &test.writer)){
+      fprintf(stderr, "Failed to create log writer: %s\n", sf3_strerror(sf3_error()));
+      return 0;
+    }
+    parallel_for(16, 16, append_log_entries, &test);
+    sf3_log_writer_flush(test.writer);
+    if(!test.ok || !sf3_log_writer_close(test.writer)){
+      fprintf(stderr, "Failed to append to log: %s\n", sf3_strerror(sf3_error()));
+      ok = 0;
+    }
+
+    sf3_handle handle;
+    if(sf3_open(path, SF3_OPEN_READ_ONLY, &handle) != SF3_FORMAT_ID_LOG){
+      fprintf(stderr, "Failed to open written log\n");
+      unlink(path);
+      return 0;
+    }
+    size_t size;
+    const struct sf3_log *log = (const struct sf3_log *)sf3_data(handle, &size);
+    if(!sf3_verify(log, size) || sf3_size(&log->identifier) != size || log->end < log->start){
+      fprintf(stderr, "Written log is corrupted\n");
+      ok = 0;
+    }
+    size_t entries = 0;
+    uint64_t last_time = 0;
+    const struct sf3_log_chunk *chunk = &log->chunks[0];
+    for(uint16_t c=0; ok && c<log->chunk_count; ++c){
+      for(uint32_t e=0; e<chunk->entry_count; ++e){
+        const struct sf3_log_entry *entry = sf3_log_entry(chunk, e);
+        if(entry->time < last_time
+           || strcmp(sf3_log_entry_source(entry), "test")
+           || strncmp(sf3_log_entry_message(entry), "Message ", 8)){
+          fprintf(stderr, "Log entry %u of chunk %u is wrong\n", e, c);
+          ok = 0;
+          break;
+        }
+        last_time = entry->time;
+        ++entries;
+      }
+      chunk = sf3_log_next_chunk(chunk);
+    }
+    if(ok && entries != 16*250){
+      fprintf(stderr, "Log has %zu entries rather than %d\n", entries, 16*250);
+      ok = 0;
+    }
+    sf3_close(handle);
+    unlink(path);
+  }
+  return ok;
+#else
+  return 1;
+#endif
+}
+static int count_log_entry(const struct sf3_log_entry *entry, void *user){
+  size_t *count = (size_t *)user;
+  (void)entry;
+  return ++*count < 10;
+}
+
+int test_log_query(){
+#if defined(HAVE_LOG_WRITER)
+  int ok = 1;
+  const char *path = "sf3_tester_query.log.sf3";
+  sf3_log_writer writer;
+  sf3_log_writer_create(path, 1, 1024, 16, &writer);
+  // Two entries at every tenth millisecond.
+  for(uint64_t i=0; i<1000; ++i){
+    sf3_log_append_at(writer, i/2*10, 0, "test", "query", "");
+  }
+  sf3_log_writer_close(writer);
+
+  sf3_handle handle;
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  const struct sf3_log *log = (const struct sf3_log *)sf3_data(handle, 0);
+  sf3_log_index index;
+  if(!sf3_log_index_build(log, &index)){
+    fprintf(stderr, "Failed to build log index: %s\n", sf3_strerror(sf3_error()));
+    sf3_close(handle);
+    unlink(path);
+    return 0;
+  }
+  uint64_t ranges[][3] = {
+    {0, UINT64_MAX, 1000}, {0, 10, 2}, {5, 15, 2}, {10, 11, 2},
+    {995, 2000, 100}, {4990, 5000, 2}, {4991, 5000, 0}, {6000, 7000, 0},
+  };
+  for(size_t r=0; r<sizeof(ranges)/sizeof(ranges[0]); ++r){
+    size_t seen = 0;
+    size_t count = sf3_log_query(index, ranges[r][0], ranges[r][1], count_log_entry, &seen);
+    size_t expected = (ranges[r][2] < 10)? ranges[r][2] : 10;
+    if(count != expected){
+      fprintf(stderr, "Log query [%lu, %lu) returned %zu entries rather than %zu\n",
+              (unsigned long)ranges[r][0], (unsigned long)ranges[r][1], count, expected);
+      ok = 0;
+    }
+  }
+  sf3_log_index_free(index);
+  sf3_close(handle);
+  unlink(path);
+  return ok;
+#else
+  return 1;
+#endif
+}
+int test_log_filter(){
+  int ok = 1;
+  // All search kernels must agree with a plain search at every
+  // alignment and around the register boundaries.
+  char haystack[200];
+  for(size_t i=0; i<sizeof(haystack); ++i) haystack[i] = "abcab"[i%5];
+  haystack[150] = 'x'; haystack[151] = 'y'; haystack[152] = 'z';
+  const char *needles[] = {"ab", "abca", "xyz", "bxyz", "ca", "zz", "bcabcabcabcabcabcabcabcabcabcabcabcx"};
+  for(size_t n=0; n<sizeof(needles)/sizeof(needles[0]); ++n){
+    size_t needle_length = strlen(needles[n]);
+    for(size_t start=0; start<40; ++start){
+      for(size_t length=start; length<=sizeof(haystack); length+=7){
+        int expected = 0;
+        for(size_t i=start; i+needle_length<=length && !expected; ++i)
+          expected = memcmp(haystack+i, needles[n], needle_length) == 0;
+        int found = log_search_scalar(haystack+start, length-start, needles[n], needle_length);
+#if defined(HAVE_SIMD_SEARCH)
+        if(__builtin_cpu_supports("sse2") && log_search_sse2(haystack+start, length-start, needles[n], needle_length) != expected) found = !expected;
+        if(__builtin_cpu_supports("avx2") && log_search_avx2(haystack+start, length-start, needles[n], needle_length) != expected) found = !expected;
+#endif
+        if(found != expected){
+          fprintf(stderr, "Substring search for %s in [%zu, %zu) is wrong\n", needles[n], start, length);
+          ok = 0;
+        }
+      }
+    }
+  }
+
+#if defined(HAVE_LOG_WRITER)
+  const char *path = "sf3_tester_filter.log.sf3";
+  sf3_log_writer writer;
+  sf3_log_writer_create(path, 1, 2048, 16, &writer);
+  char message[64];
+  for(int i=0; i<500; ++i){
+    snprintf(message, sizeof(message), "Request %d took %dms", i, i*7%1000);
+    sf3_log_append_at(writer, i, (int8_t)(i%5-2), (i%3)? "server" : "database", (i%4)? "timing" : "a-rather-long-category", message);
+  }
+  sf3_log_writer_close(writer);
+
+  sf3_handle handle;
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  const struct sf3_log *log = (const struct sf3_log *)sf3_data(handle, 0);
+  const char *sources[] = {"nothing", "database"};
+  const char *categories[] = {"a-rather-long-category"};
+  struct sf3_log_filter_spec specs[] = {
+    {INT8_MIN, 0, 0, 0, 0, 0},
+    {1, 0, 0, 0, 0, 0},
+    {INT8_MIN, sources, 2, 0, 0, 0},
+    {INT8_MIN, 0, 0, categories, 1, 0},
+    {INT8_MIN, 0, 0, 0, 0, "took 7"},
+    {0, sources, 2, categories, 1, "ms"},
+    {INT8_MIN, 0, 0, 0, 0, "Request 500"},
+  };
+  for(size_t f=0; f<sizeof(specs)/sizeof(specs[0]); ++f){
+    sf3_log_filter filter;
+    sf3_log_matches matches;
+    sf3_log_filter_compile(&specs[f], &filter);
+    if(!sf3_log_filter_run(filter, log, 4, &matches)){
+      fprintf(stderr, "Failed to run log filter: %s\n", sf3_strerror(sf3_error()));
+      ok = 0;
+      sf3_log_filter_free(filter);
+      continue;
+    }
+    size_t total = 0;
+    const struct sf3_log_chunk *chunk = &log->chunks[0];
+    for(uint16_t c=0; c<log->chunk_count; ++c){
+      uint32_t count;
+      const uint64_t *bits = sf3_log_matches_chunk(matches, c, &count);
+      for(uint32_t e=0; e<chunk->entry_count; ++e){
+        const struct sf3_log_entry *entry = sf3_log_entry(chunk, e);
+        int i = (int)entry->time;
+        snprintf(message, sizeof(message), "Request %d took %dms", i, i*7%1000);
+        int expected = (int8_t)entry->severity >= specs[f].severity
+          && (!specs[f].source_count || i%3 == 0)
+          && (!specs[f].category_count || i%4 == 0)
+          && (!specs[f].message || strstr(message, specs[f].message));
+        if(!!(bits[e/64] & ((uint64_t)1 << (e%64))) != expected){
+          fprintf(stderr, "Log filter %zu got entry %d wrong\n", f, i);
+          ok = 0;
+        }
+        total += expected;
+      }
+      chunk = sf3_log_next_chunk(chunk);
+    }
+    if(sf3_log_matches_count(matches) != total){
+      fprintf(stderr, "Log filter %zu matched %zu entries rather than %zu\n", f, sf3_log_matches_count(matches), total);
+      ok = 0;
+    }
+    sf3_log_matches_free(matches);
+    sf3_log_filter_free(filter);
+  }
+  sf3_close(handle);
+  unlink(path);
+#endif
+  return ok;
+}
+int test_log_merge(){
+#if defined(HAVE_LOG_WRITER)
+  int ok = 1;
+  const char *paths[] = {"sf3_tester_merge_a.log.sf3", "sf3_tester_merge_b.log.sf3", "sf3_tester_merge_c.log.sf3"};
+  const char *path = "sf3_tester_merged.log.sf3";
+  char source[16];
+  // The logs start a second apart and interleave their entries.
+  for(int l=0; l<3; ++l){
+    sf3_log_writer writer;
+    sf3_log_writer_create(paths[l], 100+l, 1024, 8, &writer);
+    snprintf(source, sizeof(source), "log %d", l);
+    for(int i=0; i<100; ++i){
+      sf3_log_append_at(writer, (uint64_t)i*30, 0, source, "merge", "entry");
+    }
+    sf3_log_writer_close(writer);
+  }
+  sf3_handle handles[3];
+  const struct sf3_log *logs[3];
+  for(int l=0; l<3; ++l){
+    sf3_open(paths[l], SF3_OPEN_READ_ONLY, &handles[l]);
+    logs[l] = (const struct sf3_log *)sf3_data(handles[l], 0);
+  }
+  if(!sf3_log_merge(logs, 3, path, 2048, 0)){
+    fprintf(stderr, "Failed to merge logs: %s\n", sf3_strerror(sf3_error()));
+    ok = 0;
+  }
+  for(int l=0; l<3; ++l){
+    sf3_close(handles[l]);
+    unlink(paths[l]);
+  }
+  if(!ok) return 0;
+
+  sf3_handle handle;
+  size_t size;
+  sf3_open(path, SF3_OPEN_READ_ONLY, &handle);
+  const struct sf3_log *log = (const struct sf3_log *)sf3_data(handle, &size);
+  if(!sf3_verify(log, size) || log->start != 100 || log->end != 105){
+    fprintf(stderr, "Merged log header is wrong\n");
+    ok = 0;
+  }
+  size_t entries = 0;
+  uint64_t last = 0;
+  int last_log = -1;
+  const struct sf3_log_chunk *chunk = &log->chunks[0];
+  for(uint16_t c=0; ok && c<log->chunk_count; ++c){
+    for(uint32_t e=0; e<chunk->entry_count; ++e){
+      const struct sf3_log_entry *entry = sf3_log_entry(chunk, e);
+      int l = sf3_log_entry_source(entry)[4]-'0';
+      // Entries at the same time come in the order of the inputs.
+      if(entry->time < last || (entry->time == last && l < last_log) || entry->time % 30 != (uint64_t)(l*1000) % 30){
+        fprintf(stderr, "Merged log entry %zu is out of order\n", entries);
+        ok = 0;
+        break;
+      }
+      last = entry->time;
+      last_log = l;
+      ++entries;
+    }
+    chunk = sf3_log_next_chunk(chunk);
+  }
+  if(ok && entries != 300){
+    fprintf(stderr, "Merged log has %zu entries rather than 300\n", entries);
+    ok = 0;
+  }
+  sf3_close(handle);
+  unlink(path);
+  return ok;
+#else
+  return 1;
+#endif
+}
+int test_log_follow(){
+#if defined(HAVE_LOG_WRITER) && defined(HAVE_LOG_FOLLOW)
+  int ok = 1;
+  const char *path = "sf3_tester_follow.log.sf3";
+  sf3_log_writer writer;
+  sf3_log_follower follower;
+  sf3_log_writer_create(path, 1, 1024, 8, &writer);
+  if(!sf3_log_follow(path, &follower)){
+    fprintf(stderr, "Failed to follow log: %s\n", sf3_strerror(sf3_error()));
+    sf3_log_writer_close(writer);
+    unlink(path);
+    return 0;
+  }
+  char message[32];
+  int next = 0, written = 0;
+  // Write in bursts that span several chunks, and make sure each
+  // entry is seen exactly once and in order.
+  for(int burst=0; ok && burst<5; ++burst){
+    for(int i=0; i<burst*7; ++i){
+      snprintf(message, sizeof(message), "%d", written);
+      sf3_log_append_at(writer, written++, 0, "test", "follow", message);
+    }
+    sf3_log_writer_flush(writer);
+    if(0 < burst && !sf3_log_follow_wait(follower, 1000)){
+      fprintf(stderr, "Waiting on the followed log timed out\n");
+      ok = 0;
+    }
+    const struct sf3_log_entry *entry;
+    while((entry = sf3_log_follow_next(follower))){
+      if(atoi(sf3_log_entry_message(entry)) != next++){
+        fprintf(stderr, "Followed log entry %d is wrong\n", next-1);
+        ok = 0;
+      }
+    }
+    if(next != written || sf3_log_follow_closed(follower)){
+      fprintf(stderr, "Followed log is at %d rather than %d\n", next, written);
+      ok = 0;
+    }
+  }
+  sf3_log_writer_close(writer);
+  if(!sf3_log_follow_closed(follower) || sf3_log_follow_next(follower)
+     || sf3_log_follow_log(follower)->start != 1){
+    fprintf(stderr, "Followed log did not close\n");
+    ok = 0;
+  }
+  sf3_log_follow_close(follower);
+  unlink(path);
+  return ok;
+#else
+  return 1;
+#endif
+}
 int main(int argc, const char *argv[]){
-  int all_ok = 1;
+  int all_ok = test_crc32_kernels();
+  if(!test_crc32_combine()) all_ok = 0;
+  if(!test_write()) all_ok = 0;
+  if(!test_mark_dirty()) all_ok = 0;
+  if(!test_tell()) all_ok = 0;
+  if(!test_advise()) all_ok = 0;
+  if(!test_section_range()) all_ok = 0;
+  if(!test_engine()) all_ok = 0;
+  if(!test_cache()) all_ok = 0;
+  if(!test_verify_file()) all_ok = 0;
+  if(!test_write_atomic()) all_ok = 0;
+  if(!test_resize()) all_ok = 0;
+  if(!test_arena()) all_ok = 0;
+  if(!test_shared()) all_ok = 0;
+  if(!test_archive_builder()) all_ok = 0;
+  if(!test_archive_index()) all_ok = 0;
+  if(!test_overlay()) all_ok = 0;
+  if(!test_archive_verify()) all_ok = 0;
+  if(!test_archive_open_member()) all_ok = 0;
+  if(!test_log_writer()) all_ok = 0;
+  if(!test_log_query()) all_ok = 0;
+  if(!test_log_filter()) all_ok = 0;
+  if(!test_log_merge()) all_ok = 0;
+  if(!test_log_follow()) all_ok = 0;
   for(int i=1; i<argc; ++i){
     sf3_handle handle;
     const char *path = argv[i];
@@ -0,0 +1,232 @@
+#include "sf3_lib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#  include <sys/sendfile.h>
+#endif
+
+struct unpack{
+  const char *root;
+  const struct sf3_archive *archive;
+  size_t size;
+  // The descriptor of the archive file, which lets the kernel copy
+  // the member contents for us, or -1 if there is none.
+  int fd;
+  uint64_t next;
+  int failed;
+  pthread_mutex_t mutex;
+};
+
+// Rejects paths that would escape the target directory.
+static int safe_path(const char *path){
+  if(path[0] == 0 || path[0] == '/') return 0;
+  const char *part = path;
+  while(1){
+    const char *end = strchr(part, '/');
+    size_t length = (end)? (size_t)(end-part) : strlen(part);
+    if(length == 0 || (length == 2 && part[0] == '.' && part[1] == '.')) return 0;
+    if(!end) return 1;
+    part = end+1;
+  }
+}
+
+// Creates all missing directories leading up to the file at PATH.
+// Other workers may be creating the same directories concurrently.
+static int make_parents(char *path){
+  for(char *slash = strchr(path+1, '/'); slash; slash = strchr(slash+1, '/')){
+    *slash = 0;
+    int result = mkdir(path, 0755);
+    *slash = '/';
+    if(result != 0 && errno != EEXIST) return 0;
+  }
+  return 1;
+}
+
+static int write_all(int fd, const char *data, size_t size){
+  while(0 < size){
+    ssize_t result = write(fd, data, size);
+    if(result < 0){
+      if(errno == EINTR) continue;
+      return 0;
+    }
+    data += result;
+    size -= result;
+  }
+  return 1;
+}
+
+static int copy_contents(struct unpack *unpack, int out, const struct sf3_file *file){
+  uint64_t offset = (const char *)file->data - (const char *)unpack->archive;
+  uint64_t remaining = file->length;
+  if(0 <= unpack->fd){
+    // Let the kernel move the data directly from the archive's page
+    // cache, or share the extents on filesystems that support it.
+#if defined(HAVE_COPY_FILE_RANGE)
+    off_t in = (off_t)offset;
+    while(0 < remaining){
+      ssize_t result = copy_file_range(unpack->fd, &in, out, 0, remaining, 0);
+      if(result <= 0) break;
+      remaining -= result;
+    }
+    offset = (uint64_t)in;
+#endif
+#if defined(__linux__)
+    off_t in_sendfile = (off_t)offset;
+    while(0 < remaining){
+      ssize_t result = sendfile(out, unpack->fd, &in_sendfile, remaining);
+      if(result <= 0) break;
+      remaining -= result;
+    }
+    offset = (uint64_t)in_sendfile;
+#endif
+  }
+  // Fall back to writing out of the mapped archive.
+  return write_all(out, (const char *)unpack->archive+offset, remaining);
+}
+
+static int extract_member(struct unpack *unpack, uint64_t index){
+  const struct sf3_archive_meta *meta = sf3_archive_meta_entry(unpack->archive, index);
+  const struct sf3_file *file = sf3_archive_file(unpack->archive, index);
+  const char *path = sf3_archive_meta_path(meta);
+  const char *end = (const char *)unpack->archive + unpack->size;
+  if((const char *)file->data > end || (uint64_t)(end - (const char *)file->data) < file->length){
+    fprintf(stderr, "Member %s lies outside of the archive\n", path);
+    return 0;
+  }
+  if(!safe_path(path)){
+    fprintf(stderr, "Refusing to extract %s\n", path);
+    return 0;
+  }
+  char full[8192];
+  if(sizeof(full) <= (size_t)snprintf(full, sizeof(full), "%s/%s", unpack->root, path)){
+    fprintf(stderr, "Path too long: %s\n", path);
+    return 0;
+  }
+  // Only create the directories when we find them missing, rather
+  // than paying for a mkdir per path component on every member.
+  int out = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(out < 0 && errno == ENOENT){
+    if(!make_parents(full)){
+      fprintf(stderr, "Failed to create directories for %s: %s\n", full, strerror(errno));
+      return 0;
+    }
+    out = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if(out < 0){
+    fprintf(stderr, "Failed to open %s: %s\n", full, strerror(errno));
+    return 0;
+  }
+  int ok = copy_contents(unpack, out, file);
+  if(!ok){
+    fprintf(stderr, "Failed to write %s: %s\n", full, strerror(errno));
+  }else{
+    struct timespec times[2] = {{meta->modtime, 0}, {meta->modtime, 0}};
+    futimens(out, times);
+  }
+  close(out);
+  return ok;
+}
+
+static void *worker(void *data){
+  struct unpack *unpack = (struct unpack *)data;
+  // Hand out members in small batches to keep contention on the
+  // lock low for archives with many small members.
+  const uint64_t batch = 16;
+  while(1){
+    pthread_mutex_lock(&unpack->mutex);
+    uint64_t start = unpack->next;
+    if(unpack->failed) start = unpack->archive->count;
+    unpack->next = (unpack->archive->count - start < batch)? unpack->archive->count : start+batch;
+    uint64_t end = unpack->next;
+    pthread_mutex_unlock(&unpack->mutex);
+    if(start == end) break;
+    for(uint64_t i=start; i<end; ++i){
+      if(!extract_member(unpack, i)){
+        pthread_mutex_lock(&unpack->mutex);
+        unpack->failed = 1;
+        pthread_mutex_unlock(&unpack->mutex);
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  if(argc<2){
+    fprintf(stderr, "Usage: %s [OPTION...] ARCHIVE [DIRECTORY]\n", argv[0]);
+    fprintf(stderr, "Extract all files from an SF3 archive into DIRECTORY, or the current directory.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -j, --jobs N               write files on N threads\n");
+    fprintf(stderr, "      --no-verify            do not check the archive's checksum first\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Report bugs to https://shirakumo.org/projects/libsf3/\n");
+    return 0;
+  }
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char verify = 1;
+  ++argv; --argc;
+  while(0 < argc && argv[0][0] == '-'){
+    if((strcmp(argv[0], "-j") == 0 || strcmp(argv[0], "--jobs") == 0) && 1 < argc){
+      threads = atol(argv[1]);
+      argv += 2; argc -= 2;
+    }else if(strcmp(argv[0], "--no-verify") == 0){
+      verify = 0;
+      ++argv; --argc;
+    }else{
+      fprintf(stderr, "Unknown option: %s\n", argv[0]);
+      return 1;
+    }
+  }
+  if(argc < 1 || 2 < argc){
+    fprintf(stderr, "Expected an archive and an optional directory.\n");
+    return 1;
+  }
+  if(threads < 1) threads = 1;
+
+  sf3_handle handle;
+  int type = sf3_open(argv[0], SF3_OPEN_READ_ONLY, &handle);
+  if(type == 0){
+    fprintf(stderr, "Failed to open %s: %s\n", argv[0], sf3_strerror(-1));
+    return 1;
+  }
+  struct unpack unpack = {0};
+  unpack.root = (argc == 2)? argv[1] : ".";
+  unpack.archive = sf3_data(handle, &unpack.size);
+  unpack.fd = sf3_fd(handle);
+  if(type != SF3_FORMAT_ID_ARCHIVE){
+    fprintf(stderr, "%s is not an archive\n", argv[0]);
+    sf3_close(handle);
+    return 1;
+  }
+  if(verify && !sf3_verify_parallel(unpack.archive, unpack.size, threads)){
+    fprintf(stderr, "%s is corrupted: the CRC32 checksum does not match\n", argv[0]);
+    sf3_close(handle);
+    return 1;
+  }
+  if(mkdir(unpack.root, 0755) != 0 && errno != EEXIST){
+    fprintf(stderr, "Failed to create %s: %s\n", unpack.root, strerror(errno));
+    sf3_close(handle);
+    return 1;
+  }
+
+  pthread_mutex_init(&unpack.mutex, 0);
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  long started = 0;
+  while(workers && started < threads && pthread_create(&workers[started], 0, worker, &unpack) == 0)
+    ++started;
+  // Do the work ourselves if no thread could be started.
+  if(started == 0) worker(&unpack);
+  for(long i=0; i<started; ++i)
+    pthread_join(workers[i], 0);
+  free(workers);
+  pthread_mutex_destroy(&unpack.mutex);
+  sf3_close(handle);
+  return unpack.failed;
+}
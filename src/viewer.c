@@ -45,6 +45,20 @@ int view_image(struct sf3_image *image){
   return 1;
 }
 
+void view_log_entry(time_t start, const struct sf3_log_entry *entry){
+  char tstamp[128] = {0};
+  time_t time = start + entry->time/1000;
+  uint32_t millis = entry->time % 1000;
+  strftime(tstamp, 32, "%F %T", gmtime(&time));
+  printf(" %s.%03d [%+3d] %s <%s> %s\n",
+         tstamp,
+         millis,
+         entry->severity,
+         sf3_log_entry_source(entry),
+         sf3_log_entry_category(entry),
+         sf3_log_entry_message(entry));
+}
+
 int view_log(struct sf3_log *log){
   time_t start = log->start;
   printf("Start: %s", ctime(&start));
@@ -56,24 +70,38 @@ int view_log(struct sf3_log *log){
     printf("Chunk %d (%lu bytes, %d entries)\n",
            i, chunk->size, chunk->entry_count);
     for(uint32_t e=0; e<chunk->entry_count; ++e){
-      char tstamp[128] = {0};
-      const struct sf3_log_entry *entry = sf3_log_entry(chunk, e);
-      time_t time = start + entry->time/1000;
-      uint32_t millis = entry->time % 1000;
-      strftime(tstamp, 32, "%F %T", gmtime(&time));
-      printf(" %s.%03d [%+3d] %s <%s> %s\n",
-             tstamp,
-             millis,
-             entry->severity,
-             sf3_log_entry_source(entry),
-             sf3_log_entry_category(entry),
-             sf3_log_entry_message(entry));
+      view_log_entry(start, sf3_log_entry(chunk, e));
     }
     chunk = sf3_log_next_chunk(chunk);
   }
   return 1;
 }
 
+int follow_log(const char *path){
+  sf3_log_follower follower;
+  if(!sf3_log_follow(path, &follower)){
+    printf("%s\n", sf3_strerror(-1));
+    return 0;
+  }
+  time_t start = sf3_log_follow_log(follower)->start;
+  printf("Start: %s", ctime(&start));
+  fflush(stdout);
+  for(;;){
+    // Check before reading, so that entries written right before the
+    // log was closed are still printed.
+    int closed = sf3_log_follow_closed(follower);
+    const struct sf3_log_entry *entry;
+    while((entry = sf3_log_follow_next(follower))){
+      view_log_entry(start, entry);
+    }
+    fflush(stdout);
+    if(closed) break;
+    sf3_log_follow_wait(follower, -1);
+  }
+  sf3_log_follow_close(follower);
+  return 1;
+}
+
 int view_model(struct sf3_model *model){
   printf("%d textures, %u faces, %u vertices\n",
          sf3_model_texture_count(model),
@@ -467,11 +495,12 @@ int main(int argc, char *argv[]){
     fprintf(stderr, "  -b, --brief                do not prepend filenames to output lines\n");
     fprintf(stderr, "  -i, --mime                 output MIME type strings\n");
     fprintf(stderr, "      --extension            output a slash-separated list of extensions\n");
+    fprintf(stderr, "  -f, --follow               print entries of logs as they are written, until closed\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Report bugs to https://shirakumo.org/projects/libsf3/\n");
     return 0;
   }
-  char mime=0, ext=0, brief=0;
+  char mime=0, ext=0, brief=0, follow=0;
   ++argv; --argc;
   while(1){
     if(argv[0][0] != '-')break;
@@ -484,6 +513,9 @@ int main(int argc, char *argv[]){
     }else if(strcmp(argv[0], "--extension") == 0){
       ext=1;
       ++argv; --argc;
+    }else if(strcmp(argv[0], "-f") == 0 || strcmp(argv[0], "--follow") == 0){
+      follow=1;
+      ++argv; --argc;
     }else{
       fprintf(stderr, "Unknown option: %s\n", argv[0]);
       return 1;
@@ -500,7 +532,11 @@ int main(int argc, char *argv[]){
       continue;
     }
     addr = sf3_data(handle, &size);
-    if(!mime && !ext){
+    if(!mime && !ext && follow && type == SF3_FORMAT_ID_LOG){
+      // A log that is still being written has no checksum yet.
+      printf("%s file (%s)\n", sf3_kind(type), sf3_mime_type(type));
+      follow_log(argv[i]);
+    }else if(!mime && !ext){
       printf("%s file (%s, %lu bytes)\n", sf3_kind(type), sf3_mime_type(type), size);
       if(!sf3_verify(addr, size)){
         printf("Warning: CRC32 checksum does not match!\n");